@@ -26,6 +26,33 @@
 #include "command.h" /* For struct _psh_command */
 #include "psh.h"
 
+/** @brief Output of a command captured for command substitution. */
+struct _psh_capture
+{
+    /** The captured bytes, always NUL-terminated. Words are split on this
+     * buffer in place, so it is writable even if it is a mapping. */
+    char *data;
+    /** Number of bytes captured, excluding the terminating NUL. */
+    size_t length;
+    /** Length of the mapping if @ref data is mmap()ed, 0 if it is malloc()ed.
+     */
+    size_t mapped;
+};
+
+/** @brief Body of a here-document or here-string being written. */
+struct _psh_heredoc;
+
+/** @brief A bounded set of forked workers. */
+struct _psh_pool;
+
+/** Function run by a worker in the forked child.
+ *
+ * @param state Psh internal state of the child.
+ * @param data What was passed to psh_backend_pool_run().
+ * @return The exit status of the worker.
+ */
+typedef int (*psh_backend_work)(psh_state *state, void *data);
+
 /** The separator between $PATH entries. */
 extern int psh_backend_path_separator;
 
@@ -106,6 +133,12 @@ void psh_backend_get_all_env(psh_state *state);
  */
 int psh_backend_getuid(void);
 
+/** Get the process id of the shell.
+ *
+ * @return PID.
+ */
+int psh_backend_getpid(void);
+
 /** Change working directory.
  *
  * @return Zero if succeeded.
@@ -127,6 +160,49 @@ int psh_backend_getopt(int argc, char **argv, const char *optstring);
  */
 int psh_backend_hup(int pid);
 
+/** Reap children that have exited or stopped since the last call and update
+ * the job table. Must not be called while foreground processes are being
+ * waited for.
+ *
+ * @param state Psh internal state.
+ */
+void psh_backend_reap(psh_state *state);
+
+/** Start watching a child so that psh_backend_wait_children() wakes up as
+ * soon as it exits.
+ *
+ * @param pid Child pid.
+ * @return A handle for psh_backend_unwatch_child(), -1 if the child can only
+ * be noticed through SIGCHLD.
+ */
+int psh_backend_watch_child(int pid);
+
+/** Stop watching a child.
+ *
+ * @param handle Handle from psh_backend_watch_child(), ignored if -1.
+ */
+void psh_backend_unwatch_child(int handle);
+
+/** Sleep until at least one child has exited or stopped, then reap it with
+ * psh_backend_reap().
+ *
+ * @param state Psh internal state.
+ * @return 0, or the number of the signal that interrupted the wait.
+ */
+int psh_backend_wait_children(psh_state *state);
+
+/** Get the wall-clock time.
+ *
+ * @return Microseconds since the Epoch.
+ */
+long long psh_backend_now(void);
+
+/** Close a file descriptor returned by the backend.
+ *
+ * @param fd The file descriptor.
+ */
+void psh_backend_close_fd(int fd);
+
 /** Check if file exists.
  *
  * @param path Path to the file
@@ -134,6 +210,14 @@ int psh_backend_hup(int pid);
  */
 int psh_backend_file_exists(const char *path);
 
+/** Convert a status reported by the wait functions to a shell exit status.
+ *
+ * @param wait_stat The status returned by wait().
+ * @return The exit status, 128 plus the signal number if the process was
+ * killed.
+ */
+int psh_backend_exit_status(int wait_stat);
+
 /** Run a command.
  *
  * @param state Psh internal state.
@@ -142,4 +226,126 @@ int psh_backend_file_exists(const char *path);
  */
 int psh_backend_do_run(psh_state *state, struct _psh_command *command);
 
+/** Run a command with its standard output captured.
+ *
+ * @param state Psh internal state.
+ * @param command The command to run.
+ * @param hint Expected size of the output, used to size the first buffer, 0
+ * if unknown.
+ * @param capture Where the output is stored, release it with
+ * psh_backend_capture_free(). It is empty if reading it failed.
+ * @return The exit status of the command, 1 if its output couldn't be read.
+ */
+int psh_backend_capture(psh_state *state, struct _psh_command *command,
+                        size_t hint, struct _psh_capture *capture);
+
+/** Release the output stored by psh_backend_capture().
+ *
+ * @param capture The captured output.
+ */
+void psh_backend_capture_free(struct _psh_capture *capture);
+
+/** Start a command connected to the shell with a pipe, for process
+ * substitution.
+ *
+ * The command is launched like a pipeline stage and recorded as a job.
+ *
+ * @param state Psh internal state.
+ * @param command The command to run.
+ * @param readable Nonzero for <(command), whose output the shell gets, zero
+ * for >(command), whose input the shell gets.
+ * @param path Where a path naming the shell's end of the pipe is stored.
+ * @param size Size of @p path.
+ * @return The shell's end of the pipe, to be closed with
+ * psh_backend_close_fd(), -1 on error.
+ */
+int psh_backend_procsub(psh_state *state, struct _psh_command *command,
+                        int readable, char *path, size_t size);
+
+/** Start the body of a here-document or here-string.
+ *
+ * @return The body to be filled with psh_backend_heredoc_write().
+ */
+struct _psh_heredoc *psh_backend_heredoc_new(void);
+
+/** Append to the body of a here-document or here-string.
+ *
+ * Small bodies are held in memory, larger ones are written to an anonymous
+ * file as they come, so a long body is never fully buffered.
+ *
+ * @param state Psh internal state.
+ * @param heredoc The body.
+ * @param data The bytes to append.
+ * @param length Number of bytes in @p data.
+ * @return 0 on success, 1 on error.
+ */
+int psh_backend_heredoc_write(psh_state *state, struct _psh_heredoc *heredoc,
+                              const char *data, size_t length);
+
+/** Finish and release a body, making it readable.
+ *
+ * @param state Psh internal state.
+ * @param heredoc The body, which is free()d.
+ * @return A close-on-exec file descriptor from which the body can be read, -1
+ * on error.
+ */
+int psh_backend_heredoc_finish(psh_state *state, struct _psh_heredoc *heredoc);
+
+/** Create a pool of workers.
+ *
+ * @param max Maximum number of workers running at once.
+ * @param ordered Whether the output of each worker is held back until those
+ * started before it have printed theirs, so that it appears in the order the
+ * workers were started.
+ * @return The pool, to be freed by psh_backend_pool_free().
+ */
+struct _psh_pool *psh_backend_pool_new(size_t max, int ordered);
+
+/** Start a worker, first blocking until fewer than the maximum are running.
+ * Workers are jobs of the shell and are reaped through the job table.
+ *
+ * @param state Psh internal state.
+ * @param pool The pool.
+ * @param work What to run in the child.
+ * @param data Passed to @p work, copied by fork().
+ * @param name Name of the job.
+ * @return 0, the number of the signal that interrupted the wait, or -1 if
+ * the worker couldn't be forked. Nothing is started unless 0 is returned.
+ */
+int psh_backend_pool_run(psh_state *state, struct _psh_pool *pool,
+                         psh_backend_work work, void *data,
+                         const char *name);
+
+/** Wait for all workers of a pool.
+ *
+ * @param state Psh internal state.
+ * @param pool The pool.
+ * @return 0, or the number of the signal that interrupted the wait.
+ */
+int psh_backend_pool_finish(psh_state *state, struct _psh_pool *pool);
+
+/** Get the exit statuses of the finished workers of a pool.
+ *
+ * @param pool The pool.
+ * @param count Where to store the number of workers started.
+ * @return Their exit statuses in the order they were started, -1 for those
+ * still running.
+ */
+const int *psh_backend_pool_statuses(const struct _psh_pool *pool,
+                                     size_t *count);
+
+/** Number of workers of a pool that have exited with a non-zero status.
+ *
+ * @param pool The pool.
+ * @return The number of failed workers.
+ */
+size_t psh_backend_pool_failures(const struct _psh_pool *pool);
+
+/** Free a pool, leaving workers still running as ordinary jobs.
+ *
+ * @param pool The pool.
+ */
+void psh_backend_pool_free(struct _psh_pool *pool);
+
+
 #endif /* _PSH_BACKEND_H*/
@@ -39,6 +39,18 @@ int builtin_alias(int argc, char **argv, psh_state *state);
 int builtin_unalias(int argc, char **argv, psh_state *state);
 /** Builtin exec */
 int builtin_exec(int argc, char **argv, psh_state *state);
+/** Builtin cat */
+int builtin_cat(int argc, char **argv, psh_state *state);
+/** Builtin times */
+int builtin_times(int argc, char **argv, psh_state *state);
+/** Builtin tee */
+int builtin_tee(int argc, char **argv, psh_state *state);
+/** Builtin timeout */
+int builtin_timeout(int argc, char **argv, psh_state *state);
+/** Builtin bgsched */
+int builtin_bgsched(int argc, char **argv, psh_state *state);
+/** Builtin xjobs */
+int builtin_xjobs(int argc, char **argv, psh_state *state);
 /** Builtin echo */
 int builtin_echo(int argc, char **argv, psh_state *state);
 /** Builtin exit */
@@ -57,6 +69,12 @@ int builtin_hash(int argc, char **argv, psh_state *state);
 int builtin_help(int argc, char **argv, psh_state *state);
 /** Builtin history */
 int builtin_history(int argc, char **argv, psh_state *state);
+/** Builtin for */
+int builtin_for(int argc, char **argv, psh_state *state);
+/** Builtin jobs */
+int builtin_jobs(int argc, char **argv, psh_state *state);
+/** Builtin wait */
+int builtin_wait(int argc, char **argv, psh_state *state);
 /** Builtin builtin */
 int builtin_builtin(int argc, char **argv, psh_state *state);
 
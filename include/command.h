@@ -21,7 +21,7 @@
 #ifndef _PSH_COMMAND_H
 #define _PSH_COMMAND_H
 
-#include <stdio.h> /* For FILE */
+#include <stddef.h> /* For size_t */
 
 /** @deprecated Maximum characters in a line */
 #define MAXLINE 262144
@@ -78,7 +78,8 @@ struct _psh_redirect
          */
         PSH_REDIR_OPENFN,
         /** Here document and here strings. \n
-         * @ref redirect::rhs::herexx -> @ref redirect::lhs::fd \n
+         * @ref redirect::rhs::fd -> @ref redirect::lhs::fd, where rhs is
+         * the read end of the body \n
          * forms: [n] << delimiter \n
          * [n] <<< string
          * @sa section 2.7.4
@@ -88,12 +89,11 @@ struct _psh_redirect
     /** @brief Right-hand side of this redirection no matter what type it is. */
     union _psh_redir_rhs
     {
-        /** File descripter. */
+        /** File descripter, or the body of here document and here strings.
+         */
         int fd;
         /** File path. */
         char *file;
-        /** Temporary file created to store here document and here strings. */
-        FILE *herexx;
     } rhs; /**< The right operand of this redirection. */
     /** @brief Left-hand side of this redirection no matter what type it is.
      * This side is always the side that needs backing up. */
@@ -104,6 +104,13 @@ struct _psh_redirect
         /** File path. */
         char *file;
     } lhs; /**< The left operand of his redirection. */
+    /** Variable named in {varname}>file, or NULL. If set, @ref lhs is not
+     * used, a new file descriptor is allocated instead and its number stored
+     * in this variable. Such descriptors are not restored afterwards. */
+    char *fd_varname;
+    /** Body of a here-document as written, if it is to be expanded. It is
+     * expanded by psh_expand_command() when the command is run. */
+    char *heredoc;
     /** Next redirection in the chain. */
     struct _psh_redirect *next;
 };
@@ -145,6 +152,25 @@ struct _psh_command
     struct _psh_redirect *rlist;
     /** List of arguments */
     char **argv;
+    /** Number of slots allocated for @ref argv. */
+    size_t argv_slots;
+    /** The shell's ends of process substitutions in @ref argv, closed once
+     * the command has been started. */
+    int *held_fds;
+    /** Number of entries in @ref held_fds. */
+    size_t held_fd_count;
+    /** Set on the first command of a pipeline preceded by the reserved word
+     * time: 1 to report the totals, 2 for `time -v' to report each stage
+     * as well. */
+    int timed;
+    /** For `coproc NAME command', the command to run as a coprocess. The
+     * name is in argv[1]. */
+    struct _psh_command *coproc;
+    /** The text of this command if it has parameters or commands to
+     * substitute. It is parsed again by psh_expand_command() right before
+     * the command is run, and @ref argv and @ref rlist hold it unexpanded
+     * until then. */
+    char *source;
     /** The next command in the list. */
     struct _psh_command *next;
 };
@@ -183,6 +209,26 @@ void command_init(struct _psh_command *command);
  */
 void free_command(struct _psh_command *command);
 
+/** Make sure that argv[@p idx] and its terminating NULL fit in a command.
+ *
+ * @param command Pointer to the command struct.
+ * @param idx Index of the argument about to be written.
+ */
+void command_argv_reserve(struct _psh_command *command, size_t idx);
+
+/** Keep a file descriptor open until the command has been started.
+ *
+ * @param command Pointer to the command struct.
+ * @param fd The file descriptor.
+ */
+void command_hold_fd(struct _psh_command *command, int fd);
+
+/** Close the file descriptors held by a command.
+ *
+ * @param command Pointer to the command struct.
+ */
+void command_release_fds(struct _psh_command *command);
+
 /** Free the argv field of a command struct.
  *
  * @param command Pointer to the redirect struct.
@@ -31,4 +31,15 @@
  * @param command The struct _psh_command to fill.
  * @return The number of characters processed. */
 int filpinfo(psh_state *state, char *buffer, struct _psh_command *command);
+
+/** Substitute the parameters and commands in a command filled by filpinfo(),
+ * and split the results into words. This is done right before the command
+ * is run, so that it sees what the commands before it did. Nothing is done
+ * for commands without substitutions.
+ *
+ * @param state Psh internal state.
+ * @param command The command, not the rest of its list.
+ * @return 0 on success, 1 on errors, which have been reported.
+ */
+int psh_expand_command(psh_state *state, struct _psh_command *command);
 #endif
@@ -31,4 +31,12 @@
  * if anything went wrong, @p result is untouched.
  */
 int read_cmdline(psh_state *state, char *prompt, char **result);
+
+/** Take the next line of the -c string.
+ *
+ * @param state Psh internal state.
+ * @return The line without its newline, to be free()d, or NULL if the string
+ * has been used up.
+ */
+char *read_string_line(psh_state *state);
 #endif
@@ -33,41 +33,234 @@ enum _psh_job_status
     PSH_JOB_DONE
 };
 
+/** @brief Resources used by a finished job. */
+struct _psh_job_usage
+{
+    /** User CPU time in microseconds. */
+    long long user;
+    /** System CPU time in microseconds. */
+    long long sys;
+    /** Maximum resident set size in kilobytes. */
+    long maxrss;
+    /** Blocks read from file systems. */
+    long inblock;
+    /** Blocks written to file systems. */
+    long oublock;
+    /** Voluntary context switches. */
+    long nvcsw;
+    /** Involuntary context switches. */
+    long nivcsw;
+};
+
 /** @brief Psh background jobs. */
 struct _psh_jobs
 {
-    /** Command argv[0]. */
+    /** Command argv[0], those of all the stages of a pipeline joined by
+     * ` | '. */
     char *name;
-    /** Pid of the command. */
+    /** Pid of the command, the last stage of a pipeline. */
     int pid;
+    /** PIDs of all the processes of the job in pipeline order, 0 for those
+     * reaped already. */
+    int *pids;
+    /** Number of entries in @ref pids. */
+    size_t pid_count;
+    /** Number of processes that haven't finished yet. */
+    size_t pids_left;
+    /** Job ID, as in %1. */
+    int id;
     /** Command status. */
     enum _psh_job_status status;
+    /** Status of the last stage once it has finished, which becomes that of
+     * the job when the others have too. */
+    enum _psh_job_status last_status;
     /** Job type. */
     enum _psh_cmd_type type;
     /** Status returned by wait(). */
     int wait_stat;
+    /** Exit status for the shell, valid once done or signaled. */
+    int exit_status;
     /** Signal received. */
     int sig;
     /** Whether the status of this process has been notified. */
     int notified;
-    /** Next ones. */
-    struct _psh_jobs *next;
+    /** Backend handle to wait for the job, -1 if none.
+     * @sa psh_backend_watch_child() */
+    int waitfd;
+    /** When the job was started, from psh_backend_now(). */
+    long long start;
+    /** When the job was reaped, valid once done or signaled. */
+    long long end;
+    /** Resources used, valid once done or signaled. */
+    struct _psh_job_usage usage;
+};
+
+/** @brief Table of jobs, looked up by either job ID or PID in constant
+ * time. */
+struct _psh_job_table
+{
+    /** Jobs indexed by job ID, NULL for unused IDs. Entry 0 is unused. */
+    struct _psh_jobs **by_id;
+    /** Number of slots allocated for @ref by_id. */
+    int slots;
+    /** Highest job ID in use, 0 if there are no jobs. */
+    int max_id;
+    /** Number of jobs. */
+    size_t count;
+    /** Number of jobs still running. */
+    size_t running;
+    /** Number of stopped jobs. */
+    size_t stopped;
+    /** Jobs keyed by their PID in decimal. */
+    psh_hash *by_pid;
+    /** Copies of finished jobs not yet waited for, keyed by their PID in
+     * decimal. */
+    psh_hash *done;
+    /** PIDs in @ref done in the order the jobs finished, a ring of
+     * PSH_JOBS_KEEP_DONE entries. Stale PIDs are skipped. */
+    int *done_order;
+    /** Index of the oldest entry in @ref done_order. */
+    size_t done_first;
+    /** Number of entries in @ref done_order. */
+    size_t done_count;
 };
 
+/** Number of exit statuses of finished jobs remembered for wait. */
+#define PSH_JOBS_KEEP_DONE 1024
+
 /** Add one job.
  *
  * @param state Psh internal state.
  * @param cmd Command name.
  * @param pid Job PID.
  * @param type Job type (pipe or background).
- * @return 0 on success.
+ * @return The job ID.
+ */
+int psh_jobs_add(psh_state *state, const char *cmd, int pid,
+                 enum _psh_cmd_type type);
+
+/** Add a process to a job as the next stage of its pipeline. The job takes
+ * the status of this one from then on, and is finished once all of them
+ * have.
+ *
+ * @param state Psh internal state.
+ * @param id The job ID, from psh_jobs_add().
+ * @param cmd Command name.
+ * @param pid PID of the process.
+ */
+void psh_jobs_add_stage(psh_state *state, int id, const char *cmd, int pid);
+
+/** Find a job by PID.
+ *
+ * @param state Psh internal state.
+ * @param pid Job PID.
+ * @return The job, NULL if there is none.
+ */
+struct _psh_jobs *psh_jobs_get_pid(psh_state *state, int pid);
+
+/** Find a job by job ID.
+ *
+ * @param state Psh internal state.
+ * @param id Job ID.
+ * @return The job, NULL if there is none.
+ */
+struct _psh_jobs *psh_jobs_get_id(psh_state *state, int id);
+
+/** Find a job by a specification like %2, %% or a PID.
+ *
+ * @param state Psh internal state.
+ * @param spec The specification.
+ * @return The job, NULL if there is none.
+ */
+struct _psh_jobs *psh_jobs_find(psh_state *state, const char *spec);
+
+/** Record the new status of a process of a job, called by the backend as
+ * children are reaped. Unknown PIDs are ignored. Jobs that have finished are
+ * dropped right away unless the shell is interactive, where they are kept
+ * until psh_jobs_notify() has reported them.
+ *
+ * @param state Psh internal state.
+ * @param pid PID of the child.
+ * @param status The new status.
+ * @param wait_stat Status returned by wait().
+ * @param exit_status Exit status for the shell, or the signal that stopped
+ * it.
+ * @param usage Resources used by a finished child, or NULL if unknown.
+ */
+void psh_jobs_set_status(psh_state *state, int pid,
+                         enum _psh_job_status status, int wait_stat,
+                         int exit_status, const struct _psh_job_usage *usage);
+
+/** Take the exit status of a finished job, so that it is not reported
+ * again.
+ *
+ * @param state Psh internal state.
+ * @param pid PID of the job.
+ * @return Its exit status, -1 if it hasn't finished or is unknown.
+ */
+int psh_jobs_take_status(psh_state *state, int pid);
+
+/** Iterate over the finished jobs not waited for yet, in the order they
+ * finished. These are copies kept after the jobs have left the table, with
+ * their resource usage.
+ *
+ * @param state Psh internal state.
+ * @param cursor 0 to start, advanced past the returned job.
+ * @return The next job, NULL if there are no more.
+ */
+struct _psh_jobs *psh_jobs_next_done(psh_state *state, size_t *cursor);
+
+/** Take the exit status of the job that finished first among those not
+ * waited for yet.
+ *
+ * @param state Psh internal state.
+ * @param pid Where to store its PID, or NULL.
+ * @return Its exit status, -1 if there is none.
+ */
+int psh_jobs_take_next_status(psh_state *state, int *pid);
+
+/** Describe a job like `[1]  Running    sleep'.
+ *
+ * @param job The job.
+ * @param with_pid Whether to include the PID.
+ * @param buffer Where to store the description.
+ * @param size Size of @p buffer.
+ */
+void psh_jobs_describe(const struct _psh_jobs *job, int with_pid,
+                       char *buffer, size_t size);
+
+/** Remove a job from the table and free it.
+ *
+ * @param state Psh internal state.
+ * @param job The job.
+ */
+void psh_jobs_remove(psh_state *state, struct _psh_jobs *job);
+
+/** Report jobs whose status has changed to stderr, and drop the ones that
+ * have finished.
+ *
+ * @param state Psh internal state.
+ */
+void psh_jobs_notify(psh_state *state);
+
+/** Count running and stopped jobs.
+ *
+ * @param state Psh internal state.
+ * @return The number of jobs.
+ */
+size_t psh_jobs_count(psh_state *state);
+
+/** Count running jobs only.
+ *
+ * @param state Psh internal state.
+ * @return The number of jobs.
  */
-int psh_jobs_add(psh_state *state, char *cmd, int pid, enum _psh_cmd_type type);
+size_t psh_jobs_running(psh_state *state);
 
 /** Free jobs.
  *
  * @param state Psh internal state.
- * @param sighup Whether to send a hangup signal.
+ * @param sighup Whether to send a hangup signal to those still running.
  */
 void psh_jobs_free(psh_state *state, int sighup);
 #endif
@@ -123,7 +123,7 @@ int psh_hash_add_chk(psh_hash *table, const char *key, void *value,
  */
 void *psh_hash_get(psh_hash *table, const char *key);
 
-/** Remove an item by key.
+/** Remove an item by key, freeing its value if it was added with if_free.
  *
  * @param table The table to operate.
  * @param key The key.
@@ -87,4 +87,17 @@ char *psh_strdup(const char *str);
  */
 char *psh_getstring(void *(*func)(char *, size_t), void **result);
 
+/** Split the next field off a string in place.
+ * @details Fields are delimited as in POSIX field splitting: runs of blanks in
+ * @p ifs are collapsed and ignored at both ends, while every other character
+ * in @p ifs delimits exactly one field. The delimiter after the returned field
+ * is overwritten with NUL, so no copy is ever made.
+ *
+ * @param cursor Pointer to the position to split from, advanced past the
+ * returned field and its delimiters.
+ * @param ifs Characters that delimit fields.
+ * @return The field, or NULL if no more fields remain.
+ */
+char *psh_split_field(char **cursor, const char *ifs);
+
 #endif /* _LIBPSH_UTIL_H */
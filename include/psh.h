@@ -36,7 +36,34 @@
 #include "libpsh/hash.h"
 
 /* jobs.h depends on our psh_state, so this forward decl is used instead */
-struct _psh_jobs;
+struct _psh_job_table;
+/* Likewise for variable.h */
+struct _psh_vf_binding;
+struct _psh_vfa_container;
+
+/** @brief Parameters kept in fixed slots of the state, see
+ * psh_vf_get_special(). */
+enum _psh_vf_special
+{
+    /** $? */
+    PSH_VF_STATUS,
+    /** $$ */
+    PSH_VF_PID,
+    /** $! */
+    PSH_VF_LAST_BG,
+    /** $# */
+    PSH_VF_ARGC,
+    /** $PWD */
+    PSH_VF_PWD,
+    /** $PATH */
+    PSH_VF_PATH,
+    /** $IFS */
+    PSH_VF_IFS,
+    /** $PS1 */
+    PSH_VF_PS1,
+    /** Number of slots. */
+    PSH_VF_SPECIAL_COUNT
+};
 
 /** @brief The internal state of psh. */
 typedef struct _psh_state
@@ -45,29 +72,71 @@ typedef struct _psh_state
      * other languages */
     struct _psh_vf_context
     {
-        /** Variables */
-        psh_hash *variable_table;
-        /** Global functions */
-        psh_hash *function_table;
+        /** Variables bound in this frame, most recent first. */
+        struct _psh_vf_binding *variables;
+        /** Functions bound in this frame, most recent first. */
+        struct _psh_vf_binding *functions;
     } * contexts; /**< An array of context frames. */
+    /** Variables by name, each the innermost of a stack of bindings, NULL
+     * for locals of frames already left. */
+    psh_hash *variable_table;
+    /** Functions by name, each the innermost of a stack of bindings, NULL
+     * for locals of frames already left. */
+    psh_hash *function_table;
+    /** Innermost bindings of the parameters in enum _psh_vf_special, NULL
+     * for those not set, kept up to date as they are bound and unbound. */
+    struct _psh_vfa_container *specials[PSH_VF_SPECIAL_COUNT];
+    /** @brief Environment passed to commands, see psh_vf_envp(). */
+    struct _psh_vf_env
+    {
+        /** Bindings with the export attribute, in no particular order. */
+        struct _psh_vf_binding **bindings;
+        /** NULL-terminated entries of the visible ones in @ref bindings. */
+        char **envp;
+        /** Number of entries in @ref bindings. */
+        size_t count;
+        /** Number of slots allocated for @ref bindings. */
+        size_t slots;
+        /** Inherited entries not imported as variables yet, by name. */
+        psh_hash *inherited;
+        /** Number of entries in @ref inherited. */
+        size_t inherited_count;
+        /** Whether @ref envp needs to be rebuilt. */
+        int dirty;
+    } environment;
+    /** Bindings popped with their frames, kept to be reused by the next
+     * ones, linked by their frame_next. */
+    struct _psh_vf_binding *spare_bindings;
+    /** Number of entries in @ref spare_bindings. */
+    size_t spare_count;
     /** The index of the current context frame. */
     size_t context_idx;
     /** The number of available context frames. */
     size_t context_slots;
     /** Background jobs. */
-    struct _psh_jobs *jobs;
+    struct _psh_job_table *jobs;
     /* Local functions is a psh extension */
     /** Aliases hash table */
     psh_hash *alias_table;
     /** Command hash table */
     psh_hash *command_table;
+    /** Output sizes of previous command substitutions, keyed by source. */
+    psh_hash *capture_hints;
+    /** Number of entries in @ref capture_hints. */
+    size_t capture_hint_count;
     /** Shell argv[0]. */
     char *argv0;
+    /** What is left of the -c string, read line by line in place of stdin,
+     * or NULL. */
+    const char *from_string;
     /** Verbose flag. */
     unsigned int verbose : 1;
     /** Interactive flag. */
     unsigned int interactive : 1;
     /** -x flag */
     unsigned int trace : 1;
+    /** Whether the last command may replace the shell instead of being
+     * forked, set when no input follows the command being run. */
+    unsigned int exec_last : 1;
 } psh_state;
 #endif
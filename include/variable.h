@@ -21,8 +21,12 @@
 #ifndef _PSH_VARIABLE_H
 #define _PSH_VARIABLE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+/** Strings shorter than this are stored in the container itself. */
+#define PSH_VFA_INLINE 24
+
 /** @brief Attributes of variables, functions, and aliases. */
 enum _psh_vfa_attributes
 {
@@ -59,13 +63,13 @@ enum _psh_vfa_attributes
 /** @brief Value of a variable. */
 union _psh_vfa_value
 {
-    /** String value. */
+    /** String value, from psh_vfa_str_new() or psh_vfa_str_share(). */
     char *string;
     /** Parsed code. */
     struct _psh_command *code;
     /** Integer array. */
     intmax_t *int_array;
-    /** String array. */
+    /** String array, each element like @ref string. */
     char **string_array;
     /** Integer. */
     intmax_t integer;
@@ -79,10 +83,56 @@ struct _psh_vfa_container
     union _psh_vfa_value payload;
     /** Size of the array if it is one. */
     size_t array_size;
+    /** Where short strings are kept, @ref payload pointing to it. */
+    char inline_string[PSH_VFA_INLINE];
 };
 
-/** Initialize variable and function tables of a new context frame.
- * Try to get environment parameters if this is the 0th context frame.
+/** @brief Header of a string value shared between variables.
+ *
+ * The string is never modified, assigning another value to one of the
+ * variables drops its reference instead. Variables always point to
+ * @ref data.
+ */
+struct _psh_vfa_string
+{
+    /** Number of variables referring to it. */
+    size_t refs;
+    /** The NUL-terminated string. */
+    char data[];
+};
+
+/** @brief A variable or function bound in one context frame.
+ *
+ * All bindings of a name form a stack, innermost frame first, whose top is
+ * what the name table of the shell holds, so finding a name takes a single
+ * lookup however deep the frames go. Each frame also lists the bindings it
+ * made, to be popped when it is left.
+ */
+struct _psh_vf_binding
+{
+    /** The variable or function. */
+    struct _psh_vfa_container container;
+    /** Its name. */
+    char *name;
+    /** Where short names are kept, @ref name pointing to it. */
+    char inline_name[PSH_VFA_INLINE];
+    /** Index of the context frame it belongs to. */
+    size_t frame;
+    /** Its slot if it is a special parameter, -1 otherwise. */
+    int special;
+    /** Its "name=value" entry of the environment, NULL until needed. */
+    char *env;
+    /** Its index in psh_state::environment plus one, 0 if not exported. */
+    size_t env_idx;
+    /** The binding of the same name in an outer frame, NULL if none. */
+    struct _psh_vf_binding *shadowed;
+    /** The previous binding made in the same frame. */
+    struct _psh_vf_binding *frame_prev;
+    /** The next binding made in the same frame. */
+    struct _psh_vf_binding *frame_next;
+};
+
+/** Start a new context frame, or the first one and the name tables.
  *
  * @param state Psh internal state.
  */
@@ -93,7 +143,7 @@ void psh_vfa_new_context(psh_state *state);
  * @param state Psh internal state.
  * @param varname Name of the variable or function.
  * @param attrib Variable attributes.
- * @param payload Value of the function or variable.
+ * @param payload Value of the function or variable, owned by it afterwards.
  * @param array_size Length if this is an array, 0 if not.
  * @param is_local Whether to treat as local variable.
  * @param is_func Whether this is a function.
@@ -103,6 +153,21 @@ int psh_vf_set(psh_state *state, const char *varname, unsigned int attrib,
                const union _psh_vfa_value payload, size_t array_size,
                int is_local, int is_func);
 
+/** Add or update a string variable with a copy of a string.
+ *
+ * Short strings are stored inline in the container, so this doesn't
+ * allocate anything for them.
+ *
+ * @param state Psh internal state.
+ * @param varname Name of the variable.
+ * @param attrib Variable attributes.
+ * @param value The string, NULL for an empty value.
+ * @param is_local Whether to treat as local variable.
+ * @return 0 if succeed, 1 if not.
+ */
+int psh_vf_setstr(psh_state *state, const char *varname, unsigned int attrib,
+                  const char *value, int is_local);
+
 /** Add a variable or function. Don't use this function to update, or memory
  * leak might happen.
  *
@@ -151,6 +216,106 @@ int psh_vf_unset(psh_state *state, const char *varname, int is_func);
  */
 void psh_vfa_free(psh_state *state);
 
+/** Make a shared string value.
+ *
+ * @param str The string to copy.
+ * @return The string to be stored in a payload.
+ */
+char *psh_vfa_str_new(const char *str);
+
+/** Share the string value of a variable with another one.
+ *
+ * @param container The variable.
+ * @return The same string if it is shared, a new one if it was inline, NULL
+ * if it has no value.
+ */
+char *psh_vfa_str_share(struct _psh_vfa_container *container);
+
+/** Drop a reference to a shared string value.
+ *
+ * @param string The string, can be NULL.
+ */
+void psh_vfa_str_unref(char *string);
+
+/** Take an entry of the environment the shell was started with.
+ *
+ * Only the name is indexed, the variable is created when it is first used.
+ * Until then, the entry is passed to commands as is.
+ *
+ * @param state Psh internal state.
+ * @param entry The "name=value" string, which must outlive the shell.
+ */
+void psh_vf_inherit(psh_state *state, const char *entry);
+
+/** Get the environment for the commands to be run.
+ *
+ * Only the entries of exported variables that changed since the last call
+ * are formatted again.
+ *
+ * @param state Psh internal state.
+ * @return The NULL-terminated array of "name=value" strings, valid until
+ * the next change to a variable, shouldn't be free()d.
+ */
+char **psh_vf_envp(psh_state *state);
+
+/** Get the reference to a special parameter without looking it up, the
+ * same container as psh_vf_get() returns for its name.
+ *
+ * @param state Psh internal state.
+ * @param which The parameter.
+ * @return the variable container, NULL if not set.
+ */
+static inline struct _psh_vfa_container *
+psh_vf_get_special(psh_state *state, enum _psh_vf_special which)
+{
+    return state->specials[which];
+}
+
+/** Get the string value of a special parameter.
+ *
+ * @param state Psh internal state.
+ * @param which The parameter.
+ * @return value if set, shouldn't be free()d, NULL if not.
+ */
+static inline const char *psh_vf_getstr_special(psh_state *state,
+                                                enum _psh_vf_special which)
+{
+    const struct _psh_vfa_container *container = state->specials[which];
+    return container && !(container->attributes & PSH_VFA_UNSET)
+               ? container->payload.string
+               : NULL;
+}
+
+/** Get the exit status of the last command, $?.
+ *
+ * @param state Psh internal state.
+ * @return The status.
+ */
+static inline intmax_t psh_vf_get_status(psh_state *state)
+{
+    const struct _psh_vfa_container *container =
+        state->specials[PSH_VF_STATUS];
+    return container ? container->payload.integer : 0;
+}
+
+/** Set the exit status of the last command, $?, with a single store once it
+ * exists.
+ *
+ * @param state Psh internal state.
+ * @param status The status.
+ */
+static inline void psh_vf_set_status(psh_state *state, intmax_t status)
+{
+    union _psh_vfa_value payload;
+    if (state->specials[PSH_VF_STATUS])
+    {
+        state->specials[PSH_VF_STATUS]->payload.integer = status;
+        return;
+    }
+    payload.integer = status;
+    psh_vf_set(state, "?", PSH_VFA_INTEGER, payload, 0, 0, 0);
+}
+
 /** Get a string value
  *
  * @param state Psh internal state.
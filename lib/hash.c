@@ -245,7 +245,8 @@ int psh_hash_rm(psh_hash *table, const char *key)
         if (strcmp(key, this->key) == 0)
         {
             xfree(this->key);
-            xfree(this->value);
+            if (this->if_free)
+                xfree(this->value);
             if (!old_this)
             {
                 /* Removing the first element, using->head == this */
@@ -151,3 +151,36 @@ char *psh_getstring(void *(*func)(char *, size_t), void **result)
     newtry = xrealloc(newtry, strlen(newtry) + 1);
     return newtry;
 }
+
+/* Split a field off *CURSOR in place, similar to strsep(3) but with the IFS
+ * rules of POSIX: blanks collapse, other delimiters separate exactly once. */
+char *psh_split_field(char **cursor, const char *ifs)
+{
+#define IS_IFS_BLANK(c) ((c) && strchr(ifs, (c)) && strchr(" \t\n", (c)))
+    char *field, *ptr = *cursor;
+    /* Leading blanks never start a field */
+    while (IS_IFS_BLANK(*ptr))
+        ++ptr;
+    if (*ptr == 0)
+    {
+        *cursor = ptr;
+        return NULL;
+    }
+    field = ptr;
+    while (*ptr && !strchr(ifs, *ptr))
+        ++ptr;
+    if (*ptr)
+    {
+        int was_blank = IS_IFS_BLANK(*ptr);
+        *ptr++ = 0;
+        while (IS_IFS_BLANK(*ptr))
+            ++ptr;
+        /* "a : b" is two fields, not three */
+        if (was_blank && *ptr && strchr(ifs, *ptr))
+            for (++ptr; IS_IFS_BLANK(*ptr);)
+                ++ptr;
+    }
+    *cursor = ptr;
+    return field;
+#undef IS_IFS_BLANK
+}
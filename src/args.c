@@ -21,6 +21,7 @@
 
 #include "backend.h"
 #include "filpinfo.h"
+#include "input.h"
 #include "libpsh/util.h"
 #include "psh.h"
 #include "util.h"
@@ -88,18 +89,34 @@ void parse_shell_args(psh_state *state, int argc, char **argv)
             /* -c flag */
             case 'c':
             {
-                struct _psh_command *cmd = new_command();
-                if (filpinfo(state, psh_strdup(optarg), cmd) < 0)
+                char *line;
+                state->from_string = optarg;
+                /* main() doesn't get that far */
+                if (psh_backend_prepare(state) != 0)
+                    exit_psh(state, 1);
+                /* Line by line, so that here-documents and continued
+                 * commands can take the lines that follow */
+                while ((line = read_string_line(state)) != NULL)
                 {
+                    struct _psh_command *cmd = new_command();
+                    int stat;
+                    if (state->trace == 1)
+                        printf("+ %s\n", line);
+                    if ((stat = filpinfo(state, line, cmd)) < 0)
+                    {
+                        free_command(cmd);
+                        exit_psh(state, 1);
+                    }
+                    fflush(stdout);
+                    /* Nothing follows the last line of -c, so its last
+                     * command can be exec()ed */
+                    state->exec_last =
+                        !state->interactive && *state->from_string == 0;
+                    if (stat > 0)
+                        psh_backend_do_run(state, cmd);
                     free_command(cmd);
-                    exit_psh(state, 1);
                 }
-                if (state->trace == 1)
-                    printf("+ %s\n", optarg);
-                fflush(stdout);
-                psh_backend_do_run(state, cmd);
-                free_command(cmd);
-                exit_psh(state, (int)psh_vf_getint(state, "?"));
+                exit_psh(state, (int)psh_vf_get_status(state));
                 break;
             }
             /* Verbose flag */
@@ -0,0 +1,112 @@
+/*
+    psh/backends/posix2/affinity.c - CPU placement of pipeline stages
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* sched_setaffinity(2) and CPU_SET */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libpsh/util.h"
+#include "libpsh/xmalloc.h"
+#include "posix2.h"
+#include "psh.h"
+#include "variable.h"
+
+#ifdef HAVE_SCHED_SETAFFINITY
+/* Parse a list like 0-3,8,10-11 into the CPUs in that order. Returns NULL
+ * if it is malformed */
+static int *parse_cpu_list(const char *list, size_t *count)
+{
+    size_t slots = 8;
+    int *cpus = xmalloc(sizeof(int) * slots);
+    *count = 0;
+    for (;;)
+    {
+        char *end;
+        long first, last, cpu;
+        first = last = strtol(list, &end, 10);
+        if (end == list)
+            break;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list)
+                break;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            break;
+        for (cpu = first; cpu <= last; ++cpu)
+        {
+            if (*count == slots)
+                cpus = xrealloc(cpus, sizeof(int) * (slots *= 2));
+            cpus[(*count)++] = (int)cpu;
+        }
+        if (*end == '\0')
+            return cpus;
+        if (*end != ',')
+            break;
+        list = end + 1;
+    }
+    xfree(cpus);
+    *count = 0;
+    return NULL;
+}
+#endif
+
+int *psh_posix_pipeline_cpus(psh_state *state, size_t *count)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    const char *list = psh_vf_getstr(state, "PSH_PIPELINE_CPUS");
+    int *cpus;
+    *count = 0;
+    if (list == NULL || *list == '\0')
+        return NULL;
+    if ((cpus = parse_cpu_list(list, count)) == NULL)
+        OUT2E("%s: PSH_PIPELINE_CPUS: invalid CPU list `%s'\n", state->argv0,
+              list);
+    return cpus;
+#else
+    (void)state;
+    *count = 0;
+    return NULL;
+#endif
+}
+
+void psh_posix_pin_cpu(psh_state *state, int cpu)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &set) < 0)
+        OUT2E("%s: CPU %d: %s\n", state->argv0, cpu, strerror(errno));
+#else
+    (void)state;
+    (void)cpu;
+#endif
+}
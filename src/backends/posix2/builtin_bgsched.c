@@ -0,0 +1,98 @@
+/*
+    psh/backends/posix2/builtin_bgsched.c - builtin bgsched
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "builtin.h"
+#include "libpsh/util.h"
+#include "posix2.h"
+#include "psh.h"
+#include "variable.h"
+
+/* Parse bgsched SCHED command [args] into SCHED and the command and find
+ * the command. Returns 0, or the exit status of bgsched on errors */
+static int parse(psh_state *state, int argc, char **argv,
+                 struct psh_posix_sched *sched, builtin_function *builtin,
+                 char **path)
+{
+    if (argc < 3)
+    {
+        OUT2E("%s: %s: usage: bgsched SCHED command [args]\n", state->argv0,
+              argv[0]);
+        return 125;
+    }
+    if (psh_posix_parse_sched(argv[1], sched) < 0)
+    {
+        OUT2E("%s: %s: %s: invalid scheduling\n", state->argv0, argv[0],
+              argv[1]);
+        return 125;
+    }
+    *path = NULL;
+    if ((*builtin = find_builtin(argv[2])) == NULL &&
+        (*path = psh_posix_command_path(state, argv[2])) == NULL)
+        return 127;
+    return 0;
+}
+
+void psh_posix_exec_bgsched(psh_state *state, char **argv)
+{
+    struct psh_posix_sched sched;
+    builtin_function builtin;
+    char *path;
+    int status =
+        parse(state, get_argc(argv), argv, &sched, &builtin, &path);
+    if (status)
+        _Exit(status);
+    psh_posix_apply_sched(state, &sched);
+    psh_posix_exec_command(state, builtin, path, argv + 2,
+                           psh_vf_envp(state));
+}
+
+/* Builtin bgsched, run a command scheduled in a different way than
+ * PSH_BGSCHED says, as in `bgsched none make &'. Forked children, like the
+ * one of that example, go through psh_posix_exec_bgsched() instead */
+int builtin_bgsched(int argc, char **argv, psh_state *state)
+{
+    struct psh_posix_sched sched;
+    builtin_function builtin;
+    char *path;
+    int wait_stat, status = parse(state, argc, argv, &sched, &builtin, &path);
+    pid_t pid;
+    if (status)
+        return status;
+    if ((pid = psh_posix_launch(state, builtin, path, argv + 2, &sched,
+                                NULL)) < 0)
+        return 125;
+    while (waitpid(pid, &wait_stat, 0) < 0)
+        if (errno != EINTR)
+            return 125;
+    return psh_backend_exit_status(wait_stat);
+}
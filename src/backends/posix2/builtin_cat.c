@@ -0,0 +1,81 @@
+/*
+    psh/backends/posix2/builtin_cat.c - builtin cat
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "builtin.h"
+#include "libpsh/util.h"
+#include "posix2.h"
+#include "psh.h"
+
+/* Builtin cat, without any copy through user space where the kernel allows.
+ * Options other than -u are left to the on-disk cat */
+int builtin_cat(int argc, char **argv, psh_state *state)
+{
+    struct sigaction old_action;
+    int idx = 1, ret = 0;
+    for (; idx < argc && argv[idx][0] == '-' && argv[idx][1]; ++idx)
+    {
+        if (strcmp(argv[idx], "--") == 0)
+        {
+            ++idx;
+            break;
+        }
+        if (strcmp(argv[idx], "-u") != 0)
+            return psh_posix_run_external(state, argv);
+    }
+    /* What has been printed goes first */
+    fflush(stdout);
+    /* Running in the shell, Ctrl-C must still stop it */
+    psh_posix_catch_interrupts(&old_action);
+    if (idx == argc && psh_posix_copy(STDIN_FILENO, STDOUT_FILENO) < 0)
+        ret = 1;
+    for (; idx < argc && !psh_posix_interrupted(); ++idx)
+    {
+        int fd = STDIN_FILENO;
+        if (strcmp(argv[idx], "-") != 0 &&
+            (fd = open(argv[idx], O_RDONLY | O_CLOEXEC)) < 0)
+        {
+            OUT2E("%s: %s: %s\n", argv[0], argv[idx], strerror(errno));
+            ret = 1;
+            continue;
+        }
+        if (psh_posix_copy(fd, STDOUT_FILENO) < 0 && !psh_posix_interrupted())
+        {
+            OUT2E("%s: %s: %s\n", argv[0], argv[idx], strerror(errno));
+            ret = 1;
+        }
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    if (psh_posix_interrupted())
+        ret = 128 + SIGINT;
+    psh_posix_release_interrupts(&old_action);
+    return ret;
+}
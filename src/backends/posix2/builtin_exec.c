@@ -30,13 +30,14 @@
 #include "builtin.h"
 #include "libpsh/util.h"
 #include "psh.h"
+#include "variable.h"
 
 /* Builtin exec */
-int builtin_exec(int argc, char **argv, ATTRIB_UNUSED psh_state *state)
+int builtin_exec(int argc, char **argv, psh_state *state)
 {
     if (argc < 2)
         return 0; /* Do nothing */
-    if (execv(argv[1], &argv[1]) == -1)
+    if (execve(argv[1], &argv[1], psh_vf_envp(state)) == -1)
         OUT2E("exec: %s: %s\n", argv[1], strerror(errno));
     return 127;
 }
@@ -0,0 +1,87 @@
+/*
+    psh/backends/posix2/builtin_tee.c - builtin tee
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "builtin.h"
+#include "libpsh/util.h"
+#include "libpsh/xmalloc.h"
+#include "posix2.h"
+#include "psh.h"
+
+/* Builtin tee. Standard output comes first so that tee(2) can duplicate a
+ * pipe into it. Options other than -a are left to the on-disk tee */
+int builtin_tee(int argc, char **argv, psh_state *state)
+{
+    struct sigaction old_action;
+    int idx = 1, ret = 0, flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    size_t count = 1, opened;
+    int *outs;
+    for (; idx < argc && argv[idx][0] == '-' && argv[idx][1]; ++idx)
+    {
+        if (strcmp(argv[idx], "--") == 0)
+        {
+            ++idx;
+            break;
+        }
+        if (strcmp(argv[idx], "-a") != 0)
+            return psh_posix_run_external(state, argv);
+        flags = (flags & ~O_TRUNC) | O_APPEND;
+    }
+    outs = xmalloc(sizeof(int) * (argc - idx + 1));
+    outs[0] = STDOUT_FILENO;
+    for (; idx < argc; ++idx)
+    {
+        if ((outs[count] = open(argv[idx], flags, 0666)) < 0)
+        {
+            OUT2E("%s: %s: %s\n", argv[0], argv[idx], strerror(errno));
+            ret = 1;
+            continue;
+        }
+        ++count;
+    }
+    fflush(stdout);
+    /* Running in the shell, Ctrl-C must still stop it */
+    psh_posix_catch_interrupts(&old_action);
+    if (psh_posix_tee(STDIN_FILENO, outs, count) < 0)
+    {
+        if (psh_posix_interrupted())
+            ret = 128 + SIGINT;
+        else
+        {
+            OUT2E("%s: %s\n", argv[0], strerror(errno));
+            ret = 1;
+        }
+    }
+    psh_posix_release_interrupts(&old_action);
+    for (opened = 1; opened < count; ++opened)
+        close(outs[opened]);
+    xfree(outs);
+    return ret;
+}
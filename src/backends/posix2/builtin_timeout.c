@@ -0,0 +1,276 @@
+/*
+    psh/backends/posix2/builtin_timeout.c - builtin timeout
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* sigtimedwait(2) */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_PIDFD_OPEN
+#include <sys/pidfd.h>
+#endif
+
+#include "backend.h"
+#include "builtin.h"
+#include "libpsh/util.h"
+#include "posix2.h"
+#include "psh.h"
+
+/* Exit statuses of coreutils timeout */
+#define TIMED_OUT 124
+#define TIMEOUT_FAILED 125
+
+/** @brief Signals that can be given by name. */
+static const struct
+{
+    /** Name without SIG. */
+    const char *name;
+    /** The signal. */
+    int sig;
+} signal_names[] = {{"ALRM", SIGALRM}, {"HUP", SIGHUP},   {"INT", SIGINT},
+                    {"KILL", SIGKILL}, {"QUIT", SIGQUIT}, {"TERM", SIGTERM},
+                    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}};
+
+/* Signal named like TERM, SIGTERM or 15, -1 if unknown */
+static int parse_signal(const char *name)
+{
+    size_t idx;
+    if (isdigit(*name))
+        return atoi(name);
+    if (strncasecmp(name, "SIG", 3) == 0)
+        name += 3;
+    for (idx = 0; idx < sizeof(signal_names) / sizeof(signal_names[0]); ++idx)
+        if (strcasecmp(name, signal_names[idx].name) == 0)
+            return signal_names[idx].sig;
+    return -1;
+}
+
+/* Milliseconds in a duration like 1.5, 2m, 1h or 1d, -1 if invalid */
+static long long parse_duration(const char *duration)
+{
+    char *end;
+    double value = strtod(duration, &end);
+    if (end == duration || value < 0)
+        return -1;
+    switch (*end)
+    {
+        case 'd':
+            value *= 24;
+            /* Fall through */
+        case 'h':
+            value *= 60;
+            /* Fall through */
+        case 'm':
+            value *= 60;
+            /* Fall through */
+        case 's':
+            ++end;
+            /* Fall through */
+        case '\0':
+            break;
+        default:
+            return -1;
+    }
+    if (*end)
+        return -1;
+    /* Rounded up, so that the command gets at least what was asked for */
+    return (long long)(value * 1000 + 0.999);
+}
+
+/* Milliseconds since an arbitrary point */
+static long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/** Wait for a child until a deadline.
+ *
+ * The pidfd, if any, is polled. Otherwise SIGCHLD, blocked by the caller, is
+ * waited for with sigtimedwait().
+ *
+ * @param pid The child.
+ * @param pidfd Its pidfd, -1 if none.
+ * @param deadline When to give up in now_ms() time, -1 for never.
+ * @param wait_stat Where to store its status once reaped.
+ * @return 1 if the child has been reaped, 0 if the deadline has passed, -1
+ * if it can't be waited for, with errno set.
+ */
+static int wait_until(pid_t pid, int pidfd, long long deadline,
+                      int *wait_stat)
+{
+    for (;;)
+    {
+        long long left = deadline < 0 ? -1 : deadline - now_ms();
+        pid_t got = waitpid(pid, wait_stat, WNOHANG);
+        if (got == pid)
+            return 1;
+        if (got < 0 && errno != EINTR)
+            return -1;
+        if (deadline >= 0 && left <= 0)
+            return 0;
+        if (pidfd >= 0)
+        {
+            struct pollfd child = {pidfd, POLLIN, 0};
+            poll(&child, 1, left > INT_MAX ? INT_MAX : (int)left);
+        }
+        else
+        {
+            struct timespec timeout;
+            sigset_t chld_set;
+            sigemptyset(&chld_set);
+            sigaddset(&chld_set, SIGCHLD);
+            timeout.tv_sec = left / 1000;
+            timeout.tv_nsec = left % 1000 * 1000000;
+            sigtimedwait(&chld_set, NULL, left < 0 ? NULL : &timeout);
+        }
+    }
+}
+
+/* Builtin timeout, like coreutils timeout without its intermediate process */
+int builtin_timeout(int argc, char **argv, psh_state *state)
+{
+    sigset_t chld_set, old_set;
+    builtin_function builtin;
+    char *path = NULL;
+    long long duration, kill_after = -1;
+    int count = 0, sig = SIGTERM, pidfd = -1, wait_stat, timed_out = 0;
+    int reaped;
+    pid_t pid;
+    /* count always points to the duration */
+    while (++count < argc)
+    {
+        const char *value;
+        char option;
+        if (argv[count][0] != '-')
+            break;
+        option = argv[count][1];
+        if (option == '-')
+        {
+            ++count;
+            break;
+        }
+        if (option != 's' && option != 'k')
+        {
+            OUT2E("%s: %s: unrecognized argument -%c\n", state->argv0,
+                  argv[0], option);
+            return TIMEOUT_FAILED;
+        }
+        /* -s9 or -s 9 */
+        value = argv[count][2] ? argv[count] + 2 : argv[++count];
+        if (value == NULL)
+        {
+            OUT2E("%s: %s: -%c: option requires an argument\n", state->argv0,
+                  argv[0], option);
+            return TIMEOUT_FAILED;
+        }
+        if (option == 's' && (sig = parse_signal(value)) <= 0)
+        {
+            OUT2E("%s: %s: %s: invalid signal\n", state->argv0, argv[0],
+                  value);
+            return TIMEOUT_FAILED;
+        }
+        if (option == 'k' && (kill_after = parse_duration(value)) < 0)
+        {
+            OUT2E("%s: %s: %s: invalid time interval\n", state->argv0,
+                  argv[0], value);
+            return TIMEOUT_FAILED;
+        }
+    }
+    if (argc - count < 2)
+    {
+        OUT2E("%s: %s: usage: timeout [-s SIG] [-k KILL_AFTER] DURATION "
+              "command [args]\n",
+              state->argv0, argv[0]);
+        return TIMEOUT_FAILED;
+    }
+    if ((duration = parse_duration(argv[count])) < 0)
+    {
+        OUT2E("%s: %s: %s: invalid time interval\n", state->argv0, argv[0],
+              argv[count]);
+        return TIMEOUT_FAILED;
+    }
+    argv += count + 1;
+    if ((builtin = find_builtin(argv[0])) == NULL &&
+        (path = psh_posix_command_path(state, argv[0])) == NULL)
+        return 127;
+    /* A child exiting right away mustn't be missed by the fallback */
+    sigemptyset(&chld_set);
+    sigaddset(&chld_set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_set, &old_set);
+    pid = psh_posix_launch(state, builtin, path, argv, NULL, &old_set);
+    if (pid < 0)
+    {
+        sigprocmask(SIG_SETMASK, &old_set, NULL);
+        return TIMEOUT_FAILED;
+    }
+#ifdef HAVE_PIDFD_OPEN
+    pidfd = pidfd_open(pid, 0);
+#endif
+    /* A duration of 0 disables the timeout */
+    if (!(reaped = wait_until(pid, pidfd, duration ? now_ms() + duration : -1,
+                              &wait_stat)))
+    {
+        timed_out = 1;
+        kill(pid, sig);
+        if (kill_after < 0)
+            reaped = wait_until(pid, pidfd, -1, &wait_stat);
+        else if (!(reaped = wait_until(pid, pidfd, now_ms() + kill_after,
+                                       &wait_stat)))
+        {
+            /* Still alive after the first signal */
+            kill(pid, SIGKILL);
+            reaped = wait_until(pid, pidfd, -1, &wait_stat);
+            timed_out = 2;
+        }
+    }
+    if (reaped < 0)
+        OUT2E("%s: %s: waitpid: %s\n", state->argv0, argv[0],
+              strerror(errno));
+    if (pidfd >= 0)
+        close(pidfd);
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    /* Whatever SIGCHLD was taken by sigtimedwait() might have been for a
+     * job, let the reaper know */
+    if (pidfd < 0)
+        raise(SIGCHLD);
+    if (reaped < 0)
+        return TIMEOUT_FAILED;
+    /* Like coreutils, being killed with KILL is reported as such */
+    if (timed_out == 2 || (timed_out && sig == SIGKILL))
+        return 128 + SIGKILL;
+    return timed_out ? TIMED_OUT : psh_backend_exit_status(wait_stat);
+}
@@ -0,0 +1,54 @@
+/*
+    psh/backends/posix2/builtin_times.c - builtin times
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "builtin.h"
+#include "posix2.h"
+#include "psh.h"
+
+/* Print user and system times of the shell, then of its children */
+static void print_usage(int who)
+{
+    char user[32], sys[32];
+    struct rusage usage;
+    getrusage(who, &usage);
+    psh_posix_format_time(user, sizeof(user), (long)usage.ru_utime.tv_sec,
+                          (long)usage.ru_utime.tv_usec);
+    psh_posix_format_time(sys, sizeof(sys), (long)usage.ru_stime.tv_sec,
+                          (long)usage.ru_stime.tv_usec);
+    printf("%s %s\n", user, sys);
+}
+
+/* Builtin times */
+int builtin_times(ATTRIB_UNUSED int argc, ATTRIB_UNUSED char **argv,
+                  ATTRIB_UNUSED psh_state *state)
+{
+    print_usage(RUSAGE_SELF);
+    /* Children that have been waited for */
+    print_usage(RUSAGE_CHILDREN);
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+    psh/backends/posix2/builtin_xjobs.c - builtin xjobs
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "builtin.h"
+#include "libpsh/util.h"
+#include "libpsh/xmalloc.h"
+#include "posix2.h"
+#include "psh.h"
+#include "variable.h"
+
+/* Bytes of input read at a time */
+#define XJOBS_BLOCK 65536
+
+/** @brief The command run for every item, prepared once. */
+struct xjobs_template
+{
+    /** Arguments of the command as given. */
+    char **argv;
+    /** Number of entries in @ref argv. */
+    int argc;
+    /** String replaced by the item, NULL to append the item instead. */
+    const char *replace;
+    /** Whether each argument contains @ref replace. */
+    char *replaced;
+    /** The builtin to run, if it is one. */
+    builtin_function builtin;
+    /** Path of the on-disk command otherwise. */
+    char *path;
+    /** The current item. */
+    const char *item;
+};
+
+/* Replace every PATTERN in STR with ITEM */
+static char *substitute(const char *str, const char *pattern, const char *item)
+{
+    size_t pattern_len = strlen(pattern), item_len = strlen(item);
+    size_t count = 0, length;
+    const char *found;
+    char *result, *out;
+    for (found = str; (found = strstr(found, pattern)); found += pattern_len)
+        ++count;
+    length = strlen(str) + count * item_len - count * pattern_len;
+    out = result = xmalloc(length + 1);
+    while ((found = strstr(str, pattern)))
+    {
+        memcpy(out, str, found - str);
+        out += found - str;
+        memcpy(out, item, item_len);
+        out += item_len;
+        str = found + pattern_len;
+    }
+    strcpy(out, str);
+    return result;
+}
+
+/* Worker: run the template with the item filled in. The child exits right
+ * after, so nothing is freed */
+static int run_item(psh_state *state, void *data)
+{
+    struct xjobs_template *template = data;
+    char **argv = xmalloc(sizeof(char *) * (template->argc + 2));
+    int argc = 0, null_fd;
+    for (; argc < template->argc; ++argc)
+        argv[argc] = template->replaced[argc]
+                         ? substitute(template->argv[argc], template->replace,
+                                      template->item)
+                         : template->argv[argc];
+    if (template->replace == NULL)
+        argv[argc++] = (char *)template->item;
+    argv[argc] = NULL;
+    /* The items are read from stdin */
+    if ((null_fd = open("/dev/null", O_RDONLY)) >= 0)
+    {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+    if (template->builtin)
+        return (*template->builtin)(argc, argv, state);
+    execve(template->path, argv, psh_vf_envp(state));
+    OUT2E("%s: %s: %s\n", state->argv0, template->path, strerror(errno));
+    return 127;
+}
+
+/* Read items separated by DELIMITER from stdin and start a worker for each,
+ * return 0, or the signal that interrupted, or -1 on errors */
+static int distribute(psh_state *state, struct _psh_pool *pool,
+                      struct xjobs_template *template, char delimiter)
+{
+    size_t size = XJOBS_BLOCK, used = 0, scanned = 0;
+    char *buffer = xmalloc(size + 1);
+    int ret = 0;
+    for (;;)
+    {
+        size_t start = 0;
+        ssize_t got;
+        char *end;
+        if (size - used < XJOBS_BLOCK / 2)
+        {
+            /* An item longer than what is left */
+            size *= 2;
+            buffer = xrealloc(buffer, size + 1);
+        }
+        got = read(STDIN_FILENO, buffer + used, size - used);
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            OUT2E("%s: xjobs: read: %s\n", state->argv0, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (got == 0)
+        {
+            /* The last item might lack a delimiter */
+            buffer[used++] = delimiter;
+        }
+        used += got;
+        while ((end = memchr(buffer + scanned, delimiter, used - scanned)))
+        {
+            *end = 0;
+            scanned = end - buffer + 1;
+            if (buffer[start])
+            {
+                template->item = buffer + start;
+                if ((ret = psh_backend_pool_run(state, pool, &run_item,
+                                                template, template->argv[0])))
+                    goto out;
+            }
+            start = scanned;
+        }
+        if (got == 0)
+            break;
+        /* Keep the incomplete item at the beginning */
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+        scanned -= start;
+    }
+out:
+    xfree(buffer);
+    return ret;
+}
+
+/* Builtin xjobs, run a command for every item of stdin in up to -P workers,
+ * like xargs -P 1 -L 1 */
+int builtin_xjobs(int argc, char **argv, psh_state *state)
+{
+    struct xjobs_template template;
+    struct _psh_pool *pool;
+    long max = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = 0, ordered = 0, ret, sig;
+    char delimiter = '\n';
+    memset(&template, 0, sizeof(template));
+    /* count always points to the next possible command name */
+    while (++count < argc)
+    {
+        if (argv[count][0] != '-')
+            break;
+        switch (argv[count][1])
+        {
+            case '-':
+                /* Skip this -- */
+                ++count;
+            case '\0':
+                goto endwhile;
+            case '0':
+                delimiter = 0;
+                break;
+            case 'k':
+                ordered = 1;
+                break;
+            case 'I':
+            case 'P':
+            {
+                /* -P4 or -P 4 */
+                char option = argv[count][1];
+                const char *value =
+                    argv[count][2] ? argv[count] + 2 : argv[++count];
+                if (value == NULL)
+                {
+                    OUT2E("%s: %s: -%c: option requires an argument\n",
+                          state->argv0, argv[0], option);
+                    return 2;
+                }
+                if (option == 'I')
+                    template.replace = value;
+                else if ((max = atol(value)) <= 0)
+                {
+                    OUT2E("%s: %s: %s: invalid number of workers\n",
+                          state->argv0, argv[0], value);
+                    return 2;
+                }
+                break;
+            }
+            default:
+                OUT2E("%s: %s: unrecognized argument -%c\n", state->argv0,
+                      argv[0], argv[count][1]);
+                return 2;
+        }
+    }
+endwhile:
+    if (count == argc)
+    {
+        OUT2E("%s: %s: command required\n", state->argv0, argv[0]);
+        return 2;
+    }
+    /* Everything about the command is worked out once, not for each item */
+    template.argv = argv + count;
+    template.argc = argc - count;
+    if ((template.builtin = find_builtin(template.argv[0])) == NULL &&
+        (template.path = psh_posix_command_path(state, template.argv[0])) ==
+            NULL)
+        return 127;
+    template.replaced = xcalloc(template.argc, 1);
+    if (template.replace)
+        for (count = 0; count < template.argc; ++count)
+            template.replaced[count] =
+                strstr(template.argv[count], template.replace) != NULL;
+    pool = psh_backend_pool_new(max > 0 ? (size_t)max : 1, ordered);
+    ret = distribute(state, pool, &template, delimiter);
+    /* Interrupted or not, what has been started is collected */
+    sig = psh_backend_pool_finish(state, pool);
+    if (ret > 0 || sig)
+        ret = 128 + (ret > 0 ? ret : sig);
+    else if (ret < 0 || psh_backend_pool_failures(pool))
+        ret = 123;
+    psh_backend_pool_free(pool);
+    xfree(template.replaced);
+    return ret;
+}
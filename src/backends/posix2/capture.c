@@ -0,0 +1,233 @@
+/*
+    psh/backends/posix2/capture.c - command substitution for POSIX
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* splice(2) and memfd_create(2) */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "command.h"
+#include "libpsh/util.h"
+#include "libpsh/xmalloc.h"
+#include "posix2.h"
+#include "psh.h"
+#include "variable.h"
+
+/* Size of the first buffer when no hint is available */
+#define CAPTURE_INITIAL 4096
+/* Never issue a read() smaller than this, grow the buffer instead */
+#define CAPTURE_MIN_READ 65536
+/* Outputs larger than this are moved to a memfd and mapped */
+#define CAPTURE_SPLICE_THRESHOLD (1 << 20)
+/* Bytes moved by a single splice() */
+#define CAPTURE_SPLICE_CHUNK (1 << 24)
+
+#if defined(HAVE_SPLICE) && defined(HAVE_MEMFD_CREATE)
+/** Move the rest of a large output into a memfd and map it.
+ *
+ * The bytes already read are written to the memfd once, then the pipe is
+ * drained with splice() so that the data never passes through user space
+ * again. The mapping is private, so in-place word splitting won't touch the
+ * memfd, which is closed before returning.
+ *
+ * @param state Psh internal state.
+ * @param fd Read end of the pipe.
+ * @param capture Holds the bytes read so far, replaced by the mapping.
+ * @return 0 if the pipe has been drained, -1 if the caller should keep
+ * read()ing, -2 if the output has been lost partway, which is reported.
+ */
+static int capture_to_memfd(psh_state *state, int fd,
+                            struct _psh_capture *capture)
+{
+    size_t length = capture->length;
+    char *mapping;
+    int memfd = memfd_create("psh-capture", MFD_CLOEXEC);
+    if (memfd < 0)
+        return -1;
+    if (psh_posix_write_all(memfd, capture->data, length) < 0)
+    {
+        close(memfd);
+        return -1;
+    }
+    for (;;)
+    {
+        ssize_t moved = splice(fd, NULL, memfd, NULL, CAPTURE_SPLICE_CHUNK,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved == 0)
+            break;
+        if (moved < 0)
+        {
+            char buffer[CAPTURE_MIN_READ];
+            if (errno == EINTR)
+                continue;
+            if (errno != EINVAL)
+                goto fail;
+            /* splice() unsupported here, copy the rest by hand */
+            while ((moved = read(fd, buffer, sizeof(buffer))) != 0)
+            {
+                if (moved < 0 && errno == EINTR)
+                    continue;
+                if (moved < 0 || psh_posix_write_all(memfd, buffer, moved) < 0)
+                    goto fail;
+                length += moved;
+            }
+            break;
+        }
+        length += moved;
+    }
+    /* One more byte for the terminating NUL, zero-filled by ftruncate() */
+    if (ftruncate(memfd, length + 1) < 0)
+        goto fail;
+    mapping = mmap(NULL, length + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   memfd, 0);
+    if (mapping == MAP_FAILED)
+        goto fail;
+    close(memfd);
+    xfree(capture->data);
+    capture->data = mapping;
+    capture->length = length;
+    capture->mapped = length + 1;
+    return 0;
+fail:
+    /* The pipe might have been partially consumed, nothing to fall back to */
+    OUT2E("%s: command substitution: %s\n", state->argv0, strerror(errno));
+    close(memfd);
+    return -2;
+}
+#endif
+
+/* Fork, run COMMAND with stdout going to a pipe, and collect everything it
+ * writes. Reads are at least CAPTURE_MIN_READ bytes and the buffer doubles,
+ * so the number of syscalls and reallocations is logarithmic in the size. */
+int psh_backend_capture(psh_state *state, struct _psh_command *command,
+                        size_t hint, struct _psh_capture *capture)
+{
+    int pipe_fd[2], wait_stat, failed = 0;
+    size_t size = hint ? hint + 1 : CAPTURE_INITIAL;
+    pid_t pid;
+
+    capture->data = NULL;
+    capture->length = capture->mapped = 0;
+    if (pipe(pipe_fd) != 0)
+    {
+        OUT2E("%s: pipe: %s\n", state->argv0, strerror(errno));
+        return 1;
+    }
+    /* Pending output of the shell mustn't be flushed by the child too */
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+        OUT2E("%s: fork: %s\n", state->argv0, strerror(errno));
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return 1;
+    }
+    if (pid == 0)
+    {
+        /* Child process */
+        close(pipe_fd[0]);
+        if (pipe_fd[1] != STDOUT_FILENO)
+        {
+            if (dup2(pipe_fd[1], STDOUT_FILENO) < 0)
+            {
+                OUT2E("%s: dup2: %s\n", state->argv0, strerror(errno));
+                _Exit(1);
+            }
+            close(pipe_fd[1]);
+        }
+        psh_posix_subshell(state);
+        /* This process only exits after the command */
+        state->exec_last = 1;
+        psh_backend_do_run(state, command);
+        fflush(stdout);
+        _Exit((int)psh_vf_get_status(state));
+    }
+    close(pipe_fd[1]);
+    capture->data = xmalloc(size);
+    for (;;)
+    {
+        ssize_t got;
+        size_t room = size - capture->length - 1;
+        if (room == 0 || (room < CAPTURE_MIN_READ && capture->length >= hint))
+        {
+            /* Grow geometrically, unless the hint said this is enough */
+            size = size * 2 < CAPTURE_MIN_READ ? CAPTURE_MIN_READ + 1
+                                                : size * 2;
+            capture->data = xrealloc(capture->data, size);
+        }
+        got = read(pipe_fd[0], capture->data + capture->length,
+                   size - capture->length - 1);
+        if (got == 0)
+            break;
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            OUT2E("%s: read: %s\n", state->argv0, strerror(errno));
+            failed = 1;
+            break;
+        }
+        capture->length += got;
+#if defined(HAVE_SPLICE) && defined(HAVE_MEMFD_CREATE)
+        if (capture->length >= CAPTURE_SPLICE_THRESHOLD)
+        {
+            int moved = capture_to_memfd(state, pipe_fd[0], capture);
+            if (moved == -2)
+                failed = 1;
+            if (moved != -1)
+                break;
+        }
+#endif
+    }
+    /* A child still writing gets SIGPIPE */
+    close(pipe_fd[0]);
+    if (failed)
+        /* Part of the output is lost, none of it is used */
+        capture->length = 0;
+    capture->data[capture->length] = 0;
+    while (waitpid(pid, &wait_stat, 0) < 0)
+        if (errno != EINTR)
+            return 1;
+    return failed ? 1 : psh_backend_exit_status(wait_stat);
+}
+
+void psh_backend_capture_free(struct _psh_capture *capture)
+{
+    if (capture->mapped)
+        munmap(capture->data, capture->mapped);
+    else
+        xfree(capture->data);
+    capture->data = NULL;
+    capture->length = capture->mapped = 0;
+}
@@ -0,0 +1,200 @@
+/*
+    psh/backends/posix2/copy.c - moving data between file descriptors
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* copy_file_range(2), splice(2) and tee(2) */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#include "posix2.h"
+
+/* Bytes asked from the kernel at a time by the zero-copy calls */
+#define COPY_CHUNK (1 << 30)
+/* Size of the buffer of the read()/write() fallback */
+#define COPY_BUFFER 65536
+
+/** Whether an error from a zero-copy call only means that it doesn't apply
+ * to these file descriptors, so that the next method should be tried. */
+static int unsupported(int error)
+{
+    return error == EINVAL || error == ENOSYS || error == EXDEV ||
+           error == EOPNOTSUPP || error == EBADF || error == ESPIPE;
+}
+
+/* Whether to give up after EINTR or between chunks, with errno set */
+static int stop(void)
+{
+    if (!psh_posix_interrupted())
+        return 0;
+    errno = EINTR;
+    return 1;
+}
+
+/* Repeat a zero-copy call until EOF and return 0 from the function, or -1
+ * on errors and interrupts. Falls through if the call doesn't work on these
+ * file descriptors and nothing has been moved yet */
+#define ZERO_COPY_LOOP(call)                                                   \
+    do                                                                         \
+    {                                                                          \
+        int moved_any = 0;                                                     \
+        for (;;)                                                               \
+        {                                                                      \
+            ssize_t moved;                                                     \
+            if (stop())                                                        \
+                return -1;                                                     \
+            moved = (call);                                                    \
+            if (moved == 0)                                                    \
+                return 0;                                                      \
+            if (moved < 0)                                                     \
+            {                                                                  \
+                if (errno == EINTR)                                            \
+                    continue;                                                  \
+                if (!moved_any && unsupported(errno))                          \
+                    break;                                                     \
+                return -1;                                                     \
+            }                                                                  \
+            moved_any = 1;                                                     \
+        }                                                                      \
+    } while (0)
+
+int psh_posix_copy(int in, int out)
+{
+    char buffer[COPY_BUFFER];
+    struct stat in_stat, out_stat;
+    ssize_t got;
+    if (fstat(in, &in_stat) < 0 || fstat(out, &out_stat) < 0)
+        return -1;
+#ifdef HAVE_COPY_FILE_RANGE
+    /* file -> file, possibly without moving any data at all */
+    if (S_ISREG(in_stat.st_mode) && S_ISREG(out_stat.st_mode))
+        ZERO_COPY_LOOP(copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0));
+#endif
+#ifdef HAVE_SPLICE
+    /* Either side is a pipe */
+    if (S_ISFIFO(in_stat.st_mode) || S_ISFIFO(out_stat.st_mode))
+        ZERO_COPY_LOOP(
+            splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE));
+#endif
+#ifdef HAVE_SENDFILE
+    /* file -> anything */
+    if (S_ISREG(in_stat.st_mode) || S_ISBLK(in_stat.st_mode))
+        ZERO_COPY_LOOP(sendfile(out, in, NULL, COPY_CHUNK));
+#endif
+    while ((got = read(in, buffer, sizeof(buffer))) != 0)
+    {
+        if (stop())
+            return -1;
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (psh_posix_write_all(out, buffer, got) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int psh_posix_tee(int in, const int *outs, size_t count)
+{
+    char buffer[COPY_BUFFER];
+    ssize_t got;
+    size_t idx;
+    if (count == 1)
+        return psh_posix_copy(in, outs[0]);
+#ifdef HAVE_TEE
+    if (count == 2)
+    {
+        /* pipe -> pipe and anything: tee(2) duplicates the data into the
+         * first without consuming it, then it is spliced into the second */
+        for (;;)
+        {
+            ssize_t dup_len;
+            if (stop())
+                return -1;
+            dup_len = tee(in, outs[0], COPY_CHUNK, 0);
+            if (dup_len == 0)
+                return 0;
+            if (dup_len < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (unsupported(errno))
+                    break;
+                return -1;
+            }
+            while (dup_len > 0)
+            {
+                ssize_t moved = splice(in, NULL, outs[1], NULL, dup_len,
+                                       SPLICE_F_MOVE);
+                if (moved < 0 && errno == EINTR && !stop())
+                    continue;
+                if (moved <= 0)
+                {
+                    /* The data is already in the first output, so this can't
+                     * fall back anymore */
+                    while (dup_len > 0 &&
+                           (got = read(in, buffer,
+                                       (size_t)dup_len < sizeof(buffer)
+                                           ? (size_t)dup_len
+                                           : sizeof(buffer))) > 0)
+                    {
+                        if (psh_posix_write_all(outs[1], buffer, got) < 0)
+                            return -1;
+                        dup_len -= got;
+                    }
+                    if (dup_len > 0)
+                        return -1;
+                    break;
+                }
+                dup_len -= moved;
+            }
+        }
+    }
+#endif
+    while ((got = read(in, buffer, sizeof(buffer))) != 0)
+    {
+        if (stop())
+            return -1;
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (idx = 0; idx < count; ++idx)
+            if (psh_posix_write_all(outs[idx], buffer, got) < 0)
+                return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+    psh/backends/posix2/heredoc.c - here-documents and here-strings for POSIX
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* memfd_create(2) and O_TMPFILE */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "libpsh/util.h"
+#include "libpsh/xmalloc.h"
+#include "posix2.h"
+#include "psh.h"
+
+/** @brief Body of a here-document or here-string being written.
+ *
+ * Bodies are kept in @ref buffer as long as they fit in a pipe without
+ * blocking. Anything larger is moved to an anonymous file and the rest of
+ * the body is written straight to it.
+ */
+struct _psh_heredoc
+{
+    /** The anonymous file, -1 while the body is in @ref buffer. */
+    int fd;
+    /** Number of bytes in @ref buffer. */
+    size_t length;
+    /** Small bodies. */
+    char buffer[PIPE_BUF];
+};
+
+int psh_posix_open_anonymous(const char *name)
+{
+    int fd = -1;
+#ifdef HAVE_MEMFD_CREATE
+    if ((fd = memfd_create(name, MFD_CLOEXEC)) >= 0)
+        return fd;
+#else
+    (void)name;
+#endif
+#ifdef O_TMPFILE
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        fd = open(tmpdir && *tmpdir ? tmpdir : "/tmp",
+                  O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+#endif
+    return fd;
+}
+
+struct _psh_heredoc *psh_backend_heredoc_new(void)
+{
+    struct _psh_heredoc *heredoc = xmalloc(sizeof(struct _psh_heredoc));
+    heredoc->fd = -1;
+    heredoc->length = 0;
+    return heredoc;
+}
+
+int psh_backend_heredoc_write(psh_state *state, struct _psh_heredoc *heredoc,
+                              const char *data, size_t length)
+{
+    if (heredoc->fd < 0)
+    {
+        if (heredoc->length + length <= sizeof(heredoc->buffer))
+        {
+            memcpy(heredoc->buffer + heredoc->length, data, length);
+            heredoc->length += length;
+            return 0;
+        }
+        /* Too large for a pipe */
+        heredoc->fd = psh_posix_open_anonymous("psh-heredoc");
+        if (heredoc->fd < 0 ||
+            psh_posix_write_all(heredoc->fd, heredoc->buffer,
+                                heredoc->length) < 0)
+            goto fail;
+    }
+    if (psh_posix_write_all(heredoc->fd, data, length) == 0)
+        return 0;
+fail:
+    OUT2E("%s: here-document: %s\n", state->argv0, strerror(errno));
+    return 1;
+}
+
+int psh_backend_heredoc_finish(psh_state *state, struct _psh_heredoc *heredoc)
+{
+    int fd = heredoc->fd;
+    if (fd >= 0)
+    {
+        /* Read from the beginning */
+        if (lseek(fd, 0, SEEK_SET) < 0)
+        {
+            OUT2E("%s: here-document: %s\n", state->argv0, strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        int pipe_fd[2];
+        if (pipe(pipe_fd) < 0)
+            OUT2E("%s: pipe: %s\n", state->argv0, strerror(errno));
+        else
+        {
+            /* No more than PIPE_BUF bytes, so this never blocks */
+            fcntl(pipe_fd[0], F_SETFD, FD_CLOEXEC);
+            if (psh_posix_write_all(pipe_fd[1], heredoc->buffer,
+                                    heredoc->length) < 0)
+            {
+                OUT2E("%s: here-document: %s\n", state->argv0,
+                      strerror(errno));
+                close(pipe_fd[0]);
+            }
+            else
+                fd = pipe_fd[0];
+            close(pipe_fd[1]);
+        }
+    }
+    xfree(heredoc);
+    return fd;
+}
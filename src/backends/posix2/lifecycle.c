@@ -18,17 +18,211 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+/* wait4(2) */
+#define _DEFAULT_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(HAVE_PIDFD_OPEN) && defined(HAVE_EPOLL_CREATE1)
+#define WATCH_PIDFD 1
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#endif
 
 #include "backend.h"
+#include "jobs.h"
 #include "libpsh/util.h"
+#include "posix2.h"
 #include "psh.h"
 
 volatile int last_sig;
+/* Set when a child has exited or stopped and not been reaped yet */
+static volatile sig_atomic_t children_changed;
+
+/* Set when SIGINT arrives between psh_posix_catch_interrupts() and
+ * psh_posix_release_interrupts() */
+static volatile sig_atomic_t interrupted;
 
 static void signals_handler(int sig) { last_sig = sig; }
+
+static void interrupt_handler(int sig)
+{
+    last_sig = sig;
+    interrupted = 1;
+}
+
+static void child_handler(int sig)
+{
+    last_sig = sig;
+    children_changed = 1;
+}
+
+/* Only called where the shell isn't waiting for a foreground process, so
+ * whatever is reaped here is a job */
+void psh_backend_reap(psh_state *state)
+{
+    struct _psh_job_usage job_usage;
+    struct rusage usage;
+    int wait_stat;
+    pid_t pid;
+    if (!children_changed)
+        return;
+    /* Cleared first so that a child exiting in the meantime isn't missed */
+    children_changed = 0;
+    while ((pid = wait4(-1, &wait_stat, WNOHANG | WUNTRACED, &usage)) > 0)
+    {
+        if (WIFSTOPPED(wait_stat))
+        {
+            psh_jobs_set_status(state, pid, PSH_JOB_STOPPED, wait_stat,
+                                WSTOPSIG(wait_stat), NULL);
+            continue;
+        }
+        psh_posix_job_usage(&usage, &job_usage);
+        psh_jobs_set_status(state, pid,
+                            WIFSIGNALED(wait_stat) ? PSH_JOB_SIGNALED
+                                                   : PSH_JOB_DONE,
+                            wait_stat, psh_backend_exit_status(wait_stat),
+                            &job_usage);
+    }
+}
+
+#ifdef WATCH_PIDFD
+/* One epoll instance watching the pidfds of all jobs */
+static int epoll_fd = -1;
+/* The process it belongs to, subshells must not touch the parent's one */
+static pid_t epoll_owner;
+/* Number of pidfds registered */
+static size_t watched;
+#endif
+
+int psh_backend_watch_child(int pid)
+{
+#ifdef WATCH_PIDFD
+    struct epoll_event event;
+    int pidfd;
+    if (epoll_fd < 0)
+    {
+        if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            return -1;
+        epoll_owner = getpid();
+        watched = 0;
+    }
+    /* Always close-on-exec */
+    if ((pidfd = pidfd_open(pid, 0)) < 0)
+        return -1;
+    event.events = EPOLLIN;
+    event.data.fd = pidfd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &event) < 0)
+    {
+        close(pidfd);
+        return -1;
+    }
+    ++watched;
+    return pidfd;
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+void psh_backend_unwatch_child(int handle)
+{
+#ifdef WATCH_PIDFD
+    if (handle < 0)
+        return;
+    if (epoll_fd >= 0)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, handle, NULL);
+        --watched;
+    }
+    close(handle);
+#else
+    (void)handle;
+#endif
+}
+
+void psh_posix_subshell(psh_state *state)
+{
+#ifdef WATCH_PIDFD
+    /* Shared with the parent, so nothing may be removed from it */
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    epoll_fd = -1;
+    watched = 0;
+#endif
+    psh_jobs_free(state, 0);
+}
+
+int psh_backend_wait_children(psh_state *state)
+{
+    sigset_t chld_set, old_set;
+    int sig = 0;
+    if (children_changed)
+    {
+        psh_backend_reap(state);
+        return 0;
+    }
+#ifdef WATCH_PIDFD
+    /* Only if no job was left out, otherwise its exit could be missed */
+    if (epoll_fd >= 0 && watched && watched >= psh_jobs_count(state))
+    {
+        struct epoll_event event;
+        last_sig = 0;
+        if (epoll_wait(epoll_fd, &event, 1, -1) > 0 || last_sig == SIGCHLD)
+        {
+            children_changed = 1;
+            psh_backend_reap(state);
+            return 0;
+        }
+        return last_sig;
+    }
+#endif
+    /* Sleep until SIGCHLD or another signal arrives */
+    sigemptyset(&chld_set);
+    sigaddset(&chld_set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_set, &old_set);
+    last_sig = 0;
+    while (!children_changed && (last_sig == 0 || last_sig == SIGCHLD))
+        sigsuspend(&old_set);
+    if (!children_changed)
+        sig = last_sig;
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    psh_backend_reap(state);
+    return sig;
+}
+
+void psh_posix_catch_interrupts(struct sigaction *old)
+{
+    struct sigaction action;
+    interrupted = 0;
+    sigaction(SIGINT, NULL, old);
+    if (old->sa_handler == SIG_DFL || old->sa_handler == SIG_IGN)
+        return;
+    /* No SA_RESTART, so that a blocked read() returns */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = interrupt_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+}
+
+void psh_posix_release_interrupts(const struct sigaction *old)
+{
+    if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+        sigaction(SIGINT, old, NULL);
+    interrupted = 0;
+}
+
+int psh_posix_interrupted(void) { return interrupted; }
+
 /* TODO */
 int psh_backend_prepare(psh_state *state)
 {
@@ -53,7 +247,7 @@ int psh_backend_prepare(psh_state *state)
             return 1;
         }
     }
-    if (signal(SIGCHLD, signals_handler) == SIG_ERR)
+    if (signal(SIGCHLD, child_handler) == SIG_ERR)
     {
         OUT2E("%s: error setting signal handlers: %s\n", state->argv0,
               strerror(errno));
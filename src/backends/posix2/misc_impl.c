@@ -23,17 +23,20 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "backend.h"
 #include "libpsh/util.h"
 #include "libpsh/xmalloc.h"
+#include "posix2.h"
 #include "psh.h"
 #include "variable.h"
 
@@ -88,6 +91,8 @@ char *psh_backend_gethostname_dm(void)
 
 int psh_backend_getuid(void) { return geteuid(); }
 
+int psh_backend_getpid(void) { return getpid(); }
+
 int psh_backend_chdir(char *dir) { return chdir(dir); }
 
 int psh_backend_setenv(const char *name, const char *value, int overwrite)
@@ -115,14 +120,31 @@ void psh_backend_get_all_env(psh_state *state)
 {
     size_t count;
     for (count = 0; environ[count]; ++count)
+        psh_vf_inherit(state, environ[count]);
+}
+
+long long psh_backend_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void psh_backend_close_fd(int fd) { close(fd); }
+
+int psh_posix_write_all(int fd, const char *data, size_t length)
+{
+    while (length)
     {
-        char *env = psh_strdup(environ[count]);
-        char *equal = strrchr(env, '=');
-        char *value = psh_strdup(equal + 1);
-        union _psh_vfa_value payload = {value};
-        *equal = 0;
-        psh_vf_set(state, env, PSH_VFA_EXPORT | PSH_VFA_STRING, payload, 0, 0,
-                   0);
-        xfree(env);
+        ssize_t written = write(fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR && !psh_posix_interrupted())
+                continue;
+            return -1;
+        }
+        data += written;
+        length -= written;
     }
-}
\ No newline at end of file
+    return 0;
+}
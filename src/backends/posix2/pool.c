@@ -0,0 +1,216 @@
+/*
+    psh/backends/posix2/pool.c - bounded sets of forked workers
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "command.h"
+#include "jobs.h"
+#include "libpsh/util.h"
+#include "libpsh/xmalloc.h"
+#include "posix2.h"
+#include "psh.h"
+
+/** @brief A bounded set of forked workers. */
+struct _psh_pool
+{
+    /** Maximum number of workers running at once. */
+    size_t max;
+    /** Whether outputs are printed in the order the workers were started. */
+    int ordered;
+    /** PIDs of the workers in the order they were started. */
+    pid_t *pids;
+    /** Their exit statuses, -1 while running. */
+    int *statuses;
+    /** Anonymous files holding their output, -1 once printed or if
+     * unordered. */
+    int *outputs;
+    /** Number of workers started. */
+    size_t count;
+    /** Number of slots allocated for the arrays above. */
+    size_t slots;
+    /** The next worker whose output is to be printed. */
+    size_t next_output;
+    /** Indices of the running workers, @ref max of them at most. */
+    size_t *running;
+    /** Number of entries in @ref running. */
+    size_t running_count;
+    /** Number of workers that have exited with a non-zero status. */
+    size_t failures;
+};
+
+/* Print held outputs that are no longer preceded by a running worker */
+static void flush_outputs(psh_state *state, struct _psh_pool *pool)
+{
+    while (pool->next_output < pool->count &&
+           pool->statuses[pool->next_output] >= 0)
+    {
+        int fd = pool->outputs[pool->next_output];
+        if (fd >= 0)
+        {
+            fflush(stdout);
+            if (lseek(fd, 0, SEEK_SET) < 0 ||
+                psh_posix_copy(fd, STDOUT_FILENO) < 0)
+                OUT2E("%s: output of worker: %s\n", state->argv0,
+                      strerror(errno));
+            close(fd);
+            pool->outputs[pool->next_output] = -1;
+        }
+        ++pool->next_output;
+    }
+}
+
+/* Take the statuses of the workers that have been reaped */
+static void collect(psh_state *state, struct _psh_pool *pool)
+{
+    size_t idx = 0;
+    psh_backend_reap(state);
+    while (idx < pool->running_count)
+    {
+        size_t worker = pool->running[idx];
+        int status = psh_jobs_take_status(state, pool->pids[worker]);
+        if (status < 0)
+        {
+            if (psh_jobs_get_pid(state, pool->pids[worker]))
+            {
+                /* Still running */
+                ++idx;
+                continue;
+            }
+            /* Reaped, but the status has been forgotten already */
+            status = 127;
+        }
+        pool->statuses[worker] = status;
+        if (status)
+            ++pool->failures;
+        pool->running[idx] = pool->running[--pool->running_count];
+    }
+    if (pool->ordered)
+        flush_outputs(state, pool);
+}
+
+struct _psh_pool *psh_backend_pool_new(size_t max, int ordered)
+{
+    struct _psh_pool *pool = xcalloc(1, sizeof(struct _psh_pool));
+    pool->max = max ? max : 1;
+    pool->ordered = ordered;
+    pool->running = xmalloc(sizeof(size_t) * pool->max);
+    return pool;
+}
+
+int psh_backend_pool_run(psh_state *state, struct _psh_pool *pool,
+                         psh_backend_work work, void *data, const char *name)
+{
+    int output = -1;
+    pid_t pid;
+    collect(state, pool);
+    while (pool->running_count >= pool->max)
+    {
+        int sig = psh_backend_wait_children(state);
+        if (sig)
+            return sig;
+        collect(state, pool);
+    }
+    if (pool->ordered &&
+        (output = psh_posix_open_anonymous("psh-worker")) < 0)
+        /* Printed as it comes instead */
+        OUT2E("%s: output of worker: %s\n", state->argv0, strerror(errno));
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+        OUT2E("%s: fork: %s\n", state->argv0, strerror(errno));
+        if (output >= 0)
+            close(output);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int status;
+        psh_posix_subshell(state);
+        if (output >= 0 && dup2(output, STDOUT_FILENO) < 0)
+        {
+            OUT2E("%s: dup2: %s\n", state->argv0, strerror(errno));
+            _Exit(1);
+        }
+        status = work(state, data);
+        fflush(stdout);
+        _Exit(status);
+    }
+    if (pool->count == pool->slots)
+    {
+        pool->slots = pool->slots ? pool->slots * 2 : 16;
+        pool->pids = xrealloc(pool->pids, sizeof(pid_t) * pool->slots);
+        pool->statuses = xrealloc(pool->statuses, sizeof(int) * pool->slots);
+        pool->outputs = xrealloc(pool->outputs, sizeof(int) * pool->slots);
+    }
+    pool->pids[pool->count] = pid;
+    pool->statuses[pool->count] = -1;
+    pool->outputs[pool->count] = output;
+    pool->running[pool->running_count++] = pool->count++;
+    psh_jobs_add(state, name, pid, PSH_CMD_BACKGROUND);
+    return 0;
+}
+
+int psh_backend_pool_finish(psh_state *state, struct _psh_pool *pool)
+{
+    collect(state, pool);
+    while (pool->running_count)
+    {
+        int sig = psh_backend_wait_children(state);
+        if (sig)
+            return sig;
+        collect(state, pool);
+    }
+    return 0;
+}
+
+const int *psh_backend_pool_statuses(const struct _psh_pool *pool,
+                                     size_t *count)
+{
+    *count = pool->count;
+    return pool->statuses;
+}
+
+size_t psh_backend_pool_failures(const struct _psh_pool *pool)
+{
+    return pool->failures;
+}
+
+void psh_backend_pool_free(struct _psh_pool *pool)
+{
+    size_t idx;
+    for (idx = pool->next_output; idx < pool->count; ++idx)
+        if (pool->outputs[idx] >= 0)
+            close(pool->outputs[idx]);
+    xfree(pool->pids);
+    xfree(pool->statuses);
+    xfree(pool->outputs);
+    xfree(pool->running);
+    xfree(pool);
+}
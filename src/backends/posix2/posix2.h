@@ -0,0 +1,323 @@
+/** @file psh/backends/posix2/posix2.h - @brief Helpers shared inside the
+ * POSIX backend */
+/*
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PSH_POSIX2_H
+#define _PSH_POSIX2_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include "builtin.h"
+#include "jobs.h"
+#include "psh.h"
+
+/** @brief A pipeline run under the reserved word time. */
+struct psh_posix_timing;
+
+/** Let SIGINT stop the shell's own long-running work, such as builtin cat.
+ *
+ * If the shell catches SIGINT, the handler is replaced by one that
+ * interrupts blocking system calls instead of restarting them. Otherwise
+ * SIGINT still works as usual and nothing is changed.
+ *
+ * @param old Where to save the previous handler.
+ */
+void psh_posix_catch_interrupts(struct sigaction *old);
+
+/** Undo psh_posix_catch_interrupts().
+ *
+ * @param old The handler saved by psh_posix_catch_interrupts().
+ */
+void psh_posix_release_interrupts(const struct sigaction *old);
+
+/** Whether SIGINT arrived since psh_posix_catch_interrupts().
+ *
+ * @return Nonzero if it did.
+ */
+int psh_posix_interrupted(void);
+
+/** Write a whole buffer, retrying on partial writes and on EINTR unless
+ * psh_posix_interrupted().
+ *
+ * @param fd File descriptor to write to.
+ * @param data The bytes to write.
+ * @param length Number of bytes in @p data.
+ * @return 0 on success, -1 on error with errno set.
+ */
+int psh_posix_write_all(int fd, const char *data, size_t length);
+
+/** Copy everything from one file descriptor to another.
+ *
+ * copy_file_range() is used between regular files, splice() if either side
+ * is a pipe and sendfile() from regular files, whichever is available and
+ * applies first, and read()/write() otherwise.
+ *
+ * @param in File descriptor to read until EOF.
+ * @param out File descriptor to write to.
+ * @return 0 on success, -1 on error with errno set, which is EINTR if
+ * psh_posix_interrupted().
+ */
+int psh_posix_copy(int in, int out);
+
+/** Copy everything from one file descriptor to several others.
+ *
+ * With two outputs, tee(2) duplicates the data into the first one, which
+ * should then be a pipe as well as the input, and the data is then spliced
+ * into the second one.
+ *
+ * @param in File descriptor to read until EOF.
+ * @param outs File descriptors to write to.
+ * @param count Number of entries in @p outs, at least one.
+ * @return 0 on success, -1 on error with errno set, which is EINTR if
+ * psh_posix_interrupted().
+ */
+int psh_posix_tee(int in, const int *outs, size_t count);
+
+/** Run an on-disk command, bypassing builtins, and wait for it.
+ *
+ * @param state Psh internal state.
+ * @param argv Arguments, argv[0] is searched in $PATH.
+ * @return Its exit status.
+ */
+int psh_posix_run_external(psh_state *state, char **argv);
+
+/** Find an on-disk command in $PATH, caching the result in the hash table.
+ *
+ * @param state Psh internal state.
+ * @param cmd Command name, returned as is if it contains a slash.
+ * @return Its path, not to be freed, or NULL if not found, which is reported
+ * to stderr.
+ */
+char *psh_posix_command_path(psh_state *state, char *cmd);
+
+/** Create an unlinked file, with memfd_create() if possible.
+ *
+ * @param name Name of the memfd, for debugging.
+ * @return A close-on-exec file descriptor, -1 on error with errno set.
+ */
+int psh_posix_open_anonymous(const char *name);
+
+/** Connect a socket for the redirection targets /dev/tcp/host/port,
+ * /dev/udp/host/port and /dev/unix/path, where path is the absolute path of
+ * a Unix domain socket. Connections time out after PSH_CONNECT_TIMEOUT
+ * seconds, 10 by default.
+ *
+ * @param state Psh internal state.
+ * @param path Target of the redirection.
+ * @return A close-on-exec socket, -1 on errors, which are reported to
+ * stderr, or -2 if @p path is none of the above and should be opened.
+ */
+int psh_posix_open_socket(psh_state *state, const char *path);
+
+/** Forget the jobs of the shell in a forked child that goes on running shell
+ * code, so that it neither waits for nor exits early because of them.
+ *
+ * @param state Psh internal state.
+ */
+void psh_posix_subshell(psh_state *state);
+
+/** Read the CPUs that consecutive stages of a pipeline are pinned to from
+ * PSH_PIPELINE_CPUS, a list like 0-3,8. Stage n of a pipeline runs on the
+ * n-th CPU of the list, wrapping around, so that producers and consumers
+ * listed next to each other share caches.
+ *
+ * @param state Psh internal state.
+ * @param count Where to store the number of CPUs.
+ * @return The CPUs, to be freed with xfree(), or NULL if stages are not to be
+ * pinned.
+ */
+int *psh_posix_pipeline_cpus(psh_state *state, size_t *count);
+
+/** Restrict the calling process to one CPU, printing errors to stderr.
+ *
+ * @param state Psh internal state.
+ * @param cpu The CPU number.
+ */
+void psh_posix_pin_cpu(psh_state *state, int cpu);
+
+/** I/O scheduling class best-effort. */
+#define PSH_POSIX_IOPRIO_BE 2
+/** I/O scheduling class idle. */
+#define PSH_POSIX_IOPRIO_IDLE 3
+
+/** @brief How a process is scheduled, relative to the shell. */
+struct psh_posix_sched
+{
+    /** Increment to the nice value, 0 to keep it. */
+    int nice;
+    /** CPU scheduling policy like SCHED_BATCH, -1 to keep it. */
+    int policy;
+    /** I/O scheduling class like PSH_POSIX_IOPRIO_IDLE, -1 to keep it. */
+    int ioclass;
+};
+
+/** Parse a comma-separated scheduling specification.
+ *
+ * Each item is one of none, batch (SCHED_BATCH and the lowest best-effort
+ * I/O priority), idle (SCHED_IDLE and idle I/O) and nice:N (N from 0 to 19).
+ *
+ * @param spec The specification, like batch,nice:5.
+ * @param sched Where to store the result.
+ * @return 0 on success, -1 if it is malformed.
+ */
+int psh_posix_parse_sched(const char *spec, struct psh_posix_sched *sched);
+
+/** Read how background jobs are scheduled from PSH_BGSCHED.
+ *
+ * @param state Psh internal state.
+ * @param sched Where to store the result.
+ * @return 1 if background jobs should be rescheduled, 0 if not set or
+ * invalid, which is reported to stderr.
+ */
+int psh_posix_background_sched(psh_state *state, struct psh_posix_sched *sched);
+
+/** Apply a scheduling to the calling process, printing errors to stderr.
+ *
+ * @param state Psh internal state.
+ * @param sched The scheduling.
+ */
+void psh_posix_apply_sched(psh_state *state,
+                           const struct psh_posix_sched *sched);
+
+/** Run a builtin or on-disk command in a forked child, replacing it or
+ * exiting with the status of the builtin. Builtins run as in a subshell.
+ *
+ * @param state Psh internal state.
+ * @param builtin The builtin, NULL for an on-disk command.
+ * @param path Path of the on-disk command, from psh_posix_command_path().
+ * @param argv Arguments.
+ * @param envp Environment, from psh_vf_envp() before forking.
+ */
+void psh_posix_exec_command(psh_state *state, builtin_function builtin,
+                            const char *path, char **argv,
+                            char **envp) ATTRIB_NORETURN;
+
+/** Fork and run a builtin or on-disk command in the child with
+ * psh_posix_exec_command().
+ *
+ * @param state Psh internal state.
+ * @param builtin The builtin, NULL for an on-disk command.
+ * @param path Path of the on-disk command, from psh_posix_command_path().
+ * @param argv Arguments.
+ * @param sched How to reschedule the child, NULL to leave it as is.
+ * @param mask Signal mask of the child, NULL to keep the shell's.
+ * @return The PID of the child, -1 if it couldn't be forked, which is
+ * reported to stderr.
+ */
+pid_t psh_posix_launch(psh_state *state, builtin_function builtin,
+                       const char *path, char **argv,
+                       const struct psh_posix_sched *sched,
+                       const sigset_t *mask);
+
+/** Run bgsched in a forked child that has nothing else to do: apply the
+ * scheduling and replace the child with the command.
+ *
+ * @param state Psh internal state.
+ * @param argv Arguments of bgsched.
+ */
+void psh_posix_exec_bgsched(psh_state *state, char **argv) ATTRIB_NORETURN;
+
+/** Format a duration like 1m2.345s.
+ *
+ * @param buffer Where to store the result.
+ * @param size Size of @p buffer.
+ * @param seconds Whole seconds.
+ * @param microseconds The fraction, in microseconds.
+ */
+void psh_posix_format_time(char *buffer, size_t size, long seconds,
+                           long microseconds);
+
+/** Start timing a pipeline, before its first stage is started.
+ *
+ * @param verbose Whether to report each stage as well as the totals.
+ * @return A new timing, finished by psh_posix_timing_finish() or dropped by
+ * psh_posix_timing_free().
+ */
+struct psh_posix_timing *psh_posix_timing_start(int verbose);
+
+/** Record a forked stage, to be reaped by psh_posix_timing_finish().
+ *
+ * @param timing The timing.
+ * @param pid PID of the stage.
+ * @param name Command name for the report.
+ * @param cpu The CPU it is pinned to, -1 if none.
+ */
+void psh_posix_timing_add(struct psh_posix_timing *timing, pid_t pid,
+                          const char *name, int cpu);
+
+/** Record a stage that has been run in the shell itself.
+ *
+ * @param timing The timing.
+ * @param name Command name for the report.
+ * @param status Its exit status.
+ * @param before getrusage(RUSAGE_SELF) from right before it was run.
+ */
+void psh_posix_timing_add_self(struct psh_posix_timing *timing,
+                               const char *name, int status,
+                               const struct rusage *before);
+
+/** Wait for every stage with wait4(), print the report to stderr and free
+ * the timing.
+ *
+ * @param state Psh internal state.
+ * @param timing The timing.
+ * @param total Where to add the resources used by all stages, or NULL.
+ * @return Exit status of the last stage, -1 if nothing was run.
+ */
+int psh_posix_timing_finish(psh_state *state, struct psh_posix_timing *timing,
+                            struct rusage *total);
+
+/** Free a timing without waiting or reporting.
+ *
+ * @param timing The timing.
+ */
+void psh_posix_timing_free(struct psh_posix_timing *timing);
+
+/** Add the resources used by one process to a total. CPU times, I/O and
+ * context switches are summed, the peak RSS is the largest one.
+ *
+ * @param total The total.
+ * @param usage Resources used by the process.
+ */
+void psh_posix_add_usage(struct rusage *total, const struct rusage *usage);
+
+/** Convert resources reported by wait4() for the job table.
+ *
+ * @param usage Resources used.
+ * @param job_usage Where to store them.
+ */
+void psh_posix_job_usage(const struct rusage *usage,
+                         struct _psh_job_usage *job_usage);
+
+/** Set PSH_LAST_RUSAGE to the resources used by a foreground pipeline, like
+ * `real=0.501 user=0.120 sys=0.010 maxrss=1780 inblock=0 oublock=8 nvcsw=2
+ * nivcsw=0', times in seconds and the peak RSS in kilobytes.
+ *
+ * @param state Psh internal state.
+ * @param usage Resources used by all of its processes.
+ * @param real Wall-clock time it took in microseconds.
+ */
+void psh_posix_set_last_usage(psh_state *state, const struct rusage *usage,
+                              long long real);
+
+#endif /* _PSH_POSIX2_H */
@@ -18,26 +18,35 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+/* wait4(2) */
+#define _DEFAULT_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "backend.h"
 #include "builtin.h"
+#include "filpinfo.h"
 #include "jobs.h"
 #include "libpsh/hash.h"
 #include "libpsh/path_searcher.h"
 #include "libpsh/util.h"
 #include "libpsh/xmalloc.h"
+#include "posix2.h"
 #include "psh.h"
 #include "util.h"
 #include "variable.h"
@@ -64,181 +73,311 @@
         }                                                                      \
     } while (0)
 
-/** Type of a file-descriptor backup. */
-typedef int **fd_backup;
+/* Backups and {varname} descriptors are allocated at or above this, out of
+ * the way of the small numbers scripts use */
+#define FD_FLOOR 10
+/* Number of backups that fit in a struct fd_backup without allocation */
+#define FD_BACKUP_INLINE 8
 
-/** Set up redirections and optionally backup file descriptors.
+/** @brief A file descriptor saved before redirecting it. */
+struct fd_saved
+{
+    /** The redirected file descriptor. */
+    int fd;
+    /** Close-on-exec duplicate of the original, -1 if it was closed. */
+    int copy;
+};
+
+/** @brief File descriptors saved while redirecting a builtin. */
+struct fd_backup
+{
+    /** Saved descriptors, @ref inline_saved until more are needed. */
+    struct fd_saved *saved;
+    /** Number of used entries. */
+    size_t used;
+    /** Number of entries available in @ref saved. */
+    size_t size;
+    /** Storage for the common case. */
+    struct fd_saved inline_saved[FD_BACKUP_INLINE];
+};
+
+/** Initialize an empty backup. */
+static void fd_backup_init(struct fd_backup *backup)
+{
+    backup->saved = backup->inline_saved;
+    backup->used = 0;
+    backup->size = FD_BACKUP_INLINE;
+}
+
+/** Save a file descriptor before it is redirected.
+ *
+ * The copy is close-on-exec, so it never leaks into the commands run while it
+ * is alive. Closed fds are saved as -1, which is what fcntl() returns on
+ * EBADF.
+ *
+ * @param state Psh internal state.
+ * @param backup The backup to add to.
+ * @param fd The file descriptor to save.
+ * @return 0 on success, 1 on error.
+ */
+static int backup_fd(psh_state *state, struct fd_backup *backup, int fd)
+{
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, FD_FLOOR);
+    if (copy < 0 && errno != EBADF)
+    {
+        OUT2E("%s: %d: %s\n", state->argv0, fd, strerror(errno));
+        return 1;
+    }
+    if (backup->used == backup->size)
+    {
+        backup->size *= 2;
+        if (backup->saved == backup->inline_saved)
+        {
+            backup->saved = xmalloc(sizeof(struct fd_saved) * backup->size);
+            memcpy(backup->saved, backup->inline_saved,
+                   sizeof(backup->inline_saved));
+        }
+        else
+            backup->saved = xrealloc(backup->saved,
+                                     sizeof(struct fd_saved) * backup->size);
+    }
+    backup->saved[backup->used].fd = fd;
+    backup->saved[backup->used].copy = copy;
+    ++backup->used;
+    return 0;
+}
+
+/** Restore the file descriptors in a backup and release it.
+ *
+ * The entries are restored in reverse order, so an fd redirected several
+ * times gets its very first value back.
+ *
+ * @return 0 on success, 1 if any fd couldn't be restored.
+ */
+static int restore_fds(psh_state *state, struct fd_backup *backup)
+{
+    int ret = 0;
+    /* Output buffered while redirected belongs to the redirection */
+    fflush(stdout);
+    while (backup->used)
+    {
+        struct fd_saved *saved = &backup->saved[--backup->used];
+        if (saved->copy < 0)
+        {
+            close(saved->fd);
+            continue;
+        }
+        /* dup2() replaces the redirected fd in one step */
+        if (dup2(saved->copy, saved->fd) < 0)
+        {
+            OUT2E("%s: %d: %s\n", state->argv0, saved->fd, strerror(errno));
+            ret = 1;
+        }
+        close(saved->copy);
+    }
+    if (backup->saved != backup->inline_saved)
+        xfree(backup->saved);
+    return ret;
+}
+
+/** Keep the redirections in a backup and release it, as done by exec. */
+static void discard_fds(struct fd_backup *backup)
+{
+    while (backup->used)
+    {
+        struct fd_saved *saved = &backup->saved[--backup->used];
+        if (saved->copy >= 0)
+            close(saved->copy);
+    }
+    if (backup->saved != backup->inline_saved)
+        xfree(backup->saved);
+}
+
+/** Make the left-hand side of a redirection refer to what @p from does.
  *
- * For the backup, originally closed fds are saved as -1, which is what dup
- * returns on EBADF, so we don't need to explicitly backup closed fds.
+ * @param state Psh internal state.
+ * @param redirect The redirection.
+ * @param from The file descriptor to duplicate.
+ * @param owned Whether @p from was opened for this redirection and should be
+ * closed.
+ * @return 0 on success, 1 on error.
+ */
+static int redirect_fd(psh_state *state, struct _psh_redirect *redirect,
+                       int from, int owned)
+{
+    int target = redirect->lhs.fd;
+    if (redirect->fd_varname)
+    {
+        /* {varname}>file: a new fd that stays open after the command */
+        union _psh_vfa_value payload;
+        target = fcntl(from, F_DUPFD, FD_FLOOR);
+        if (owned)
+            close(from);
+        if (target < 0)
+        {
+            OUT2E("%s: %s: %s\n", state->argv0, redirect->fd_varname,
+                  strerror(errno));
+            return 1;
+        }
+        payload.integer = target;
+        psh_vf_set(state, redirect->fd_varname, PSH_VFA_INTEGER, payload, 0,
+                   0, 0);
+        return 0;
+    }
+    if (from == target)
+    {
+        /* open() reused the closed target, which must survive exec */
+        if (owned && fcntl(target, F_SETFD, 0) < 0)
+        {
+            OUT2E("%s: %d: %s\n", state->argv0, target, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+    if (dup2(from, target) < 0)
+    {
+        OUT2E("%s: %d: %s\n", state->argv0, from, strerror(errno));
+        if (owned)
+            close(from);
+        return 1;
+    }
+    if (owned)
+        close(from);
+    return 0;
+}
+
+/** Get the file descriptor stored in a variable by {varname}>file, for
+ * {varname}>&-.
+ *
+ * @param state Psh internal state.
+ * @param varname Name of the variable.
+ * @return The file descriptor, -1 if the variable doesn't hold one.
+ */
+static int varname_fd(psh_state *state, const char *varname)
+{
+    const struct _psh_vfa_container *var = psh_vf_get(state, varname, 0, 0);
+    if (!var ||
+        (var->attributes & (PSH_VFA_INTEGER | PSH_VFA_UNSET |
+                            PSH_VFA_INDEX_ARRAY | PSH_VFA_ASSOC_ARRAY)) !=
+            PSH_VFA_INTEGER ||
+        var->payload.integer < 0 || var->payload.integer > INT_MAX)
+    {
+        OUT2E("%s: %s: ambiguous redirect\n", state->argv0, varname);
+        return -1;
+    }
+    return (int)var->payload.integer;
+}
+
+/** Set up redirections and optionally backup file descriptors.
  *
  * @param state Psh internal state
  * @param redirect Redirections
- * @param if_backup Whether to back up redirected file descriptors.
- * @param backup If @ref if_backup is true, a list of int[2]s with the file
- * descriptors that were backed up is allocated and returned, in which [0]
- * is the original and [1] is the replaced. In this case, @ref backup should be
- * free()d. If @ref if_backup is 0, This argument is ignored.
- * @return 0 on success, 1 on error, but *@ref backup should still be free()d.
+ * @param backup If not NULL, the redirected file descriptors are saved here,
+ * to be passed to @ref restore_fds or @ref discard_fds even if this function
+ * fails.
+ * @return 0 on success, 1 on error.
  */
 static int set_up_redirection(psh_state *state, struct _psh_redirect *redirect,
-                              int if_backup, fd_backup *backup)
+                              struct fd_backup *backup)
 {
-    size_t have_size = 10, used_size = 0;
-    /* Backup file descriptors for builtin commands */
-    if (if_backup)
-        *backup = xmalloc(sizeof(int) * 2 * have_size);
-#define BACKUP_FD(fd)                                                          \
-    do                                                                         \
-    {                                                                          \
-        if (!if_backup)                                                        \
-            break;                                                             \
-        (*backup)[used_size][0] = (fd);                                        \
-        (*backup)[used_size][1] = dup((fd));                                   \
-        if ((*backup)[used_size][1] < 0 && errno != EBADF)                     \
-            /* Backup failed */                                                \
-            return 2;                                                          \
-        if (++used_size >= have_size)                                          \
-            *backup = xrealloc(*backup, sizeof(int) * 2 * (have_size *= 2));   \
-    } while (0)
-
-    while (redirect)
+    for (; redirect; redirect = redirect->next)
     {
+        int from = -1, flags = 0, owned = 1;
+#ifdef DEBUG
+        printf("redirect(%d, %d)\n", redirect->type, redirect->lhs.fd);
+#endif
+        if (redirect->type == PSH_REDIR_NONE)
+            continue;
+        /* Backed up before open(), which could reuse a closed lhs */
+        if (backup && !redirect->fd_varname &&
+            backup_fd(state, backup, redirect->lhs.fd))
+            return 1;
         switch (redirect->type)
         {
-            case PSH_REDIR_NONE:
-                /* This case currently exists, but should not. #4 TODO */
-                break;
             case PSH_REDIR_OUT_REDIR:
-            {
-                int file_fd;
-#ifdef DEBUG
-                printf("output(%d, %s)\n", redirect->lhs.fd,
-                       redirect->rhs.file);
-#endif
                 /* if piping and redirecting output, bash actually respects
                  * the redirect instead of the pipe, but I dislike that.
                  * However, here the pipe's fd is actually overriden. */
-                /* Open output file */
-                file_fd = open(redirect->rhs.file, O_WRONLY | O_CREAT | O_TRUNC,
-                               0644);
-                DO_THIS_OR_FAIL_MAIN((file_fd < 0), "open", 1);
-                BACKUP_FD(redirect->lhs.fd);
-                close(redirect->lhs.fd);
-                DO_THIS_OR_FAIL_MAIN((dup2(file_fd, redirect->lhs.fd) < 0),
-                                     "dup2", 1);
-                close(file_fd);
+                flags = O_WRONLY | O_CREAT | O_TRUNC;
                 break;
-            }
             case PSH_REDIR_OUT_APPN:
-            {
-                int file_fd;
-#ifdef DEBUG
-                printf("append(%d, %s)\n", redirect->lhs.fd,
-                       redirect->rhs.file);
-#endif
-                file_fd = open(redirect->rhs.file,
-                               O_WRONLY | O_CREAT | O_APPEND, 0644);
-                DO_THIS_OR_FAIL_MAIN((file_fd < 0), "open", 1);
-                BACKUP_FD(redirect->lhs.fd);
-                close(redirect->lhs.fd);
-                DO_THIS_OR_FAIL_MAIN((dup2(file_fd, redirect->lhs.fd) < 0),
-                                     "dup2", 1);
-                close(file_fd);
+                flags = O_WRONLY | O_CREAT | O_APPEND;
                 break;
-            }
             case PSH_REDIR_IN_REDIR:
-            {
-                int file_fd;
-#ifdef DEBUG
-                printf("input(%d, %s)\n", redirect->lhs.fd, redirect->rhs.file);
-#endif
-                file_fd = open(redirect->rhs.file, O_RDONLY, 0644);
-                DO_THIS_OR_FAIL_MAIN((file_fd < 0), "open", 1);
-                BACKUP_FD(redirect->lhs.fd);
-                close(redirect->lhs.fd);
-                DO_THIS_OR_FAIL_MAIN((dup2(file_fd, redirect->lhs.fd) < 0),
-                                     "dup2", 1);
-                close(file_fd);
-                break;
-            }
-            case PSH_REDIR_FD2FD:
-#ifdef DEBUG
-                printf("fd_dup(%d, %d)\n", redirect->lhs.fd, redirect->rhs.fd);
-#endif
-                BACKUP_FD(redirect->lhs.fd);
-                close(redirect->lhs.fd);
-                DO_THIS_OR_FAIL_MAIN(
-                    (dup2(redirect->rhs.fd, redirect->lhs.fd) < 0), "dup2", 1);
-                break;
-            case PSH_REDIR_CLOSEFD:
-#ifdef DEBUG
-                printf("close(%d, %d)\n", redirect->lhs.fd, redirect->rhs.fd);
-#endif
-                BACKUP_FD(redirect->lhs.fd);
-                close(redirect->lhs.fd);
+                flags = O_RDONLY;
                 break;
             case PSH_REDIR_OPENFN:
-            {
-                int file_fd;
-#ifdef DEBUG
-                printf("open(%d, %s)\n", redirect->lhs.fd, redirect->rhs.file);
-#endif
-                file_fd = open(redirect->rhs.file, O_RDWR | O_CREAT, 0644);
-                DO_THIS_OR_FAIL_MAIN((file_fd < 0), "open", 1);
-                BACKUP_FD(redirect->lhs.fd);
-                close(redirect->lhs.fd);
-                DO_THIS_OR_FAIL_MAIN((dup2(file_fd, redirect->lhs.fd) < 0),
-                                     "dup2", 1);
-                close(file_fd);
+                flags = O_RDWR | O_CREAT;
+                break;
+            case PSH_REDIR_FD2FD:
+                from = redirect->rhs.fd;
+                owned = 0;
                 break;
-            }
             case PSH_REDIR_HEREXX:
-            {
-                int file_fd;
-#ifdef DEBUG
-                printf("herexx(%d, %p)\n", redirect->lhs.fd,
-                       redirect->rhs.herexx);
-#endif
-                file_fd = open(redirect->rhs.file, O_RDONLY, 0644);
-                DO_THIS_OR_FAIL_MAIN((file_fd < 0), "open", 1);
-                BACKUP_FD(redirect->lhs.fd);
-                close(redirect->lhs.fd);
-                DO_THIS_OR_FAIL_MAIN((dup2(file_fd, redirect->lhs.fd) < 0),
-                                     "dup2", 1);
-                close(file_fd);
+                from = redirect->rhs.fd;
+                owned = 0;
                 break;
-            }
+            case PSH_REDIR_CLOSEFD:
+                if (!redirect->fd_varname)
+                    close(redirect->lhs.fd);
+                else if ((from = varname_fd(state, redirect->fd_varname)) < 0)
+                    return 1;
+                else
+                    close(from);
+                continue;
             default:
                 code_fault(state, __FILE__, __LINE__);
         }
-        redirect = redirect->next;
+        if (owned)
+        {
+            /* The fd that is kept is a dup2()ed one without O_CLOEXEC */
+            from = psh_posix_open_socket(state, redirect->rhs.file);
+            if (from == -1)
+                return 1;
+            if (from == -2)
+                from = open(redirect->rhs.file, flags | O_CLOEXEC, 0644);
+            if (from < 0)
+            {
+                OUT2E("%s: %s: %s\n", state->argv0, redirect->rhs.file,
+                      strerror(errno));
+                return 1;
+            }
+        }
+        if (redirect_fd(state, redirect, from, owned))
+            return 1;
     }
-    if (if_backup)
-        (*backup)[used_size] = NULL;
     return 0;
 }
 
-/** Restore file descriptors that were backed up */
-static int restore_fds(psh_state *state, fd_backup restore_spec)
+/** Connect a child process to its pipes.
+ *
+ * @param state Psh internal state.
+ * @param pipe_in Pipe for stdin, 0 if none.
+ * @param pipe_out Pipe for stdout, 0 if none.
+ * @param pipe_close1 The other end of the pipe to be closed.
+ * @param pipe_close2 The other end of the pipe to be closed.
+ */
+static void child_set_up_pipes(psh_state *state, int pipe_in, int pipe_out,
+                               int pipe_close1, int pipe_close2)
 {
-    while (*restore_spec)
+#ifdef DEBUG
+    printf("pipe(%d, %d)\n", pipe_in, pipe_out);
+#endif
+    if (pipe_in)
     {
-        /* Close the original, restore_spec[0][0] */
-        close(**restore_spec);
-        /* -1 indicates that the fd was originally closed. */
-        if ((*restore_spec)[1] >= 0)
-        {
-            /* Replace the original with the restored */
-            DO_THIS_OR_FAIL_MAIN((dup2((*restore_spec)[1], **restore_spec) < 0),
-                                 "dup2", 1);
-            /* Close the restored */
-            close((*restore_spec)[1]);
-        }
-        /* Get the next one */
-        ++restore_spec;
+        DO_THIS_OR_FAIL((dup2(pipe_in, STDIN_FILENO) < 0), "dup2");
+        close(pipe_in);
     }
-    return 0;
+    if (pipe_out)
+    {
+        DO_THIS_OR_FAIL((dup2(pipe_out, STDOUT_FILENO) < 0), "dup2");
+        close(pipe_out);
+    }
+    /* Close the other end of the pipes */
+    if (pipe_close1)
+        close(pipe_close1);
+    if (pipe_close2)
+        close(pipe_close2);
 }
 
 /** Execute one command.
@@ -251,6 +390,8 @@ static int restore_fds(psh_state *state, fd_backup restore_spec)
  * @param pipe_close2 The other end of the pipe to be closed.
  * @param builtin A builtin function if this command is a builtin.
  * @param cmd_realpath Full path to the command.
+ * @param cpu The CPU to pin the process to, -1 if none.
+ * @param sched How to reschedule the process, NULL to leave it as is.
  * @note If both @ref builtin and @ref cmd_realpath are NULL, nothing will be
  * executed, but a process will still be created.
  * @return The PID of the forked process.
@@ -258,9 +399,15 @@ static int restore_fds(psh_state *state, fd_backup restore_spec)
 static pid_t execute_single_cmd(psh_state *state, struct _psh_command *cmd,
                                 int pipe_in, int pipe_out, int pipe_close1,
                                 int pipe_close2, builtin_function builtin,
-                                char *cmd_realpath)
+                                char *cmd_realpath, int cpu,
+                                const struct psh_posix_sched *sched)
 {
-    pid_t pid = fork();
+    /* Built here so that the shell keeps the formatted entries */
+    char **envp = psh_vf_envp(state);
+    pid_t pid;
+    /* Otherwise the child could flush what the shell has buffered */
+    fflush(stdout);
+    pid = fork();
     DO_THIS_OR_FAIL_MAIN((pid < 0), "fork", -1);
     if (pid > 0)
     {
@@ -274,56 +421,27 @@ static pid_t execute_single_cmd(psh_state *state, struct _psh_command *cmd,
     {
         /* Child process */
         struct _psh_redirect *redirect = cmd->rlist;
-        /* Set up pipes. Bash always sets up pipes prior to processing
-         * redirection */
-#ifdef DEBUG
-        printf("%s = pipe(%d, %d)\n", cmd->argv[0], pipe_in, pipe_out);
-#endif
-        if (pipe_in)
-        {
-            close(STDIN_FILENO);
-#ifdef DEBUG
-            printf("%s = dup2(%d, %d)\n", cmd->argv[0], pipe_in, STDIN_FILENO);
-#endif
-            DO_THIS_OR_FAIL((dup2(pipe_in, STDIN_FILENO) < 0), "dup2");
-            close(pipe_in);
-        }
-        if (pipe_out)
-        {
-            close(STDOUT_FILENO);
-#ifdef DEBUG
-            printf("%s = dup2(%d, %d)\n", cmd->argv[0], pipe_out,
-                   STDOUT_FILENO);
-#endif
-            DO_THIS_OR_FAIL((dup2(pipe_out, STDOUT_FILENO) < 0), "dup2");
-            close(pipe_out);
-        }
-        /* Close the other end of the pipes */
-        if (pipe_close1)
-            close(pipe_close1);
-        if (pipe_close2)
-            close(pipe_close2);
+        if (cpu >= 0)
+            psh_posix_pin_cpu(state, cpu);
+        /* bgsched reschedules the command itself */
+        if (sched && builtin != builtin_bgsched)
+            psh_posix_apply_sched(state, sched);
+        /* Bash always sets up pipes prior to processing redirection */
+        child_set_up_pipes(state, pipe_in, pipe_out, pipe_close1, pipe_close2);
         /* Process other redirections */
-        if (set_up_redirection(state, redirect, 0, NULL))
+        if (set_up_redirection(state, redirect, NULL))
             _Exit(1);
         /* Run the command */
-        if (builtin)
-            /* Run a builtin */
-            _Exit((*builtin)(get_argc(cmd->argv), cmd->argv, state));
-        if (cmd_realpath)
-        {
-            /* An on-disk command */
-            execv(cmd_realpath, cmd->argv);
-            OUT2E("%s: %s: %s\n", state->argv0, cmd_realpath, strerror(errno));
-            _Exit(127);
-        }
+        if (builtin || cmd_realpath)
+            psh_posix_exec_command(state, builtin, cmd_realpath, cmd->argv,
+                                   envp);
         _Exit(127);
     }
     /* Control shouldn't reach here */
     code_fault(state, __FILE__, __LINE__);
 }
 
-static char *get_cmd_realpath(psh_state *state, char *cmd)
+char *psh_posix_command_path(psh_state *state, char *cmd)
 {
     if (strchr(cmd, '/'))
         /* A command with a path */
@@ -344,7 +462,7 @@ static char *get_cmd_realpath(psh_state *state, char *cmd)
         char *name = xmalloc(strlen(cmd) + 2);
         name[0] = '/';
         psh_strncpy(name + 1, cmd, strlen(cmd));
-        exec_path = psh_search_path(psh_vf_getstr(state, "PATH"),
+        exec_path = psh_search_path(psh_vf_getstr_special(state, PSH_VF_PATH),
                                     psh_backend_path_separator, name,
                                     &psh_backend_file_exists);
         xfree(name);
@@ -361,6 +479,291 @@ static char *get_cmd_realpath(psh_state *state, char *cmd)
     return exec_path;
 }
 
+/** Replace the shell with a command, used when nothing is left to be done
+ * after it.
+ *
+ * @param state Psh internal state.
+ * @param cmd Command.
+ * @return Only returns on failure, with the exit status.
+ */
+static int exec_in_place(psh_state *state, struct _psh_command *cmd)
+{
+    char *cmd_realpath = psh_posix_command_path(state, cmd->argv[0]);
+    if (cmd_realpath == NULL)
+        return 127;
+    if (set_up_redirection(state, cmd->rlist, NULL))
+        return 1;
+    fflush(stdout);
+    execve(cmd_realpath, cmd->argv, psh_vf_envp(state));
+    OUT2E("%s: %s: %s\n", state->argv0, cmd_realpath, strerror(errno));
+    return 127;
+}
+
+void psh_posix_exec_command(psh_state *state, builtin_function builtin,
+                            const char *path, char **argv, char **envp)
+{
+    if (builtin == builtin_bgsched)
+        /* Nothing is left to wait for the command */
+        psh_posix_exec_bgsched(state, argv);
+    if (builtin)
+    {
+        int status;
+        psh_posix_subshell(state);
+        status = (*builtin)(get_argc(argv), argv, state);
+        fflush(stdout);
+        _Exit(status);
+    }
+    execve(path, argv, envp);
+    OUT2E("%s: %s: %s\n", state->argv0, path, strerror(errno));
+    _Exit(errno == ENOENT ? 127 : 126);
+}
+
+pid_t psh_posix_launch(psh_state *state, builtin_function builtin,
+                       const char *path, char **argv,
+                       const struct psh_posix_sched *sched,
+                       const sigset_t *mask)
+{
+    /* Built here so that the shell keeps the formatted entries */
+    char **envp = psh_vf_envp(state);
+    pid_t pid;
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+    {
+        OUT2E("%s: fork: %s\n", state->argv0, strerror(errno));
+        return -1;
+    }
+    if (pid > 0)
+        return pid;
+    if (mask)
+        sigprocmask(SIG_SETMASK, mask, NULL);
+    if (sched)
+        psh_posix_apply_sched(state, sched);
+    psh_posix_exec_command(state, builtin, path, argv, envp);
+}
+
+int psh_posix_run_external(psh_state *state, char **argv)
+{
+    int status;
+    pid_t pid;
+    char *cmd_realpath = psh_posix_command_path(state, argv[0]);
+    if (cmd_realpath == NULL)
+        return 127;
+    if ((pid = psh_posix_launch(state, NULL, cmd_realpath, argv, NULL,
+                                NULL)) < 0)
+        return 1;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return 1;
+    return psh_backend_exit_status(status);
+}
+
+/** Start a pipeline stage, looking up the builtin or on-disk command.
+ *
+ * @return The PID of the forked process, -1 on error.
+ */
+static pid_t launch_stage(psh_state *state, struct _psh_command *cmd,
+                          int pipe_in, int pipe_out, int pipe_close1,
+                          int pipe_close2, int cpu,
+                          const struct psh_posix_sched *sched)
+{
+    builtin_function builtin = find_builtin(cmd->argv[0]);
+    if (builtin)
+        return execute_single_cmd(state, cmd, pipe_in, pipe_out, pipe_close1,
+                                  pipe_close2, builtin, NULL, cpu, sched);
+    return execute_single_cmd(
+        state, cmd, pipe_in, pipe_out, pipe_close1, pipe_close2, NULL,
+        psh_posix_command_path(state, cmd->argv[0]), cpu, sched);
+}
+
+/** Start a command asynchronously: a simple command like a pipeline stage, a
+ * list of commands in a forked shell connected the same way.
+ *
+ * @return The PID of the forked process, -1 on error.
+ */
+static pid_t launch_async(psh_state *state, struct _psh_command *cmd,
+                          int pipe_in, int pipe_out, int pipe_close1,
+                          int pipe_close2)
+{
+    pid_t pid;
+    if (cmd->next == NULL)
+    {
+        if (psh_expand_command(state, cmd) != 0)
+            return -1;
+        return launch_stage(state, cmd, pipe_in, pipe_out, pipe_close1,
+                            pipe_close2, -1, NULL);
+    }
+    fflush(stdout);
+    pid = fork();
+    DO_THIS_OR_FAIL_MAIN((pid < 0), "fork", -1);
+    if (pid == 0)
+    {
+        child_set_up_pipes(state, pipe_in, pipe_out, pipe_close1,
+                           pipe_close2);
+        psh_posix_subshell(state);
+        state->exec_last = 1;
+        psh_backend_do_run(state, cmd);
+        fflush(stdout);
+        _Exit((int)psh_vf_get_status(state));
+    }
+    return pid;
+}
+
+int psh_backend_procsub(psh_state *state, struct _psh_command *command,
+                        int readable, char *path, size_t size)
+{
+    int pipe_fd[2], shell_end, child_end;
+    pid_t pid;
+    if (pipe(pipe_fd) != 0)
+    {
+        OUT2E("%s: pipe: %s\n", state->argv0, strerror(errno));
+        return -1;
+    }
+    shell_end = readable ? pipe_fd[0] : pipe_fd[1];
+    child_end = readable ? pipe_fd[1] : pipe_fd[0];
+    pid = launch_async(state, command, readable ? 0 : child_end,
+                       readable ? child_end : 0, shell_end, 0);
+    close(child_end);
+    if (pid < 0)
+    {
+        close(shell_end);
+        return -1;
+    }
+    psh_jobs_add(state, command->argv[0], pid, PSH_CMD_BACKGROUND);
+    snprintf(path, size, "/dev/fd/%d", shell_end);
+    return shell_end;
+}
+
+/** Start a coprocess and store its file descriptors in NAME[0] (its output)
+ * and NAME[1] (its input), and its PID in NAME_PID.
+ *
+ * @param state Psh internal state.
+ * @param cmd The `coproc NAME' command.
+ * @return Exit status.
+ */
+static int start_coproc(psh_state *state, struct _psh_command *cmd)
+{
+    int to_coproc[2], from_coproc[2], idx;
+    const char *name = cmd->argv[1];
+    char *pid_name;
+    union _psh_vfa_value payload;
+    pid_t pid;
+    if (pipe(to_coproc) != 0)
+    {
+        OUT2E("%s: pipe: %s\n", state->argv0, strerror(errno));
+        return 1;
+    }
+    if (pipe(from_coproc) != 0)
+    {
+        OUT2E("%s: pipe: %s\n", state->argv0, strerror(errno));
+        close(to_coproc[0]);
+        close(to_coproc[1]);
+        return 1;
+    }
+    pid = launch_async(state, cmd->coproc, to_coproc[0], from_coproc[1],
+                       to_coproc[1], from_coproc[0]);
+    close(to_coproc[0]);
+    close(from_coproc[1]);
+    if (pid < 0)
+    {
+        close(to_coproc[1]);
+        close(from_coproc[0]);
+        return 1;
+    }
+    payload.int_array = xmalloc(sizeof(intmax_t) * 2);
+    payload.int_array[0] = from_coproc[0];
+    payload.int_array[1] = to_coproc[1];
+    for (idx = 0; idx < 2; ++idx)
+    {
+        /* Out of the way of other redirections and other children, so that
+         * the coprocess sees EOF once the shell closes its input */
+        int moved = fcntl((int)payload.int_array[idx], F_DUPFD_CLOEXEC,
+                          FD_FLOOR);
+        if (moved >= 0)
+        {
+            close((int)payload.int_array[idx]);
+            payload.int_array[idx] = moved;
+        }
+    }
+    psh_vf_set(state, name, PSH_VFA_INDEX_ARRAY | PSH_VFA_INTEGER, payload, 2,
+               0, 0);
+    pid_name = xmalloc(strlen(name) + sizeof("_PID"));
+    strcpy(pid_name, name);
+    strcat(pid_name, "_PID");
+    payload.integer = pid;
+    psh_vf_set(state, pid_name, PSH_VFA_INTEGER, payload, 0, 0, 0);
+    xfree(pid_name);
+    psh_jobs_add(state, cmd->argv[1], pid, PSH_CMD_BACKGROUND);
+    return 0;
+}
+
+/** Block until a job slot is free, that is until fewer background jobs than
+ * PSH_MAXJOBS are running. A background pipeline takes one slot.
+ *
+ * @param state Psh internal state.
+ * @return 0, or the number of the signal that interrupted the wait.
+ */
+static int wait_job_slot(psh_state *state)
+{
+    const char *limit = psh_vf_getstr(state, "PSH_MAXJOBS");
+    long max;
+    if (limit == NULL || (max = atol(limit)) <= 0)
+        /* Unlimited */
+        return 0;
+    while (psh_jobs_running(state) >= (size_t)max)
+    {
+        /* Slots are released as the jobs are reaped */
+        int sig = psh_backend_wait_children(state);
+        if (sig)
+            return sig;
+    }
+    return 0;
+}
+
+/** Wait for a foreground process.
+ *
+ * @param pid Its PID.
+ * @param total Where to add the resources it used, or NULL.
+ * @return Its status as returned by wait().
+ */
+static int wait_foreground(pid_t pid, struct rusage *total)
+{
+    struct rusage usage;
+    int wait_stat;
+    while (wait4(pid, &wait_stat, 0, &usage) < 0)
+        if (errno != EINTR)
+            return 127 << 8;
+    if (total)
+        psh_posix_add_usage(total, &usage);
+    return wait_stat;
+}
+
+/** Wait for the stages of a foreground pipeline.
+ *
+ * @param pids PIDs of the stages, -1 for those that weren't started.
+ * @param count Number of entries in @p pids.
+ * @param total Where to add the resources they used, or NULL.
+ * @return The number of stages waited for.
+ */
+static size_t wait_stages(const pid_t *pids, size_t count,
+                          struct rusage *total)
+{
+    size_t idx, waited = 0;
+    for (idx = 0; idx < count; ++idx)
+        if (pids[idx] > 0)
+        {
+            wait_foreground(pids[idx], total);
+            ++waited;
+        }
+    return waited;
+}
+
+int psh_backend_exit_status(int wait_stat)
+{
+    if (WIFSIGNALED(wait_stat))
+        return 128 + WTERMSIG(wait_stat);
+    return WEXITSTATUS(wait_stat);
+}
+
 int psh_backend_do_run(psh_state *state, struct _psh_command *cmd)
 {
     int i = 0;
@@ -368,7 +771,28 @@ int psh_backend_do_run(psh_state *state, struct _psh_command *cmd)
     int status;
     builtin_function builtin;
     int error_level = 0;
-    int should_be_run = 1;
+    /* How the current pipeline follows the one before: after && or ||, it
+     * is only run if the status allows */
+    enum _psh_cmd_type link = PSH_CMD_SINGLE;
+    struct psh_posix_timing *timing = NULL;
+    /* CPUs for the stages of the current pipeline */
+    int *cpus = NULL;
+    size_t cpu_count = 0, stage = 0;
+    /* Stages of the current pipeline but the last, waited for at its end */
+    pid_t *stage_pids = NULL;
+    size_t stage_slots = 0;
+    /* Whether the current pipeline ends with & */
+    int in_background = 0;
+    /* Its job, once its first stage has been started */
+    int bg_job = 0;
+    /* How its stages are scheduled, if they should be rescheduled */
+    struct psh_posix_sched bgsched;
+    int rescheduled = 0;
+    /* Resources used by its stages if it's run in the foreground, for
+     * PSH_LAST_RUSAGE */
+    struct rusage fg_usage;
+    long long fg_start = 0;
+    int fg_waited = 0;
 
 #ifdef DEBUG
     printf("command position: %p\n", cmd);
@@ -376,6 +800,7 @@ int psh_backend_do_run(psh_state *state, struct _psh_command *cmd)
     while (++i, cmd)
     {
         int pipe_fd[2] = {0};
+        int cpu, sig;
         pid_t pid;
 #ifdef DEBUG
         printf("part %d:\n"
@@ -386,32 +811,113 @@ int psh_backend_do_run(psh_state *state, struct _psh_command *cmd)
             printf("argv[%d] = %s\n", j, cmd->argv[j]);
         printf("flag: %d\n", cmd->type);
 #endif
+        if (stage == 0)
+        {
+            /* A new pipeline, no foreground process is running */
+            struct _psh_command *last = cmd;
+            while (last->type == PSH_CMD_PIPED && last->next)
+                last = last->next;
+            if ((link == PSH_CMD_RUN_AND && psh_vf_get_status(state) != 0) ||
+                (link == PSH_CMD_RUN_OR && psh_vf_get_status(state) == 0))
+            {
+                /* Skipped, keeping the status for the next && or || */
+                for (; cmd != last; cmd = cmd->next)
+                    command_release_fds(cmd);
+                fg_waited = 0;
+                goto cont;
+            }
+            in_background = last->type == PSH_CMD_BACKGROUND;
+            bg_job = 0;
+            psh_backend_reap(state);
+            if (in_background && (sig = wait_job_slot(state)))
+            {
+                /* Interrupted, drop the whole pipeline */
+                psh_vf_set_status(state, 128 + sig);
+                for (; cmd != last; cmd = cmd->next)
+                    command_release_fds(cmd);
+                goto cont;
+            }
+            /* `time pipeline &' isn't waited for, so it is not timed */
+            if (cmd->timed && !in_background)
+                timing = psh_posix_timing_start(cmd->timed == 2);
+            if (cmd->type == PSH_CMD_PIPED)
+                cpus = psh_posix_pipeline_cpus(state, &cpu_count);
+            rescheduled =
+                in_background && psh_posix_background_sched(state, &bgsched);
+            memset(&fg_usage, 0, sizeof(struct rusage));
+            fg_start = psh_backend_now();
+            fg_waited = 0;
+        }
+        if (stage >= stage_slots)
+        {
+            stage_slots = stage_slots ? stage_slots * 2 : 8;
+            stage_pids = xrealloc(stage_pids, sizeof(pid_t) * stage_slots);
+        }
+        stage_pids[stage] = -1;
+        /* Only now do substitutions see what the commands before did */
+        if (psh_expand_command(state, cmd) != 0)
+        {
+            psh_vf_set_status(state, 1);
+            ++error_level;
+            goto cont;
+        }
+        if (cmd->coproc)
+        {
+            psh_vf_set_status(state, start_coproc(state, cmd));
+            goto cont;
+        }
         /* First try to find a builtin command TODO: functions */
         builtin = find_builtin(cmd->argv[0]);
+        if (!builtin && !*cmd->argv[0] && !cmd->argv[1])
+            /* Only redirections, like >file, a bare `time', or words that
+             * expanded to nothing */
+            builtin = builtin_true;
         if (builtin && cmd->type != PSH_CMD_PIPED &&
-            cmd->type != PSH_CMD_BACKGROUND)
+            cmd->type != PSH_CMD_BACKGROUND && !last_pipe_fd[0])
         {
-            /* Execute without forking if async execution is not needed */
-            fd_backup backed_up;
+            /* Execute without forking if async execution is not needed and
+             * the input isn't from a pipe */
+            struct fd_backup backed_up;
+            struct rusage before;
+            int builtin_status;
             /* Builtin commands can be redirected too */
-
-            if (set_up_redirection(state, cmd->rlist, 1, &backed_up))
+            fd_backup_init(&backed_up);
+            fflush(stdout);
+            if (set_up_redirection(state, cmd->rlist, &backed_up))
             {
-                /* Even if set_up_redirection failed, this must still be free()d
-                 */
-                xfree(backed_up);
+                /* Undo what has been redirected */
+                restore_fds(state, &backed_up);
+                psh_vf_set_status(state, 1);
                 ++error_level;
                 goto cont;
             }
             /* Run the builtin */
-            psh_vf_get(state, "?", 0, 0)->payload.integer =
-                (*builtin)(get_argc(cmd->argv), cmd->argv, state);
-            /* Restore file descriptors as we are returning to shell */
+            if (timing)
+                getrusage(RUSAGE_SELF, &before);
+            builtin_status = (*builtin)(get_argc(cmd->argv), cmd->argv, state);
+            psh_vf_set_status(state, builtin_status);
+            if (timing)
+                psh_posix_timing_add_self(timing, cmd->argv[0],
+                                          builtin_status, &before);
+            /* Restore file descriptors as we are returning to shell, except
+             * for exec, whose redirections are permanent */
             if (builtin != builtin_exec)
-                restore_fds(state, backed_up);
-            xfree(backed_up);
+                restore_fds(state, &backed_up);
+            else
+                discard_fds(&backed_up);
+            goto cont;
+        }
+        if (state->exec_last && !builtin && !cmd->next &&
+            psh_jobs_count(state) == 0 && !last_pipe_fd[0] && !timing &&
+            cmd->type == PSH_CMD_SINGLE)
+        {
+            /* The last simple command with no jobs to wait for, no trap to
+             * run and no more input: the shell would only wait and exit, so
+             * skip the fork */
+            psh_vf_set_status(state, exec_in_place(state, cmd));
             goto cont;
         }
+        cpu = cpus ? cpus[stage % cpu_count] : -1;
         if (cmd->type == PSH_CMD_PIPED)
         {
             /* Create pipe */
@@ -425,16 +931,13 @@ int psh_backend_do_run(psh_state *state, struct _psh_command *cmd)
 #endif
         }
         if (builtin)
-            pid =
-                execute_single_cmd(state, cmd, last_pipe_fd[0], pipe_fd[1],
-                                   pipe_fd[0], last_pipe_fd[1], builtin, NULL);
-        else
-        {
-            char *cmd_realpath = get_cmd_realpath(state, cmd->argv[0]);
             pid = execute_single_cmd(state, cmd, last_pipe_fd[0], pipe_fd[1],
                                      pipe_fd[0], last_pipe_fd[1], builtin,
-                                     cmd_realpath);
-        }
+                                     NULL, cpu, rescheduled ? &bgsched : NULL);
+        else
+            pid = launch_stage(state, cmd, last_pipe_fd[0], pipe_fd[1],
+                               pipe_fd[0], last_pipe_fd[1], cpu,
+                               rescheduled ? &bgsched : NULL);
         /* Make sure the used fds of the pipe are closed in the main process. */
         if (last_pipe_fd[0])
             close(last_pipe_fd[0]);
@@ -445,26 +948,87 @@ int psh_backend_do_run(psh_state *state, struct _psh_command *cmd)
         last_pipe_fd[0] = pipe_fd[0];
         last_pipe_fd[1] = pipe_fd[1];
         if (pid < 0)
-            return 1;
-        switch (cmd->type)
         {
-            case PSH_CMD_BACKGROUND:
-            case PSH_CMD_PIPED:
-                psh_jobs_add(state, cmd->argv[0], pid, cmd->type);
-                break;
-            case PSH_CMD_RUN_AND:
-                waitpid(pid, &status, 0);
-                psh_vf_get(state, "?", 0, 0)->payload.integer = status;
-                should_be_run = pid == 0 ? 0 : 0;
-                break;
-            case PSH_CMD_RUN_OR:
-            case PSH_CMD_SINGLE:
-            case PSH_CMD_MULTICMD:
-                waitpid(pid, &status, 0);
-                psh_vf_get(state, "?", 0, 0)->payload.integer = status;
+            if (timing)
+                psh_posix_timing_free(timing);
+            wait_stages(stage_pids, stage, NULL);
+            xfree(stage_pids);
+            xfree(cpus);
+            return 1;
         }
+        if (timing)
+            /* All stages are waited for once the pipeline is complete */
+            psh_posix_timing_add(timing, pid, cmd->argv[0], cpu);
+        else
+            switch (cmd->type)
+            {
+                case PSH_CMD_BACKGROUND:
+                {
+                    int id = bg_job;
+                    union _psh_vfa_value payload;
+                    if (id)
+                        psh_jobs_add_stage(state, id, cmd->argv[0], pid);
+                    else
+                        id = psh_jobs_add(state, cmd->argv[0], pid, cmd->type);
+                    /* $! for wait */
+                    payload.integer = pid;
+                    psh_vf_set(state, "!", PSH_VFA_INTEGER, payload, 0, 0, 0);
+                    if (state->interactive)
+                        OUT2E("[%d] %ld\n", id, (long)pid);
+                    break;
+                }
+                case PSH_CMD_PIPED:
+                    /* The whole pipeline is one job */
+                    if (in_background && bg_job)
+                        psh_jobs_add_stage(state, bg_job, cmd->argv[0], pid);
+                    else if (in_background)
+                        bg_job = psh_jobs_add(state, cmd->argv[0], pid,
+                                              PSH_CMD_BACKGROUND);
+                    else
+                        stage_pids[stage] = pid;
+                    break;
+                case PSH_CMD_RUN_AND:
+                    status = wait_foreground(pid, &fg_usage);
+                    fg_waited = 1;
+                    psh_vf_set_status(state, psh_backend_exit_status(status));
+                    break;
+                case PSH_CMD_RUN_OR:
+                case PSH_CMD_SINGLE:
+                case PSH_CMD_MULTICMD:
+                    status = wait_foreground(pid, &fg_usage);
+                    fg_waited = 1;
+                    psh_vf_set_status(state, psh_backend_exit_status(status));
+            }
     cont:
+        if (timing && (cmd->type != PSH_CMD_PIPED || !cmd->next))
+        {
+            /* The end of the timed pipeline */
+            int timed_status =
+                psh_posix_timing_finish(state, timing, &fg_usage);
+            if (timed_status >= 0)
+                psh_vf_set_status(state, timed_status);
+            timing = NULL;
+            fg_waited = 1;
+        }
+        if (cmd->type == PSH_CMD_PIPED && cmd->next)
+            ++stage;
+        else
+        {
+            /* The last stage has been waited for already */
+            if (wait_stages(stage_pids, stage, &fg_usage))
+                fg_waited = 1;
+            if (fg_waited)
+                psh_posix_set_last_usage(state, &fg_usage,
+                                         psh_backend_now() - fg_start);
+            xfree(cpus);
+            cpus = NULL;
+            stage = 0;
+            link = cmd->type;
+        }
+        /* Process substitutions are connected to the command by now */
+        command_release_fds(cmd);
         cmd = cmd->next;
     }
+    xfree(stage_pids);
     return 0;
 }
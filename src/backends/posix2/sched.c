@@ -0,0 +1,133 @@
+/*
+    psh/backends/posix2/sched.c - scheduling classes of background jobs
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* SCHED_BATCH, SCHED_IDLE and syscall(2) */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libpsh/util.h"
+#include "posix2.h"
+#include "psh.h"
+#include "variable.h"
+
+/* From linux/ioprio.h, which glibc has no wrapper for */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+int psh_posix_parse_sched(const char *spec, struct psh_posix_sched *sched)
+{
+    sched->nice = 0;
+    sched->policy = -1;
+    sched->ioclass = -1;
+    while (*spec)
+    {
+        size_t length = strcspn(spec, ",");
+        if (length == 4 && strncmp(spec, "none", 4) == 0)
+        {
+            /* Scheduled like the shell */
+        }
+        else if (length == 5 && strncmp(spec, "batch", 5) == 0)
+        {
+#ifdef SCHED_BATCH
+            sched->policy = SCHED_BATCH;
+#endif
+            /* Lowest best-effort I/O priority */
+            sched->ioclass = PSH_POSIX_IOPRIO_BE;
+        }
+        else if (length == 4 && strncmp(spec, "idle", 4) == 0)
+        {
+#ifdef SCHED_IDLE
+            sched->policy = SCHED_IDLE;
+#endif
+            sched->ioclass = PSH_POSIX_IOPRIO_IDLE;
+        }
+        else if (strncmp(spec, "nice:", 5) == 0)
+        {
+            char *end;
+            long nice = strtol(spec + 5, &end, 10);
+            if (end == spec + 5 || end != spec + length || nice < 0 ||
+                nice > 19)
+                return -1;
+            sched->nice = (int)nice;
+        }
+        else
+            return -1;
+        spec += length;
+        if (*spec == ',')
+            ++spec;
+    }
+    return 0;
+}
+
+int psh_posix_background_sched(psh_state *state, struct psh_posix_sched *sched)
+{
+    const char *spec = psh_vf_getstr(state, "PSH_BGSCHED");
+    if (spec == NULL || *spec == '\0')
+        return 0;
+    if (psh_posix_parse_sched(spec, sched) < 0)
+    {
+        OUT2E("%s: PSH_BGSCHED: invalid scheduling `%s'\n", state->argv0,
+              spec);
+        return 0;
+    }
+    return 1;
+}
+
+void psh_posix_apply_sched(psh_state *state,
+                           const struct psh_posix_sched *sched)
+{
+    if (sched->nice)
+    {
+        int nice;
+        /* -1 is a valid priority */
+        errno = 0;
+        nice = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0 && setpriority(PRIO_PROCESS, 0, nice + sched->nice) < 0)
+            OUT2E("%s: setpriority: %s\n", state->argv0, strerror(errno));
+    }
+    if (sched->policy >= 0)
+    {
+        struct sched_param param;
+        param.sched_priority = 0;
+        if (sched_setscheduler(0, sched->policy, &param) < 0)
+            OUT2E("%s: sched_setscheduler: %s\n", state->argv0,
+                  strerror(errno));
+    }
+#ifdef SYS_ioprio_set
+    if (sched->ioclass >= 0)
+    {
+        /* The level, lowest priority within the class, is ignored by idle */
+        int ioprio = sched->ioclass << IOPRIO_CLASS_SHIFT | 7;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0)
+            OUT2E("%s: ioprio_set: %s\n", state->argv0, strerror(errno));
+    }
+#endif
+}
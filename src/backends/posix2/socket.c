@@ -0,0 +1,187 @@
+/*
+    psh/backends/posix2/socket.c - /dev/tcp, /dev/udp and /dev/unix redirections
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpsh/util.h"
+#include "libpsh/xmalloc.h"
+#include "posix2.h"
+#include "psh.h"
+#include "variable.h"
+
+/* Seconds to wait for a connection unless PSH_CONNECT_TIMEOUT says
+ * otherwise */
+#define CONNECT_TIMEOUT 10
+
+/* Milliseconds since an arbitrary point */
+static long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/** Connect a new close-on-exec socket, giving up at @p deadline.
+ *
+ * @return The socket in blocking mode, -1 on error with errno set.
+ */
+static int connect_before(int family, int type, const struct sockaddr *addr,
+                          socklen_t addrlen, long long deadline)
+{
+    int fd = socket(family, type | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, addr, addrlen) < 0)
+    {
+        struct pollfd pfd;
+        if (errno != EINPROGRESS)
+            goto fail;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        for (;;)
+        {
+            long long left = deadline - now_ms();
+            int ready;
+            if (left <= 0)
+            {
+                errno = ETIMEDOUT;
+                goto fail;
+            }
+            ready = poll(&pfd, 1, left > 1000000 ? 1000000 : (int)left);
+            if (ready > 0)
+                break;
+            if (ready < 0 && errno != EINTR)
+                goto fail;
+        }
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+            goto fail;
+        if (error)
+        {
+            errno = error;
+            goto fail;
+        }
+    }
+    /* Commands expect ordinary blocking file descriptors */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+fail:
+    error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+}
+
+/* Connect to HOST_PORT, like host/port, trying each address in turn */
+static int connect_inet(psh_state *state, const char *path,
+                        const char *host_port, int type, long long deadline)
+{
+    struct addrinfo hints, *result, *addr;
+    const char *slash = strrchr(host_port, '/');
+    char *host;
+    int fd = -1, status;
+    if (slash == NULL || slash == host_port || slash[1] == '\0')
+    {
+        OUT2E("%s: %s: expected host/port\n", state->argv0, path);
+        return -1;
+    }
+    host = xmalloc(slash - host_port + 1);
+    psh_strncpy(host, host_port, slash - host_port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+    status = getaddrinfo(host, slash + 1, &hints, &result);
+    xfree(host);
+    if (status != 0)
+    {
+        OUT2E("%s: %s: %s\n", state->argv0, path,
+              status == EAI_SYSTEM ? strerror(errno) : gai_strerror(status));
+        return -1;
+    }
+    for (addr = result; addr && fd < 0; addr = addr->ai_next)
+        fd = connect_before(addr->ai_family, addr->ai_socktype, addr->ai_addr,
+                            addr->ai_addrlen, deadline);
+    if (fd < 0)
+        OUT2E("%s: %s: %s\n", state->argv0, path, strerror(errno));
+    freeaddrinfo(result);
+    return fd;
+}
+
+/* Connect to the Unix domain socket at SOCKET_PATH, a stream or datagram
+ * one */
+static int connect_unix(psh_state *state, const char *path,
+                        const char *socket_path, long long deadline)
+{
+    struct sockaddr_un addr;
+    int fd;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        OUT2E("%s: %s: %s\n", state->argv0, path, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    fd = connect_before(AF_UNIX, SOCK_STREAM, (struct sockaddr *)&addr,
+                        sizeof(addr), deadline);
+    if (fd < 0 && errno == EPROTOTYPE)
+        fd = connect_before(AF_UNIX, SOCK_DGRAM, (struct sockaddr *)&addr,
+                            sizeof(addr), deadline);
+    if (fd < 0)
+        OUT2E("%s: %s: %s\n", state->argv0, path, strerror(errno));
+    return fd;
+}
+
+int psh_posix_open_socket(psh_state *state, const char *path)
+{
+    const char *timeout;
+    long long deadline = now_ms();
+    int type;
+    if (strncmp(path, "/dev/tcp/", 9) == 0)
+        type = SOCK_STREAM;
+    else if (strncmp(path, "/dev/udp/", 9) == 0)
+        type = SOCK_DGRAM;
+    else if (strncmp(path, "/dev/unix/", 10) == 0)
+        type = 0;
+    else
+        return -2;
+    /* Only looked up for sockets, as every redirection comes here */
+    timeout = psh_vf_getstr(state, "PSH_CONNECT_TIMEOUT");
+    deadline += (timeout && *timeout ? atol(timeout) : CONNECT_TIMEOUT) * 1000;
+    if (type == 0)
+        /* The rest is an absolute path */
+        return connect_unix(state, path, path + 9, deadline);
+    return connect_inet(state, path, path + 9, type, deadline);
+}
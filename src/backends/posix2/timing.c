@@ -0,0 +1,293 @@
+/*
+    psh/backends/posix2/timing.c - the reserved word time for POSIX
+    Copyright 2020 Zhang Maiyun
+
+    This file is part of Psh, P shell.
+
+    Psh is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Psh is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* wait4(2) */
+#define _DEFAULT_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "libpsh/util.h"
+#include "libpsh/xmalloc.h"
+#include "posix2.h"
+#include "psh.h"
+#include "variable.h"
+
+/** @brief One stage of a timed pipeline. */
+struct timed_stage
+{
+    /** Its PID, or the shell's for builtins run without forking. */
+    pid_t pid;
+    /** Command argv[0]. */
+    char *name;
+    /** The CPU it is pinned to, -1 if none. */
+    int cpu;
+    /** Exit status, valid once reaped. */
+    int status;
+    /** Whether @ref usage and @ref status are filled in. */
+    int reaped;
+    /** Resources used by the stage alone. */
+    struct rusage usage;
+};
+
+/** @brief A pipeline run under the reserved word time. */
+struct psh_posix_timing
+{
+    /** Whether to report each stage. */
+    int verbose;
+    /** When the first stage was started. */
+    struct timespec start;
+    /** The stages in pipeline order. */
+    struct timed_stage *stages;
+    /** Number of entries in @ref stages. */
+    size_t count;
+    /** Number of slots allocated for @ref stages. */
+    size_t slots;
+};
+
+void psh_posix_format_time(char *buffer, size_t size, long seconds,
+                           long microseconds)
+{
+    snprintf(buffer, size, "%ldm%ld.%03lds", seconds / 60, seconds % 60,
+             microseconds / 1000);
+}
+
+/* Format a timeval like 0m1.234s */
+static const char *format_timeval(char *buffer, size_t size,
+                                  const struct timeval *tv)
+{
+    psh_posix_format_time(buffer, size, (long)tv->tv_sec, (long)tv->tv_usec);
+    return buffer;
+}
+
+/* Add B to A */
+static void add_timeval(struct timeval *a, const struct timeval *b)
+{
+    a->tv_sec += b->tv_sec;
+    a->tv_usec += b->tv_usec;
+    if (a->tv_usec >= 1000000)
+    {
+        ++a->tv_sec;
+        a->tv_usec -= 1000000;
+    }
+}
+
+/* Subtract B from A */
+static void sub_timeval(struct timeval *a, const struct timeval *b)
+{
+    a->tv_sec -= b->tv_sec;
+    a->tv_usec -= b->tv_usec;
+    if (a->tv_usec < 0)
+    {
+        --a->tv_sec;
+        a->tv_usec += 1000000;
+    }
+}
+
+/* Append a stage and return it */
+static struct timed_stage *new_stage(struct psh_posix_timing *timing,
+                                     pid_t pid, const char *name)
+{
+    struct timed_stage *stage;
+    if (timing->count == timing->slots)
+    {
+        timing->slots = timing->slots ? timing->slots * 2 : 4;
+        timing->stages = xrealloc(timing->stages, sizeof(struct timed_stage) *
+                                                      timing->slots);
+    }
+    stage = &timing->stages[timing->count++];
+    memset(stage, 0, sizeof(struct timed_stage));
+    stage->pid = pid;
+    stage->cpu = -1;
+    stage->name = psh_strdup(name);
+    return stage;
+}
+
+struct psh_posix_timing *psh_posix_timing_start(int verbose)
+{
+    struct psh_posix_timing *timing =
+        xcalloc(1, sizeof(struct psh_posix_timing));
+    timing->verbose = verbose;
+    clock_gettime(CLOCK_MONOTONIC, &timing->start);
+    return timing;
+}
+
+void psh_posix_timing_add(struct psh_posix_timing *timing, pid_t pid,
+                          const char *name, int cpu)
+{
+    new_stage(timing, pid, name)->cpu = cpu;
+}
+
+void psh_posix_timing_add_self(struct psh_posix_timing *timing,
+                               const char *name, int status,
+                               const struct rusage *before)
+{
+    struct timed_stage *stage = new_stage(timing, getpid(), name);
+    getrusage(RUSAGE_SELF, &stage->usage);
+    sub_timeval(&stage->usage.ru_utime, &before->ru_utime);
+    sub_timeval(&stage->usage.ru_stime, &before->ru_stime);
+    stage->usage.ru_nvcsw -= before->ru_nvcsw;
+    stage->usage.ru_nivcsw -= before->ru_nivcsw;
+    stage->status = status;
+    stage->reaped = 1;
+}
+
+void psh_posix_add_usage(struct rusage *total, const struct rusage *usage)
+{
+    add_timeval(&total->ru_utime, &usage->ru_utime);
+    add_timeval(&total->ru_stime, &usage->ru_stime);
+    /* Peak of a pipeline is the largest stage */
+    if (usage->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = usage->ru_maxrss;
+    total->ru_inblock += usage->ru_inblock;
+    total->ru_oublock += usage->ru_oublock;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+void psh_posix_job_usage(const struct rusage *usage,
+                         struct _psh_job_usage *job_usage)
+{
+    job_usage->user =
+        (long long)usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec;
+    job_usage->sys =
+        (long long)usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec;
+    job_usage->maxrss = usage->ru_maxrss;
+    job_usage->inblock = usage->ru_inblock;
+    job_usage->oublock = usage->ru_oublock;
+    job_usage->nvcsw = usage->ru_nvcsw;
+    job_usage->nivcsw = usage->ru_nivcsw;
+}
+
+void psh_posix_set_last_usage(psh_state *state, const struct rusage *usage,
+                              long long real)
+{
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "real=%lld.%03lld user=%ld.%03ld sys=%ld.%03ld maxrss=%ld "
+             "inblock=%ld oublock=%ld nvcsw=%ld nivcsw=%ld",
+             real / 1000000, real % 1000000 / 1000,
+             (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec / 1000,
+             (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec / 1000,
+             usage->ru_maxrss, usage->ru_inblock, usage->ru_oublock,
+             usage->ru_nvcsw, usage->ru_nivcsw);
+    psh_vf_setstr(state, "PSH_LAST_RUSAGE", PSH_VFA_STRING, buffer, 0);
+}
+
+/* Print the report of a finished pipeline to stderr, and store what it used
+ * in TOTAL */
+static void report(const struct psh_posix_timing *timing,
+                   const struct timeval *real, struct rusage *total)
+{
+    char user[32], sys[32], cpu[16];
+    size_t idx;
+    memset(total, 0, sizeof(struct rusage));
+    if (timing->verbose)
+        OUT2E("%-6s%-8s%-5s%-12s%-12s%-10s%-8s%-8s%s\n", "STAGE", "PID",
+              "CPU", "USER", "SYS", "MAXRSS", "VCSW", "IVCSW", "COMMAND");
+    for (idx = 0; idx < timing->count; ++idx)
+    {
+        const struct rusage *usage = &timing->stages[idx].usage;
+        psh_posix_add_usage(total, usage);
+        if (!timing->verbose)
+            continue;
+        if (timing->stages[idx].cpu < 0)
+            strcpy(cpu, "-");
+        else
+            snprintf(cpu, sizeof(cpu), "%d", timing->stages[idx].cpu);
+        OUT2E("%-6zu%-8ld%-5s%-12s%-12s%-10ld%-8ld%-8ld%s\n", idx + 1,
+              (long)timing->stages[idx].pid, cpu,
+              format_timeval(user, sizeof(user), &usage->ru_utime),
+              format_timeval(sys, sizeof(sys), &usage->ru_stime),
+              usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw,
+              timing->stages[idx].name);
+    }
+    OUT2E("\nreal\t%s\n", format_timeval(user, sizeof(user), real));
+    OUT2E("user\t%s\n", format_timeval(user, sizeof(user), &total->ru_utime));
+    OUT2E("sys\t%s\n", format_timeval(sys, sizeof(sys), &total->ru_stime));
+    OUT2E("maxrss\t%ldk\n", total->ru_maxrss);
+    OUT2E("ctxsw\t%ld voluntary, %ld involuntary\n", total->ru_nvcsw,
+          total->ru_nivcsw);
+}
+
+int psh_posix_timing_finish(psh_state *state, struct psh_posix_timing *timing,
+                            struct rusage *total)
+{
+    struct rusage pipeline_total;
+    struct timespec end;
+    struct timeval real;
+    int status = -1;
+    size_t idx;
+    for (idx = 0; idx < timing->count; ++idx)
+    {
+        struct timed_stage *stage = &timing->stages[idx];
+        int wait_stat;
+        if (stage->reaped)
+            continue;
+        while (wait4(stage->pid, &wait_stat, 0, &stage->usage) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            OUT2E("%s: wait4: %s\n", state->argv0, strerror(errno));
+            wait_stat = 127 << 8;
+            break;
+        }
+        stage->status = psh_backend_exit_status(wait_stat);
+        stage->reaped = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    real.tv_sec = end.tv_sec - timing->start.tv_sec;
+    real.tv_usec = (end.tv_nsec - timing->start.tv_nsec) / 1000;
+    if (real.tv_usec < 0)
+    {
+        --real.tv_sec;
+        real.tv_usec += 1000000;
+    }
+    /* Everything the stages printed goes first */
+    fflush(stdout);
+    report(timing, &real, &pipeline_total);
+    if (total)
+        psh_posix_add_usage(total, &pipeline_total);
+    if (timing->count)
+        status = timing->stages[timing->count - 1].status;
+    psh_posix_timing_free(timing);
+    return status;
+}
+
+void psh_posix_timing_free(struct psh_posix_timing *timing)
+{
+    size_t idx;
+    for (idx = 0; idx < timing->count; ++idx)
+        xfree(timing->stages[idx].name);
+    xfree(timing->stages);
+    xfree(timing);
+}
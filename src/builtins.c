@@ -41,10 +41,12 @@ const struct builtin builtins[] = {{".", &builtin_unsupported},
                                    {":", &builtin_true},
                                    {"alias", &builtin_alias},
                                    {"bg", &builtin_unsupported},
+                                   {"bgsched", &builtin_bgsched},
                                    {"bind", &builtin_unsupported},
                                    {"break", &builtin_unsupported},
                                    {"builtin", &builtin_builtin},
                                    {"case", &builtin_unsupported},
+                                   {"cat", &builtin_cat},
                                    {"cd", &builtin_cd},
                                    {"chdir", &builtin_cd},
                                    {"command", &builtin_unsupported},
@@ -64,7 +66,7 @@ const struct builtin builtins[] = {{".", &builtin_unsupported},
                                    {"fc", &builtin_unsupported},
                                    {"fg", &builtin_unsupported},
                                    {"fi", &builtin_unsupported},
-                                   {"for", &builtin_unsupported},
+                                   {"for", &builtin_for},
                                    {"getopts", &builtin_unsupported},
                                    {"getstat", &builtin_getstat_handler},
                                    {"hash", &builtin_hash},
@@ -72,7 +74,7 @@ const struct builtin builtins[] = {{".", &builtin_unsupported},
                                    {"history", &builtin_history},
                                    {"if", &builtin_unsupported},
                                    {"jobid", &builtin_unsupported},
-                                   {"jobs", &builtin_unsupported},
+                                   {"jobs", &builtin_jobs},
                                    {"local", &builtin_unsupported},
                                    {"logout", &builtin_exit},
                                    {"popd", &builtin_unsupported},
@@ -86,9 +88,11 @@ const struct builtin builtins[] = {{".", &builtin_unsupported},
                                    {"setvar", &builtin_unsupported},
                                    {"shift", &builtin_unsupported},
                                    {"source", &builtin_unsupported},
+                                   {"tee", &builtin_tee},
                                    {"test", &builtin_unsupported},
                                    {"then", &builtin_unsupported},
-                                   {"times", &builtin_unsupported},
+                                   {"timeout", &builtin_timeout},
+                                   {"times", &builtin_times},
                                    {"trap", &builtin_unsupported},
                                    {"true", &builtin_true},
                                    {"type", &builtin_unsupported},
@@ -97,9 +101,10 @@ const struct builtin builtins[] = {{".", &builtin_unsupported},
                                    {"unalias", &builtin_unalias},
                                    {"unset", &builtin_unsupported},
                                    {"until", &builtin_unsupported},
-                                   {"wait", &builtin_unsupported},
+                                   {"wait", &builtin_wait},
                                    {"which", &builtin_unsupported},
-                                   {"while", &builtin_unsupported}};
+                                   {"while", &builtin_unsupported},
+                                   {"xjobs", &builtin_xjobs}};
 
 int get_argc(char **argv)
 {
@@ -120,7 +125,7 @@ static int builtin_unsupported(ATTRIB_UNUSED int argc,
 static int builtin_getstat_handler(ATTRIB_UNUSED int argc,
                                    ATTRIB_UNUSED char **argv, psh_state *state)
 {
-    printf("%" PRIdMAX "\n", psh_vf_getint(state, "?"));
+    printf("%" PRIdMAX "\n", psh_vf_get_status(state));
     return 0;
 }
 
@@ -109,7 +109,7 @@ static char *canonicalize_path(psh_state *state, const char *path, int flags)
             xpath = psh_backend_getcwd_dm();
         else
         {
-            xpath = psh_strdup(psh_vf_getstr(state, "PWD"));
+            xpath = psh_strdup(psh_vf_getstr_special(state, PSH_VF_PWD));
             if (!xpath)
                 xpath = psh_backend_getcwd_dm();
         }
@@ -207,6 +207,7 @@ int main(int argc, char **argv)
 int builtin_cd(int argc, char **argv, psh_state *state)
 {
     char *destination, *path = NULL;
+    union _psh_vfa_value payload;
     int current_arg;
     unsigned int flags = 0;
     struct _psh_vfa_container *pwd = psh_vf_get(state, "PWD", 0, 0);
@@ -269,7 +270,7 @@ int builtin_cd(int argc, char **argv, psh_state *state)
         return 1;
     }
     if (strcmp(path, "-") == 0)
-        path = oldpwd->payload.string;
+        path = oldpwd ? oldpwd->payload.string : NULL;
     if (!path)
     {
         OUT2E("%s: %s: OLDPWD not set\n", state->argv0, argv[0]);
@@ -285,9 +286,17 @@ int builtin_cd(int argc, char **argv, psh_state *state)
         xfree(destination);
         return 1;
     }
-    xfree(oldpwd->payload.string);
-    oldpwd->payload.string = pwd->payload.string;
-    pwd->payload.string = destination;
-    /* Destination not free()d, this is intended */
+    /* OLDPWD shares the string of PWD, both keep their attributes so that
+     * the environment is updated if they are exported */
+    payload.string = pwd && !(pwd->attributes & PSH_VFA_UNSET)
+                         ? psh_vfa_str_share(pwd)
+                         : NULL;
+    psh_vf_set(state, "OLDPWD",
+               oldpwd ? oldpwd->attributes & ~PSH_VFA_UNSET : PSH_VFA_STRING,
+               payload, 0, 0, 0);
+    psh_vf_setstr(state, "PWD",
+                  pwd ? pwd->attributes & ~PSH_VFA_UNSET : PSH_VFA_STRING,
+                  destination, 0);
+    xfree(destination);
     return 0;
 }
@@ -32,7 +32,7 @@
 int builtin_exit(int argc, char **argv, psh_state *state)
 {
     if (argc < 2)
-        exit_psh(state, psh_vf_getint(state, "?"));
+        exit_psh(state, psh_vf_get_status(state));
     else
     {
         int i = (int)strtol(argv[1], NULL, 10);
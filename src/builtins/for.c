@@ -0,0 +1,203 @@
+/*
+   psh/builtins/for.c - builtin command for, the body of for loops
+
+   Copyright 2020 Zhang Maiyun.
+
+   This file is part of Psh, P shell.
+
+   Psh is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Psh is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+#include "builtin.h"
+#include "command.h"
+#include "filpinfo.h"
+#include "libpsh/util.h"
+#include "libpsh/xmalloc.h"
+#include "psh.h"
+#include "variable.h"
+
+/** @brief One iteration of a loop. */
+struct iteration
+{
+    /** The unexpanded body. */
+    const char *body;
+    /** Name of the variable. */
+    const char *name;
+    /** Its value for this iteration. */
+    const char *word;
+};
+
+/* Set the variable and run the body, which is parsed again so that it sees
+ * the new value. Returns its exit status */
+static int run_iteration(psh_state *state, void *data)
+{
+    const struct iteration *iteration = data;
+    struct _psh_command *cmd = new_command();
+    psh_vf_setstr(state, iteration->name, PSH_VFA_STRING, iteration->word, 0);
+    if (filpinfo(state, psh_strdup(iteration->body), cmd) > 0)
+        psh_backend_do_run(state, cmd);
+    free_command(cmd);
+    return (int)psh_vf_get_status(state);
+}
+
+/* Store the exit statuses of the iterations of a parallel loop in
+ * FORSTATUS */
+static void set_statuses(psh_state *state, const int *statuses, size_t count)
+{
+    union _psh_vfa_value payload;
+    size_t idx;
+    if (count == 0)
+    {
+        psh_vf_unset(state, "FORSTATUS", 0);
+        return;
+    }
+    payload.int_array = xmalloc(sizeof(intmax_t) * count);
+    for (idx = 0; idx < count; ++idx)
+        payload.int_array[idx] = statuses[idx];
+    psh_vf_set(state, "FORSTATUS", PSH_VFA_INDEX_ARRAY | PSH_VFA_INTEGER,
+               payload, count, 0, 0);
+}
+
+/* Run the iterations in up to WORKERS forked shells. Assignments in the body
+ * stay in the worker */
+static int run_parallel(psh_state *state, struct iteration *iteration,
+                        char **words, int count, size_t workers,
+                        int fail_fast)
+{
+    struct _psh_pool *pool = psh_backend_pool_new(workers, 0);
+    const int *statuses;
+    size_t done, idx;
+    int sig = 0, ret = 0;
+    for (idx = 0; (int)idx < count; ++idx)
+    {
+        /* Stop starting iterations after the first failure */
+        if (fail_fast && psh_backend_pool_failures(pool))
+            break;
+        iteration->word = words[idx];
+        if ((sig = psh_backend_pool_run(state, pool, &run_iteration,
+                                        iteration, "for")))
+            break;
+    }
+    /* Whatever happened, the started ones are collected. A failed fork
+     * stays reported as such */
+    if (sig == 0)
+        sig = psh_backend_pool_finish(state, pool);
+    else
+        psh_backend_pool_finish(state, pool);
+    statuses = psh_backend_pool_statuses(pool, &done);
+    set_statuses(state, statuses, done);
+    /* The first failure in the order of the words */
+    for (idx = 0; idx < done && ret == 0; ++idx)
+        ret = statuses[idx];
+    if (sig > 0)
+        ret = 128 + sig;
+    else if (sig < 0 && ret == 0)
+        ret = 1;
+    psh_backend_pool_free(pool);
+    return ret;
+}
+
+/* Builtin for, called by the parser for loops as
+ * for BODY [-P N] [-e] NAME [in WORD...] */
+int builtin_for(int argc, char **argv, psh_state *state)
+{
+    struct iteration iteration;
+    long workers = 0;
+    int count = 1, fail_fast = 0, ret = 0, exec_last;
+    const char *name;
+    if (argc < 3)
+    {
+        OUT2E("%s: %s: usage: for BODY [-P N] [-e] NAME [in WORD...]\n",
+              state->argv0, argv[0]);
+        return 2;
+    }
+    iteration.body = argv[1];
+    /* count always points to the next possible name */
+    while (++count < argc)
+    {
+        if (argv[count][0] != '-')
+            break;
+        switch (argv[count][1])
+        {
+            case '-':
+                /* Skip this -- */
+                ++count;
+            case '\0':
+                goto endwhile;
+            case 'e':
+                fail_fast = 1;
+                break;
+            case 'P':
+            {
+                /* -P4 or -P 4 */
+                const char *value =
+                    argv[count][2] ? argv[count] + 2 : argv[++count];
+                if (value == NULL || (workers = atol(value)) <= 0)
+                {
+                    OUT2E("%s: %s: -P: number of workers expected\n",
+                          state->argv0, argv[0]);
+                    return 2;
+                }
+                break;
+            }
+            default:
+                OUT2E("%s: %s: unrecognized argument -%c\n", state->argv0,
+                      argv[0], argv[count][1]);
+                return 2;
+        }
+    }
+endwhile:
+    name = count < argc ? argv[count] : "";
+    if (!isalpha(*name) && *name != '_')
+    {
+        OUT2E("%s: %s: `%s': not a valid identifier\n", state->argv0,
+              argv[0], name);
+        return 1;
+    }
+    iteration.name = name;
+    if (++count < argc)
+    {
+        if (strcmp(argv[count], "in") != 0)
+        {
+            OUT2E("%s: %s: syntax error: `in' expected\n", state->argv0,
+                  argv[0]);
+            return 2;
+        }
+        ++count;
+    }
+    if (workers)
+        return run_parallel(state, &iteration, argv + count, argc - count,
+                            (size_t)workers, fail_fast);
+    /* The body's last command is not the last thing the shell does */
+    exec_last = state->exec_last;
+    state->exec_last = 0;
+    for (; count < argc; ++count)
+    {
+        iteration.word = argv[count];
+        if ((ret = run_iteration(state, &iteration)) && fail_fast)
+            break;
+    }
+    state->exec_last = exec_last;
+    return ret;
+}
@@ -147,7 +147,7 @@ endwhile:
             char *path;
             name[0] = '/';
             psh_strncpy(name + 1, argv[count], strlen(argv[count]));
-            path = psh_search_path(psh_vf_getstr(state, "PATH"),
+            path = psh_search_path(psh_vf_getstr_special(state, PSH_VF_PATH),
                                    psh_backend_path_separator, name,
                                    &psh_backend_file_exists);
             xfree(name);
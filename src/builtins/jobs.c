@@ -0,0 +1,175 @@
+/*
+   psh/builtins/jobs.c - builtin command jobs
+
+   Copyright 2020 Zhang Maiyun.
+
+   This file is part of Psh, P shell.
+
+   Psh is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Psh is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <time.h>
+
+#include "backend.h"
+#include "builtin.h"
+#include "jobs.h"
+#include "libpsh/util.h"
+#include "psh.h"
+
+#define WITH_PID 0x01
+#define PID_ONLY 0x02
+#define WITH_USAGE 0x04
+
+/* Print when a job was started and the resources it has used */
+static void show_usage(const struct _psh_jobs *job)
+{
+    char started[16] = "?";
+    time_t start_sec = (time_t)(job->start / 1000000);
+    struct tm *start_tm = localtime(&start_sec);
+    long long real;
+    if (start_tm)
+        strftime(started, sizeof(started), "%H:%M:%S", start_tm);
+    if (job->status == PSH_JOB_RUNNING || job->status == PSH_JOB_STOPPED)
+    {
+        /* Nothing known but how long it's been running */
+        real = psh_backend_now() - job->start;
+        printf("      started %s  real %lld.%03llds\n", started,
+               real / 1000000, real % 1000000 / 1000);
+        return;
+    }
+    real = job->end - job->start;
+    printf("      started %s  real %lld.%03llds  user %lld.%03llds  "
+           "sys %lld.%03llds  maxrss %ldk  io %ld/%ld  ctxsw %ld/%ld\n",
+           started, real / 1000000, real % 1000000 / 1000,
+           job->usage.user / 1000000, job->usage.user % 1000000 / 1000,
+           job->usage.sys / 1000000, job->usage.sys % 1000000 / 1000,
+           job->usage.maxrss, job->usage.inblock, job->usage.oublock,
+           job->usage.nvcsw, job->usage.nivcsw);
+}
+
+/* Print one job, and forget it if it has finished since it's been reported
+ * now */
+static void show_job(psh_state *state, struct _psh_jobs *job,
+                     unsigned int flags)
+{
+    char description[256];
+    if (flags & PID_ONLY)
+        printf("%d\n", job->pid);
+    else
+    {
+        psh_jobs_describe(job, flags & WITH_PID, description,
+                          sizeof(description));
+        printf("%s\n", description);
+        if (flags & WITH_USAGE)
+            show_usage(job);
+    }
+    job->notified = 1;
+    if (job->status == PSH_JOB_DONE || job->status == PSH_JOB_SIGNALED)
+        psh_jobs_remove(state, job);
+}
+
+/* Show the jobs that have left the table since they finished, with what they
+ * used, once */
+static void show_finished(psh_state *state, unsigned int flags)
+{
+    char description[256];
+    struct _psh_jobs *job, *in_table;
+    size_t cursor = 0;
+    while ((job = psh_jobs_next_done(state, &cursor)) != NULL)
+    {
+        if (job->notified)
+            continue;
+        job->notified = 1;
+        in_table = psh_jobs_get_pid(state, job->pid);
+        if (in_table && in_table->status != PSH_JOB_RUNNING &&
+            in_table->status != PSH_JOB_STOPPED)
+            /* Shown with the others */
+            continue;
+        if (flags & PID_ONLY)
+        {
+            printf("%d\n", job->pid);
+            continue;
+        }
+        psh_jobs_describe(job, flags & WITH_PID, description,
+                          sizeof(description));
+        printf("%s\n", description);
+        show_usage(job);
+    }
+}
+
+int builtin_jobs(int argc, char **argv, psh_state *state)
+{
+    unsigned int flags = 0;
+    int count = 0, return_value = 0;
+    /* count always points to the next possible job */
+    while (++count < argc)
+    {
+        if (argv[count][0] != '-')
+            break;
+        switch (argv[count][1])
+        {
+            case '-':
+                /* Skip this -- */
+                ++count;
+            case '\0':
+                goto endwhile;
+            case 'l':
+                flags |= WITH_PID;
+                break;
+            case 'p':
+                flags |= PID_ONLY;
+                break;
+            case 'v':
+                flags |= WITH_USAGE;
+                break;
+            default:
+                OUT2E("%s: %s: unrecognized argument -%c\n", state->argv0,
+                      argv[0], argv[count][1]);
+                return 2;
+        }
+    }
+endwhile:
+    /* Statuses straight from the job table, as up to date as possible */
+    psh_backend_reap(state);
+    if (count == argc)
+    {
+        int id;
+        if (state->jobs == NULL)
+            return 0;
+        if (flags & WITH_USAGE)
+            show_finished(state, flags);
+        for (id = 1; id <= state->jobs->max_id; ++id)
+            if (state->jobs->by_id[id])
+                show_job(state, state->jobs->by_id[id], flags);
+        return 0;
+    }
+    for (; count < argc; ++count)
+    {
+        struct _psh_jobs *job = psh_jobs_find(state, argv[count]);
+        if (job == NULL)
+        {
+            OUT2E("%s: %s: %s: no such job\n", state->argv0, argv[0],
+                  argv[count]);
+            return_value = 1;
+            continue;
+        }
+        show_job(state, job, flags);
+    }
+    return return_value;
+}
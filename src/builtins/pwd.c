@@ -59,7 +59,7 @@ int builtin_pwd(int argc, char **argv, psh_state *state)
     }
     if (!flag) /* No -P */
     {
-        char *path = (char *)psh_vf_getstr(state, "PWD"), *p;
+        char *path = (char *)psh_vf_getstr_special(state, PSH_VF_PWD), *p;
 
         if (!path || path[0] != '/')
             goto use_p;
@@ -0,0 +1,142 @@
+/*
+   psh/builtins/wait.c - builtin command wait
+
+   Copyright 2020 Zhang Maiyun.
+
+   This file is part of Psh, P shell.
+
+   Psh is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Psh is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include "backend.h"
+#include "builtin.h"
+#include "jobs.h"
+#include "libpsh/util.h"
+#include "psh.h"
+
+/* PID of the job specified by SPEC, -1 if invalid. Finished jobs might have
+ * left the table already, so plain PIDs are not looked up */
+static int spec_to_pid(psh_state *state, const char *spec)
+{
+    struct _psh_jobs *job;
+    char *end;
+    long pid;
+    if (spec[0] == '%')
+        return (job = psh_jobs_find(state, spec)) ? job->pid : -1;
+    pid = strtol(spec, &end, 10);
+    if (*spec == 0 || *end != 0 || pid <= 0 || pid > INT_MAX)
+        return -1;
+    return (int)pid;
+}
+
+/* Wait for one job, return its exit status */
+static int wait_pid(psh_state *state, int pid)
+{
+    for (;;)
+    {
+        struct _psh_jobs *job;
+        int status, sig;
+        psh_backend_reap(state);
+        if ((status = psh_jobs_take_status(state, pid)) >= 0)
+            return status;
+        job = psh_jobs_get_pid(state, pid);
+        /* Never started by this shell or waited for already */
+        if (job == NULL)
+            return 127;
+        if (job->status == PSH_JOB_STOPPED)
+            return 128 + job->sig;
+        if ((sig = psh_backend_wait_children(state)))
+            return 128 + sig;
+    }
+}
+
+int builtin_wait(int argc, char **argv, psh_state *state)
+{
+    int count = 0, next = 0, status = 0;
+    /* count always points to the next possible job */
+    while (++count < argc)
+    {
+        if (argv[count][0] != '-')
+            break;
+        switch (argv[count][1])
+        {
+            case '-':
+                /* Skip this -- */
+                ++count;
+            case '\0':
+                goto endwhile;
+            case 'n':
+                next = 1;
+                break;
+            default:
+                OUT2E("%s: %s: unrecognized argument -%c\n", state->argv0,
+                      argv[0], argv[count][1]);
+                return 2;
+        }
+    }
+endwhile:
+    if (next)
+    {
+        /* Whichever job finishes first, woken up by the backend rather than
+         * by checking every job in turn */
+        for (;;)
+        {
+            int sig;
+            psh_backend_reap(state);
+            if ((status = psh_jobs_take_next_status(state, NULL)) >= 0)
+                return status;
+            if (psh_jobs_running(state) == 0)
+                return 127;
+            if ((sig = psh_backend_wait_children(state)))
+                return 128 + sig;
+        }
+    }
+    if (count == argc)
+    {
+        /* Every job */
+        for (;;)
+        {
+            int sig;
+            psh_backend_reap(state);
+            if (psh_jobs_running(state) == 0)
+                break;
+            if ((sig = psh_backend_wait_children(state)))
+                return 128 + sig;
+        }
+        /* Nothing left to wait for */
+        while (psh_jobs_take_next_status(state, NULL) >= 0)
+            ;
+        return 0;
+    }
+    for (; count < argc; ++count)
+    {
+        int pid = spec_to_pid(state, argv[count]);
+        if (pid < 0)
+        {
+            OUT2E("%s: %s: %s: no such job\n", state->argv0, argv[0],
+                  argv[count]);
+            status = 127;
+            continue;
+        }
+        status = wait_pid(state, pid);
+    }
+    return status;
+}
@@ -24,6 +24,7 @@
 
 #include <string.h>
 
+#include "backend.h"
 #include "command.h"
 #include "libpsh/xmalloc.h"
 
@@ -34,13 +35,30 @@ void free_redirect(struct _psh_redirect *redir)
     {
         temp = redir;
         redir = redir->next;
+        switch (temp->type)
+        {
+            case PSH_REDIR_OUT_REDIR:
+            case PSH_REDIR_OUT_APPN:
+            case PSH_REDIR_IN_REDIR:
+            case PSH_REDIR_OPENFN:
+                xfree(temp->rhs.file);
+                break;
+            case PSH_REDIR_HEREXX:
+                if (temp->rhs.fd >= 0)
+                    psh_backend_close_fd(temp->rhs.fd);
+                xfree(temp->heredoc);
+                break;
+            default:
+                break;
+        }
+        xfree(temp->fd_varname);
         xfree(temp);
         temp = NULL;
     }
 }
 
-/* Malloc a command, enNULL all elements, malloc the first element in argv[] and
- * a struct _psh_redirect */
+/* Malloc a command, enNULL all elements and malloc the first element in argv[].
+ * Redirections are appended to rlist by the parser as they are met */
 struct _psh_command *new_command()
 {
     /* TODO: Remove MAXARG, MAXEACHARG */
@@ -48,9 +66,9 @@ struct _psh_command *new_command()
     cmd = xcalloc(1, sizeof(struct _psh_command));
     /* Setting to '\0' will be used to detect
                            whether an element is used */
-    cmd->argv = xcalloc(MAXARG, P_CS);
+    cmd->argv = xcalloc(MAXARG, sizeof(char *));
+    cmd->argv_slots = MAXARG;
     cmd->argv[0] = xcalloc(MAXEACHARG, P_CS);
-    cmd->rlist = xcalloc(1, sizeof(struct _psh_redirect));
     return cmd;
 }
 
@@ -64,15 +82,46 @@ void free_command(struct _psh_command *cmd)
         cmd = cmd->next;
         free_argv(temp);
         free_redirect(temp->rlist);
+        command_release_fds(temp);
+        xfree(temp->held_fds);
+        free_command(temp->coproc);
+        xfree(temp->source);
         xfree(temp);
         temp = NULL;
     }
 }
 
+/* Grow argv geometrically so that [idx] and the NULL after it are valid */
+void command_argv_reserve(struct _psh_command *cmd, size_t idx)
+{
+    size_t old_slots = cmd->argv_slots;
+    if (idx + 1 < old_slots)
+        return;
+    while (idx + 1 >= cmd->argv_slots)
+        cmd->argv_slots *= 2;
+    cmd->argv = xrealloc(cmd->argv, sizeof(char *) * cmd->argv_slots);
+    memset(cmd->argv + old_slots, 0,
+           sizeof(char *) * (cmd->argv_slots - old_slots));
+}
+
+/* Keep FD open as long as CMD needs it */
+void command_hold_fd(struct _psh_command *cmd, int fd)
+{
+    cmd->held_fds =
+        xrealloc(cmd->held_fds, sizeof(int) * (cmd->held_fd_count + 1));
+    cmd->held_fds[cmd->held_fd_count++] = fd;
+}
+
+void command_release_fds(struct _psh_command *cmd)
+{
+    while (cmd->held_fd_count)
+        psh_backend_close_fd(cmd->held_fds[--cmd->held_fd_count]);
+}
+
 void free_argv(struct _psh_command *cmd)
 {
-    int count;
-    for (count = 0; count < MAXARG; ++count)
+    size_t count;
+    for (count = 0; count < cmd->argv_slots; ++count)
     {
         if (cmd->argv[count] == NULL)
             break; /* All args should be freed after here */
@@ -24,16 +24,29 @@
 #endif
 
 #include <ctype.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "backend.h"
 #include "command.h"
 #include "filpinfo.h"
+#include "input.h"
+#include "libpsh/hash.h"
 #include "libpsh/util.h"
 #include "libpsh/xmalloc.h"
 #include "psh.h"
 #include "util.h"
+#include "variable.h"
+
+/** Default value of $IFS. */
+#define DEFAULT_IFS " \t\n"
+/** Number of command substitutions whose output sizes are remembered. */
+#define CAPTURE_HINTS_MAX 256
+
+static int parse(psh_state *state, char *buffer, struct _psh_command *info,
+                 struct _psh_command *parsed);
 
 /* Get the index of the last char in the buffer */
 static int ignore_IFSs(char *buffer, int count)
@@ -48,9 +61,697 @@ static int ignore_IFSs(char *buffer, int count)
     return -6; /* Reaching here impossible */
 }
 
+/* Find the CLOSE that matches an OPEN right before BUFFER[START], skipping
+ * quoted and escaped characters. Returns its index, or -1 if there is none */
+static int find_closing(const char *buffer, int start, char open, char close)
+{
+    int depth = 1, idx;
+    char quote = 0;
+    for (idx = start; buffer[idx]; ++idx)
+    {
+        if (buffer[idx] == '\\' && quote != '\'')
+        {
+            if (buffer[idx + 1])
+                ++idx;
+            continue;
+        }
+        if (quote)
+        {
+            if (buffer[idx] == quote)
+                quote = 0;
+        }
+        else if (buffer[idx] == close && --depth == 0)
+            return idx;
+        else if (buffer[idx] == open)
+            ++depth;
+        else if (buffer[idx] == '\'' || buffer[idx] == '"')
+            quote = buffer[idx];
+    }
+    return -1;
+}
+
+/* Append LENGTH characters of TEXT to argv[ELEMENT] of CMD, which is grown if
+ * the fixed-sized buffer is too small */
+static void append_argument(struct _psh_command *cmd, int element,
+                            int *charcnt, const char *text, size_t length)
+{
+    if (*charcnt + length + 1 >= MAXEACHARG)
+        cmd->argv[element] =
+            xrealloc(cmd->argv[element], *charcnt + length + MAXEACHARG);
+    memcpy(cmd->argv[element] + *charcnt, text, length);
+    *charcnt += length;
+    cmd->argv[element][*charcnt] = 0;
+}
+
+/* Write the result of an expansion to the argument being built. If IFS is not
+ * NULL, TEXT is split into fields in place, each of which after the first one
+ * starts a new argument. Returns the number of characters written */
+static int write_expansion(struct _psh_command *cmd, int *element,
+                           int *charcnt, char *text, size_t length,
+                           const char *ifs)
+{
+    char *cursor = text, *field;
+    int written = 0;
+    if (ifs == NULL)
+    {
+        append_argument(cmd, *element, charcnt, text, length);
+        return length;
+    }
+    /* A leading separator ends the word before it */
+    if (*charcnt && *text && strchr(ifs, *text))
+        field = NULL;
+    else if ((field = psh_split_field(&cursor, ifs)) != NULL)
+    {
+        size_t field_len = strlen(field);
+        append_argument(cmd, *element, charcnt, field, field_len);
+        written += field_len;
+        field = NULL;
+    }
+    while ((field = psh_split_field(&cursor, ifs)) != NULL)
+    {
+        size_t field_len = strlen(field);
+        command_argv_reserve(cmd, ++*element);
+        cmd->argv[*element] = xcalloc(MAXEACHARG, P_CS);
+        *charcnt = 0;
+        append_argument(cmd, *element, charcnt, field, field_len);
+        written += field_len;
+    }
+    return written;
+}
+
+/* Run the command substitution in SOURCE, which is LENGTH characters long,
+ * and write its output to the argument being built. Returns the number of
+ * characters written */
+static int expand_command(psh_state *state, struct _psh_command *cmd,
+                          int *element, int *charcnt, const char *source,
+                          size_t length, int quoted)
+{
+    struct _psh_command *sub = new_command();
+    struct _psh_capture capture;
+    char *text = xmalloc(length + 1);
+    const char *ifs = NULL;
+    int written;
+
+    memcpy(text, source, length);
+    text[length] = 0;
+    if (!state->capture_hints)
+        state->capture_hints = psh_hash_create(CAPTURE_HINTS_MAX);
+    if (filpinfo(state, psh_strdup(text), sub) > 0)
+    {
+        /* Size the buffer after what this substitution printed last time,
+         * stored plus one so that an empty output isn't taken for none */
+        size_t hint =
+            (size_t)(uintptr_t)psh_hash_get(state->capture_hints, text);
+        int status = psh_backend_capture(state, sub, hint ? hint - 1 : 0,
+                                         &capture);
+        psh_vf_set_status(state, status);
+        if (!hint && ++state->capture_hint_count > CAPTURE_HINTS_MAX)
+        {
+            /* Start over rather than grow without bound */
+            psh_hash_free(state->capture_hints);
+            state->capture_hints = psh_hash_create(CAPTURE_HINTS_MAX);
+            state->capture_hint_count = 1;
+        }
+        psh_hash_add_chk(state->capture_hints, text,
+                         (void *)(uintptr_t)(capture.length + 1), 0);
+    }
+    else
+    {
+        capture.data = psh_strdup("");
+        capture.length = capture.mapped = 0;
+    }
+    free_command(sub);
+    xfree(text);
+    /* Trailing newlines are removed */
+    while (capture.length && capture.data[capture.length - 1] == '\n')
+        capture.data[--capture.length] = 0;
+    if (!quoted && !(ifs = psh_vf_getstr_special(state, PSH_VF_IFS)))
+        ifs = DEFAULT_IFS;
+    written = write_expansion(cmd, element, charcnt, capture.data,
+                              capture.length, ifs);
+    psh_backend_capture_free(&capture);
+    return written;
+}
+
+/* Write the value of parameter NAME, possibly NAME[index], to the argument
+ * being built. Returns the number of characters written */
+static int expand_parameter(psh_state *state, struct _psh_command *cmd,
+                            int *element, int *charcnt, const char *name,
+                            int quoted)
+{
+    const struct _psh_vfa_container *var;
+    const char *ifs = NULL, *subscript = strchr(name, '[');
+    size_t index = 0;
+    char number[24], *value, *copy = NULL;
+    int written;
+    if (subscript && name[strlen(name) - 1] == ']')
+    {
+        /* TODO: @ and * subscripts, arithmetic in subscripts */
+        char *base = xmalloc(subscript - name + 1);
+        psh_strncpy(base, name, subscript - name);
+        index = strtoul(subscript + 1, NULL, 10);
+        var = psh_vf_get(state, base, 0, 0);
+        xfree(base);
+    }
+    else
+        var = psh_vf_get(state, name, 0, 0);
+    if (!var || var->attributes &
+                    (PSH_VFA_UNSET | PSH_VFA_ASSOC_ARRAY | PSH_VFA_PARSED))
+        /* TODO: Associative arrays */
+        return 0;
+    if (var->attributes & PSH_VFA_INDEX_ARRAY)
+    {
+        /* Like ${name[0]} if no subscript is given */
+        if (index >= var->array_size)
+            return 0;
+        if (var->attributes & PSH_VFA_INTEGER)
+        {
+            snprintf(number, sizeof(number), "%" PRIdMAX,
+                     var->payload.int_array[index]);
+            value = number;
+        }
+        else if (var->payload.string_array[index])
+            value = var->payload.string_array[index];
+        else
+            return 0;
+    }
+    else if (index != 0)
+        return 0;
+    else if (var->attributes & PSH_VFA_INTEGER)
+    {
+        snprintf(number, sizeof(number), "%" PRIdMAX, var->payload.integer);
+        value = number;
+    }
+    else if (var->payload.string)
+        value = var->payload.string;
+    else
+        return 0;
+    if (!quoted && !(ifs = psh_vf_getstr_special(state, PSH_VF_IFS)))
+        ifs = DEFAULT_IFS;
+    /* Field splitting writes to the value, which may be shared */
+    if (ifs && value != number)
+        value = copy = psh_strdup(value);
+    written = write_expansion(cmd, element, charcnt, value, strlen(value), ifs);
+    xfree(copy);
+    return written;
+}
+
+/* Length of the parameter name at START, which follows a dollar sign */
+static size_t parameter_name_length(const char *start)
+{
+    size_t length = 0;
+    /* Special parameters have one-character names */
+    if (*start && (strchr("?$!#@*-", *start) || isdigit(*start)))
+        return 1;
+    while (isalnum(start[length]) || start[length] == '_')
+        ++length;
+    return length;
+}
+
+/* Expand parameters and command substitutions in a line of a here-document
+ * as if it were double-quoted, except that quotes are not special. Returns
+ * a new string */
+static char *expand_heredoc_line(psh_state *state, const char *line)
+{
+    struct _psh_command *scratch = new_command();
+    int element = 0, charcnt = 0;
+    char *result;
+    while (*line)
+    {
+        size_t length = 0;
+        int end = -1;
+        if (*line == '\\' && line[1] && strchr("$`\\", line[1]))
+        {
+            append_argument(scratch, 0, &charcnt, line + 1, 1);
+            line += 2;
+            continue;
+        }
+        if (*line == '`')
+            end = find_closing(line, 1, '`', '`');
+        else if (line[0] == '$' && line[1] == '(' && line[2] != '(')
+            end = find_closing(line, 2, '(', ')');
+        if (end > 0)
+        {
+            size_t start = *line == '`' ? 1 : 2;
+            expand_command(state, scratch, &element, &charcnt, line + start,
+                           end - start, 1);
+            line += end + 1;
+            continue;
+        }
+        if (line[0] == '$' && line[1] == '{' &&
+            (end = find_closing(line, 2, '{', '}')) > 0)
+            length = end - 2;
+        else if (*line == '$')
+            length = parameter_name_length(line + 1);
+        if (length)
+        {
+            char *name = xmalloc(length + 1);
+            psh_strncpy(name, line + (end > 0 ? 2 : 1), length);
+            expand_parameter(state, scratch, &element, &charcnt, name, 1);
+            xfree(name);
+            line += end > 0 ? (size_t)end + 1 : length + 1;
+            continue;
+        }
+        append_argument(scratch, 0, &charcnt, line++, 1);
+    }
+    result = psh_strdup(scratch->argv[0]);
+    free_command(scratch);
+    return result;
+}
+
+/* Read the next line of an unfinished command, from the -c string if there
+ * is one, as what follows on stdin isn't part of the command. Returns NULL at
+ * EOF */
+static char *read_line(psh_state *state)
+{
+    return state->from_string ? read_string_line(state) : psh_gets("> ");
+}
+
+/* Read the body of a here-document up to the line DELIMITER for REDIRECT.
+ * The body is kept in REDIRECT->heredoc to be expanded when the command is
+ * run, unless the delimiter was quoted, that is if QUOTED, the LENGTH
+ * characters of the delimiter as written, contain quotes. It is then the
+ * right-hand side of REDIRECT right away. Leading tabs are removed if
+ * STRIP_TABS. Returns 1 on errors */
+static int read_heredoc(psh_state *state, struct _psh_redirect *redirect,
+                        const char *delimiter, const char *quoted,
+                        size_t length, int strip_tabs)
+{
+    struct _psh_heredoc *body = NULL;
+    int expand = 1, failed = 0;
+    size_t idx, used = 0;
+    for (idx = 0; idx < length; ++idx)
+        if (strchr("'\"\\", quoted[idx]))
+            expand = 0;
+    if (expand)
+        redirect->heredoc = psh_strdup("");
+    else
+        body = psh_backend_heredoc_new();
+    for (;;)
+    {
+        char *line = read_line(state), *start;
+        size_t line_length;
+        if (line == NULL)
+        {
+            OUT2E("%s: warning: here-document delimited by end-of-file "
+                  "(wanted `%s')\n",
+                  state->argv0, delimiter);
+            break;
+        }
+        start = line;
+        if (strip_tabs)
+            while (*start == '\t')
+                ++start;
+        if (strcmp(start, delimiter) == 0)
+        {
+            xfree(line);
+            break;
+        }
+        line_length = strlen(start);
+        if (expand)
+        {
+            redirect->heredoc =
+                xrealloc(redirect->heredoc, used + line_length + 2);
+            memcpy(redirect->heredoc + used, start, line_length);
+            used += line_length;
+            redirect->heredoc[used++] = '\n';
+            redirect->heredoc[used] = 0;
+        }
+        /* Otherwise each line goes to the body as soon as it is read */
+        else if (!failed)
+            failed =
+                psh_backend_heredoc_write(state, body, start, line_length) ||
+                psh_backend_heredoc_write(state, body, "\n", 1);
+        xfree(line);
+    }
+    if (expand)
+        return 0;
+    redirect->rhs.fd = psh_backend_heredoc_finish(state, body);
+    return failed || redirect->rhs.fd < 0;
+}
+
+/* Expand the lines of the here-document body TEXT and make the result the
+ * right-hand side of REDIRECT. Returns 1 on errors */
+static int expand_heredoc(psh_state *state, struct _psh_redirect *redirect,
+                          const char *text)
+{
+    struct _psh_heredoc *body = psh_backend_heredoc_new();
+    int failed = 0;
+    while (*text)
+    {
+        size_t length = strcspn(text, "\n");
+        char *line = xmalloc(length + 1), *expanded;
+        psh_strncpy(line, text, length);
+        expanded = expand_heredoc_line(state, line);
+        if (!failed)
+            failed = psh_backend_heredoc_write(state, body, expanded,
+                                               strlen(expanded)) ||
+                     psh_backend_heredoc_write(state, body, "\n", 1);
+        xfree(expanded);
+        xfree(line);
+        text += text[length] ? length + 1 : length;
+    }
+    redirect->rhs.fd = psh_backend_heredoc_finish(state, body);
+    return failed || redirect->rhs.fd < 0;
+}
+
+/* Give REDIRECT the body of the here-document TWIN read when the command was
+ * parsed, expanding it if needed. Returns 1 on errors */
+static int take_heredoc(psh_state *state, struct _psh_redirect *redirect,
+                        struct _psh_redirect *twin)
+{
+    if (twin == NULL || twin->type != PSH_REDIR_HEREXX)
+        code_fault(state, __FILE__, __LINE__);
+    if (twin->heredoc)
+        return expand_heredoc(state, redirect, twin->heredoc);
+    redirect->rhs.fd = twin->rhs.fd;
+    twin->rhs.fd = -1;
+    return 0;
+}
+
+/* Make WORD, followed by a newline, the body of the here-string REDIRECT.
+ * Returns 1 on errors */
+static int set_herestring(psh_state *state, struct _psh_redirect *redirect,
+                          const char *word)
+{
+    struct _psh_heredoc *body = psh_backend_heredoc_new();
+    int failed = psh_backend_heredoc_write(state, body, word, strlen(word)) ||
+                 psh_backend_heredoc_write(state, body, "\n", 1);
+    redirect->rhs.fd = psh_backend_heredoc_finish(state, body);
+    return failed || redirect->rhs.fd < 0;
+}
+
+/* Start the process substitution in SOURCE, which is LENGTH characters long,
+ * and write the path to its pipe to the argument being built. Returns the
+ * number of characters written */
+static int substitute_process(psh_state *state, struct _psh_command *cmd,
+                              int element, int *charcnt, const char *source,
+                              size_t length, int readable)
+{
+    struct _psh_command *sub = new_command();
+    char *text = xmalloc(length + 1), path[32];
+    int fd = -1;
+
+    memcpy(text, source, length);
+    text[length] = 0;
+    if (filpinfo(state, text, sub) > 0)
+        fd = psh_backend_procsub(state, sub, readable, path, sizeof(path));
+    free_command(sub);
+    if (fd < 0)
+        return 0;
+    /* Open until the command is started */
+    command_hold_fd(cmd, fd);
+    length = strlen(path);
+    append_argument(cmd, element, charcnt, path, length);
+    return length;
+}
+
+/* Parse what follows the reserved word coproc at BUFFER[START]: either
+ * [NAME] { list; } or a simple command, named COPROC. The command is stored
+ * in CMD->coproc and its name in argv[1]. Returns the index of the last
+ * character used, -1 on errors */
+static int parse_coproc(psh_state *state, struct _psh_command *cmd,
+                        const char *buffer, int start)
+{
+    int name_end = start, body_start, end;
+    char *body;
+    while (isalnum(buffer[name_end]) || buffer[name_end] == '_')
+        ++name_end;
+    body_start = name_end;
+    while (buffer[body_start] == ' ' || buffer[body_start] == '\t')
+        ++body_start;
+    if (buffer[body_start] == '{' && !isdigit(buffer[start]))
+    {
+        /* coproc [NAME] { list; } */
+        end = find_closing(buffer, body_start + 1, '{', '}');
+        if (end < 0)
+        {
+            OUT2E("%s: unexpected EOF while looking for matching `}'\n",
+                  state->argv0);
+            return -1;
+        }
+        ++body_start;
+    }
+    else
+    {
+        /* coproc command [args], up to the end of the list */
+        char quote = 0;
+        name_end = body_start = start;
+        for (end = start; buffer[end]; ++end)
+        {
+            if (buffer[end] == '\\' && quote != '\'' && buffer[end + 1])
+                ++end;
+            else if (quote)
+                quote = buffer[end] == quote ? 0 : quote;
+            else if (buffer[end] == '\'' || buffer[end] == '"')
+                quote = buffer[end];
+            else if (buffer[end] == ';' || buffer[end] == '&')
+                break;
+        }
+    }
+    body = xmalloc(end - body_start + 1);
+    psh_strncpy(body, buffer + body_start, end - body_start);
+    cmd->coproc = new_command();
+    if (filpinfo(state, body, cmd->coproc) <= 0)
+    {
+        OUT2E("%s: coproc: command expected\n", state->argv0);
+        return -1;
+    }
+    command_argv_reserve(cmd, 1);
+    cmd->argv[1] = xcalloc(MAXEACHARG, P_CS);
+    if (name_end == start)
+        strcpy(cmd->argv[1], "COPROC");
+    else
+        psh_strncpy(cmd->argv[1], buffer + start,
+                    name_end - start < MAXEACHARG ? name_end - start
+                                                  : MAXEACHARG - 1);
+    /* The closing brace is used too */
+    return buffer[end] == '}' ? end : end - 1;
+}
+
+/* Append the next line of input to *BUFFER after a newline. Returns -1 at
+ * EOF */
+static int read_more(psh_state *state, char **buffer, const char *wanted)
+{
+    char *line = read_line(state);
+    size_t length = strlen(*buffer);
+    if (line == NULL)
+    {
+        OUT2E("%s: unexpected EOF while looking for `%s'\n", state->argv0,
+              wanted);
+        return -1;
+    }
+    *buffer = xrealloc(*buffer, length + strlen(line) + 2);
+    (*buffer)[length] = '\n';
+    strcpy(*buffer + length + 1, line);
+    xfree(line);
+    return 0;
+}
+
+/* Length of the unquoted word at BUFFER, as far as do and done are
+ * concerned */
+static size_t loop_word_length(const char *buffer)
+{
+    size_t length = 0;
+    while (buffer[length] && !strchr(" \t\n;&|()<>'\"\\", buffer[length]))
+        ++length;
+    return length;
+}
+
+/* Whether the word at BUFFER is the reserved word WORD */
+static int is_reserved(const char *buffer, const char *word)
+{
+    size_t length = loop_word_length(buffer);
+    return length == strlen(word) && strncmp(buffer, word, length) == 0;
+}
+
+/* Copy the LENGTH characters of a loop body at TEXT, with newlines turned
+ * into the `;' they stand for */
+static char *copy_loop_body(const char *text, size_t length)
+{
+    char *body = xmalloc(length + 1), quote = 0;
+    size_t idx, out = 0;
+    for (idx = 0; idx < length; ++idx)
+    {
+        char current = text[idx];
+        if (current == '\\' && quote != '\'' && idx + 1 < length)
+        {
+            body[out++] = current;
+            current = text[++idx];
+        }
+        else if (quote)
+            quote = current == quote ? 0 : quote;
+        else if (current == '\'' || current == '"')
+            quote = current;
+        else if (current == '\n')
+        {
+            /* Not after an operator that continues on the next line */
+            size_t last = out;
+            while (last > 0 && strchr(" \t", body[last - 1]))
+                --last;
+            current = last == 0 || strchr(";&|", body[last - 1]) ? ' ' : ';';
+        }
+        body[out++] = current;
+    }
+    /* Trailing separators */
+    while (out > 0 && strchr(" \t;", body[out - 1]))
+        --out;
+    body[out] = 0;
+    return body;
+}
+
+/* Parse what follows the reserved word for at (*BUFFER)[START]:
+ * [-P N] [-e] NAME [in WORD...]; do LIST; done, reading more lines until the
+ * done. CMD becomes a call to the builtin for with the body, kept
+ * unexpanded, and the words of the header as arguments. They are expanded
+ * if PARSED is set, as in parse(), otherwise *DEFERRED is set if they need
+ * to be. Returns the index of the last character used, -1 on errors */
+static int parse_for(psh_state *state, struct _psh_command *cmd,
+                     char **buffer, int start, struct _psh_command *parsed,
+                     int *deferred)
+{
+    struct _psh_command *header = new_command();
+    int idx = start, body_start, depth = 1, at_command = 1, argc;
+    char quote = 0, *text;
+    /* The header ends at the first unquoted separator */
+    for (; (*buffer)[idx] && (quote || !strchr(";\n", (*buffer)[idx])); ++idx)
+    {
+        if ((*buffer)[idx] == '\\' && quote != '\'' && (*buffer)[idx + 1])
+            ++idx;
+        else if (quote)
+            quote = (*buffer)[idx] == quote ? 0 : quote;
+        else if ((*buffer)[idx] == '\'' || (*buffer)[idx] == '"')
+            quote = (*buffer)[idx];
+    }
+    text = xmalloc(idx - start + 1);
+    psh_strncpy(text, *buffer + start, idx - start);
+    if (parse(state, text, header, parsed) <= 0 || header->next)
+    {
+        OUT2E("%s: for: name expected\n", state->argv0);
+        goto fail;
+    }
+    if (header->source)
+        *deferred = 1;
+    /* Then do, possibly on the next line */
+    for (;;)
+    {
+        while ((*buffer)[idx] && strchr(" \t\n;", (*buffer)[idx]))
+            ++idx;
+        if ((*buffer)[idx])
+            break;
+        if (read_more(state, buffer, "do") < 0)
+            goto fail;
+    }
+    if (!is_reserved(*buffer + idx, "do"))
+    {
+        OUT2E("%s: syntax error: `do' expected\n", state->argv0);
+        goto fail;
+    }
+    body_start = idx += 2;
+    /* The matching done, with nested loops */
+    for (;;)
+    {
+        char current = (*buffer)[idx];
+        size_t length;
+        if (current == 0)
+        {
+            if (read_more(state, buffer, "done") < 0)
+                goto fail;
+            continue;
+        }
+        if (current == '\\' && quote != '\'' && (*buffer)[idx + 1])
+        {
+            idx += 2;
+            continue;
+        }
+        if (quote || current == '\'' || current == '"')
+        {
+            if (!quote)
+                at_command = 0;
+            quote = current == quote ? 0 : quote ? quote : current;
+            ++idx;
+            continue;
+        }
+        if (strchr(" \t)<>;&|(\n", current))
+        {
+            /* A command follows operators */
+            if (strchr(";&|(\n", current))
+                at_command = 1;
+            ++idx;
+            continue;
+        }
+        length = loop_word_length(*buffer + idx);
+        if (at_command && is_reserved(*buffer + idx, "done") && --depth == 0)
+            break;
+        if (at_command && is_reserved(*buffer + idx, "do"))
+            ++depth;
+        else
+            at_command = 0;
+        idx += length ? length : 1;
+    }
+    /* for BODY HEADER... */
+    for (argc = 0; header->argv[argc]; ++argc)
+        ;
+    command_argv_reserve(cmd, argc + 1);
+    cmd->argv[1] = copy_loop_body(*buffer + body_start, idx - body_start);
+    for (argc = 0; header->argv[argc]; ++argc)
+    {
+        /* With room for what the caller might append */
+        cmd->argv[argc + 2] = xmalloc(strlen(header->argv[argc]) + MAXEACHARG);
+        strcpy(cmd->argv[argc + 2], header->argv[argc]);
+    }
+    free_command(header);
+    return idx + 3;
+fail:
+    free_command(header);
+    return -1;
+}
+
+/* Whether the LENGTH characters at WORD are like {varname} */
+static int is_fd_varname(const char *word, size_t length)
+{
+    size_t idx;
+    if (length < 3 || word[0] != '{' || word[length - 1] != '}' ||
+        isdigit(word[1]))
+        return 0;
+    for (idx = 1; idx < length - 1; ++idx)
+        if (!isalnum(word[idx]) && word[idx] != '_')
+            return 0;
+    return 1;
+}
+
+/* Store WORD as the right-hand side of REDIRECT, as a file descriptor if
+ * FOR_FD is set or as a file name otherwise. Returns 1 on a bad target */
+static int set_redirect_target(psh_state *state, struct _psh_redirect *redirect,
+                               const char *word, int for_fd)
+{
+    if (!for_fd)
+    {
+        redirect->rhs.file = psh_strdup(word);
+        return 0;
+    }
+    if (strcmp(word, "-") == 0)
+    {
+        redirect->type = PSH_REDIR_CLOSEFD;
+        redirect->rhs.fd = -1;
+        return 0;
+    }
+    if (*word == 0 || strspn(word, "0123456789") != strlen(word))
+    {
+        OUT2E("%s: %s: ambiguous redirect\n", state->argv0, word);
+        return 1;
+    }
+    redirect->rhs.fd = atoi(word);
+    return 0;
+}
+
 /* Fill a command with a buffer, free() the buffer, and return the number of
- * characters processed */
-int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
+ * characters processed. Parameters and commands to substitute are kept as
+ * they are, with the text of their commands in `source', unless PARSED is
+ * set: BUFFER is then the text of that command, and is expanded now that it
+ * is run */
+static int parse(psh_state *state, char *buffer, struct _psh_command *info,
+                 struct _psh_command *parsed)
 {
 /* Report a syntax error */
 #define synerr(token)                                                          \
@@ -78,33 +779,66 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
     } while (0)
 
 /* malloc() and zero-initialize an element in argv[][] */
-#define malloc_one(n) (cmd_lastnode->argv[n]) = xcalloc(MAXEACHARG, P_CS)
+#define malloc_one(n)                                                          \
+    do                                                                         \
+    {                                                                          \
+        command_argv_reserve(cmd_lastnode, (n));                               \
+        (cmd_lastnode->argv[n]) = xcalloc(MAXEACHARG, P_CS);                   \
+    } while (0)
 
 /* Write the current char in buffer to current command, increase cnt_return
  * only if current is neither blank nor 0 */
 #define write_current()                                                        \
     do                                                                         \
     {                                                                          \
-        if (stat_parsing_redirect == 0)                                        \
-            cmd_lastnode->argv[cnt_argument_element][cnt_argument_char++] =    \
-                buffer[cnt_buffer];                                            \
-        if (stat_parsing_redirect == 1) /* for an fd */                        \
-        {                                                                      \
-            if (redir_lastnode == NULL)                                        \
-                redir_lastnode = xcalloc(1, sizeof(struct _psh_redirect));     \
-            if (!isdigit(buffer[cnt_buffer]))                                  \
-            {                                                                  \
-                OUT2E("%s: %c: Digit input required\n", state->argv0,          \
-                      buffer[cnt_buffer]);                                     \
-                cnt_return = -2;                                               \
-                goto done;                                                     \
-            }                                                                  \
-        }                                                                      \
+        cmd_lastnode->argv[cnt_argument_element][cnt_argument_char++] =        \
+            buffer[cnt_buffer];                                                \
         if (strchr(" \t", buffer[cnt_buffer]) == NULL &&                       \
             buffer[cnt_buffer] != 0) /* current char not blank */              \
             cnt_return++;                                                      \
     } while (0) /* Make the semicolon happy */
 
+/* If the current word is the target of a redirection, move it from argv to
+ * the redirection and empty the word */
+#define end_redirect()                                                         \
+    do                                                                         \
+    {                                                                          \
+        char *word = cmd_lastnode->argv[cnt_argument_element];                 \
+        int failed;                                                            \
+        if (stat_parsing_redirect == 0)                                        \
+            break;                                                             \
+        word[cnt_argument_char] = 0;                                           \
+        if (cnt_argument_element != cnt_redirect_element)                      \
+        {                                                                      \
+            /* The target was split into several fields */                     \
+            OUT2E("%s: ambiguous redirect\n", state->argv0);                   \
+            cnt_return = -2;                                                   \
+            goto done;                                                         \
+        }                                                                      \
+        if (stat_parsing_redirect == 3 && parsed)                              \
+            failed = take_heredoc(state, redir_lastnode, redir_twin);          \
+        else if (stat_parsing_redirect == 3)                                   \
+            failed = read_heredoc(state, redir_lastnode, word,                 \
+                                  buffer + cnt_redirect_start,                 \
+                                  cnt_buffer - cnt_redirect_start,             \
+                                  stat_strip_tabs);                            \
+        else if (stat_parsing_redirect == 4)                                   \
+            failed = set_herestring(state, redir_lastnode, word);              \
+        else                                                                   \
+            failed = set_redirect_target(state, redir_lastnode, word,          \
+                                         stat_parsing_redirect == 1);          \
+        if (failed)                                                            \
+        {                                                                      \
+            cnt_return = -2;                                                   \
+            goto done;                                                         \
+        }                                                                      \
+        if (redir_lastnode->heredoc && !parsed)                                \
+            stat_deferred = 1;                                                 \
+        word[0] = 0;                                                           \
+        cnt_argument_char = 0;                                                 \
+        stat_parsing_redirect = 0;                                             \
+    } while (0)
+
 /* Write any char to current command, increase cnt_return only if c != 0 */
 #define write_char(c)                                                          \
     do                                                                         \
@@ -114,6 +848,33 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
             cnt_return++;                                                      \
     } while (0)
 
+/* Keep LENGTH characters from the current one as they are, to be expanded
+ * when the command is run */
+#define defer_raw(length)                                                      \
+    do                                                                         \
+    {                                                                          \
+        append_argument(cmd_lastnode, cnt_argument_element,                    \
+                        &cnt_argument_char, buffer + cnt_buffer, (length));    \
+        cnt_return += (length);                                                \
+        stat_deferred = 1;                                                     \
+    } while (0)
+
+/* The current command ends at cnt_buffer, keep its text if it is to be
+ * expanded */
+#define end_command()                                                          \
+    do                                                                         \
+    {                                                                          \
+        if (stat_deferred && !parsed)                                          \
+        {                                                                      \
+            cmd_lastnode->source =                                             \
+                xmalloc(cnt_buffer - cnt_command_start + 1);                   \
+            psh_strncpy(cmd_lastnode->source, buffer + cnt_command_start,      \
+                        cnt_buffer - cnt_command_start);                       \
+        }                                                                      \
+        stat_deferred = 0;                                                     \
+        stat_quoted_word = 0;                                                  \
+    } while (0)
+
 #define escape (cnt_buffer != 0 && buffer[cnt_buffer - 1] == '\\')
 #define ignore (stat_in_dquote == 1 || stat_in_squote == 1 || escape)
     /*
@@ -123,10 +884,13 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
     */
     struct _psh_command *cmd_lastnode =
         info /* The last node of the command list */;
-    struct _psh_redirect *redir_lastnode = info ? info->rlist : NULL;
-    int stat_in_squote = 0, stat_in_dquote = 0, stat_parsing_redirect = 0;
+    struct _psh_redirect *redir_lastnode = NULL, *redir_twin = NULL;
+    int stat_in_squote = 0, stat_in_dquote = 0, stat_parsing_redirect = 0,
+        stat_strip_tabs = 0, stat_deferred = 0, stat_quoted_word = 0;
     int cnt_buffer = 0, cnt_argument_char = 0, cnt_argument_element = 0,
-        cnt_return = 0, cnt_old_parameter = 0, cnt_first_nonIFS = 0;
+        cnt_return = 0, cnt_old_parameter = 0, cnt_first_nonIFS = 0,
+        cnt_redirect_element = 0, cnt_redirect_start = 0,
+        cnt_command_start = 0;
     /*
     -- Variable prefixes:
         - cnt: count;
@@ -138,22 +902,33 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
         x = 0: Not parsing for redirect;
         x = 1: Parsing for a fd (like 3>&1, 2<&7);
         x = 2: Parsing for a filename (like 1>output, 2>/dev/null);
+        x = 3: Parsing for a here-document delimiter (like <<EOF);
+        x = 4: Parsing for a here-string (like <<<word);
+        - stat_strip_tabs: whether the here-document is <<-;
+        - stat_deferred: whether the current command has something to
+    expand when it is run;
+        - stat_quoted_word: whether the current word has quotes, so that it
+    is kept even if it is empty;
         - cnt_buffer: count for buffer;
         - cnt_argument_char: count for current parameter element;
         - cnt_argument_element: count representing how many elements are there
     in parameter;
         - cnt_return: characters actually wrote to the command, returned;
         - cnt_old_parameter: saved cnt_argument_char for undo IFS delim;
-        - cnt_first_nonIFS: the first non-IFS char in buffer.
+        - cnt_first_nonIFS: the first non-IFS char in buffer;
+        - cnt_redirect_element: the element the redirection target is
+    collected in;
+        - cnt_redirect_start: where the redirection target starts in buffer;
+        - cnt_command_start: where the current command starts in buffer.
     */
     /* The input command should be initialized in main.c, otherwise report a
      * programming error */
     if (info == NULL)
         code_fault(state, __FILE__, __LINE__);
-    if (state->verbose)
+    if (state->verbose && !parsed)
         OUT2E("%s\n", buffer);
     ignIFS(); /* Ignore starting spaces */
-    cnt_first_nonIFS = ++cnt_buffer;
+    cnt_first_nonIFS = cnt_command_start = ++cnt_buffer;
     do
     {
         switch (buffer[cnt_buffer])
@@ -169,9 +944,9 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                 else
                 {
                     if (cnt_buffer == cnt_first_nonIFS)
-                        stat_in_squote = 1;
+                        stat_in_squote = stat_quoted_word = 1;
                     else if (!escape)
-                        stat_in_squote = 1;
+                        stat_in_squote = stat_quoted_word = 1;
                     else /* not the first char and a '\\' is there */
                         /* Write a ' */
                         write_current();
@@ -190,7 +965,7 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                     else if (escape)
                         write_current();
                     else
-                        stat_in_dquote = 1;
+                        stat_in_dquote = stat_quoted_word = 1;
                 }
                 break;
             case '\t':
@@ -200,10 +975,77 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                 else
                 {
                     ignIFS();
+                    if (stat_parsing_redirect)
+                    {
+                        /* The element is reused for the next word */
+                        end_redirect();
+                        break;
+                    }
+                    if (cnt_argument_element == 0 && cnt_argument_char == 4 &&
+                        !cmd_lastnode->timed &&
+                        strncmp(cmd_lastnode->argv[0], "time", 4) == 0)
+                    {
+                        /* The reserved word applies to the whole pipeline,
+                         * the word is reused for the first command */
+                        cmd_lastnode->timed = 1;
+                        cnt_argument_char = 0;
+                        break;
+                    }
+                    if (cnt_argument_element == 0 && cnt_argument_char == 2 &&
+                        cmd_lastnode->timed == 1 &&
+                        strncmp(cmd_lastnode->argv[0], "-v", 2) == 0)
+                    {
+                        /* time -v */
+                        cmd_lastnode->timed = 2;
+                        cnt_argument_char = 0;
+                        break;
+                    }
+                    if (cnt_argument_element == 0 && cnt_argument_char == 6 &&
+                        !cmd_lastnode->coproc &&
+                        strncmp(cmd_lastnode->argv[0], "coproc", 6) == 0)
+                    {
+                        /* The reserved word takes the whole command */
+                        int end = parse_coproc(state, cmd_lastnode, buffer,
+                                               cnt_buffer + 1);
+                        if (end < 0)
+                        {
+                            cnt_return = -2;
+                            goto done;
+                        }
+                        cmd_lastnode->argv[0][cnt_argument_char] = 0;
+                        cnt_argument_element = 1;
+                        cnt_argument_char = strlen(cmd_lastnode->argv[1]);
+                        cnt_buffer = end;
+                        break;
+                    }
+                    if (cnt_argument_element == 0 && cnt_argument_char == 3 &&
+                        strncmp(cmd_lastnode->argv[0], "for", 3) == 0)
+                    {
+                        /* The reserved word takes the whole loop */
+                        int end =
+                            parse_for(state, cmd_lastnode, &buffer,
+                                      cnt_buffer + 1, parsed, &stat_deferred);
+                        if (end < 0)
+                        {
+                            cnt_return = -2;
+                            goto done;
+                        }
+                        cmd_lastnode->argv[0][cnt_argument_char] = 0;
+                        while (cmd_lastnode->argv[cnt_argument_element + 1])
+                            ++cnt_argument_element;
+                        cnt_argument_char =
+                            strlen(cmd_lastnode->argv[cnt_argument_element]);
+                        cnt_buffer = end;
+                        break;
+                    }
+                    if (parsed && cnt_argument_char == 0 && !stat_quoted_word)
+                        /* Expanded to nothing, the element is reused */
+                        break;
                     write_char(0);
                     cnt_argument_element++;
                     cnt_old_parameter = cnt_argument_char;
                     cnt_argument_char = 0;
+                    stat_quoted_word = 0;
                     malloc_one(cnt_argument_element);
                 }
                 break;
@@ -212,13 +1054,16 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                     write_current();
                 else
                 {
-                    if (cnt_argument_char == 0) /* Previously a blank reached */
+                    end_redirect();
+                    /* Previously a blank reached, or only redirections */
+                    if (cnt_argument_char == 0 && cnt_argument_element > 0)
                     {
                         cnt_argument_char = cnt_old_parameter;
                         xfree(cmd_lastnode->argv[cnt_argument_element]);
                         cmd_lastnode->argv[cnt_argument_element] = NULL;
                         cnt_argument_element--;
                     }
+                    end_command();
                     if (ignore_IFSs(buffer,
                                     cnt_buffer + 1 /* the char after & */) ==
                         -5) /* EOL */
@@ -251,7 +1096,13 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                             -5) /* EOL */
                         {
                             char *cmdand_buf;
-                            cmdand_buf = psh_gets("> ");
+                            if ((cmdand_buf = read_line(state)) == NULL)
+                            {
+                                OUT2E("%s: unexpected EOF after `&&'\n",
+                                      state->argv0);
+                                cnt_return = -2;
+                                goto done;
+                            }
                             buffer =
                                 xrealloc(buffer, P_CS * (strlen(buffer) +
                                                          strlen(cmdand_buf) +
@@ -277,6 +1128,7 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                     cnt_argument_element = 0;
                     cnt_argument_char = 0;
                     ignIFS_from_next_char();
+                    cnt_command_start = cnt_buffer + 1;
                 }
                 break;
             case '|':
@@ -284,12 +1136,15 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                     write_current();
                 else
                 {
-                    if (cnt_argument_char == 0) /* Previously a blank reached */
+                    end_redirect();
+                    /* Previously a blank reached, or only redirections */
+                    if (cnt_argument_char == 0 && cnt_argument_element > 0)
                     {
                         cnt_argument_char = cnt_old_parameter;
                         xfree(cmd_lastnode->argv[cnt_argument_element]);
                         cmd_lastnode->argv[cnt_argument_element] = NULL;
                     }
+                    end_command();
                     cmd_lastnode->next = new_command();
                     if (buffer[cnt_buffer + 1] == '|')
                     {
@@ -307,7 +1162,13 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                             -5) /* EOL */
                         {
                             char *cmdor_buf;
-                            cmdor_buf = psh_gets("> ");
+                            if ((cmdor_buf = read_line(state)) == NULL)
+                            {
+                                OUT2E("%s: unexpected EOF after `||'\n",
+                                      state->argv0);
+                                cnt_return = -2;
+                                goto done;
+                            }
                             buffer =
                                 xrealloc(buffer, P_CS * (strlen(buffer) +
                                                          strlen(cmdor_buf) +
@@ -332,7 +1193,13 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                             -5) /* EOL */
                         {
                             char *pipe_buf;
-                            pipe_buf = psh_gets("> ");
+                            if ((pipe_buf = read_line(state)) == NULL)
+                            {
+                                OUT2E("%s: unexpected EOF after `|'\n",
+                                      state->argv0);
+                                cnt_return = -2;
+                                goto done;
+                            }
                             buffer = xrealloc(buffer, P_CS * (strlen(buffer) +
                                                               strlen(pipe_buf) +
                                                               1 /* \0 */));
@@ -344,6 +1211,7 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                     cnt_argument_element = 0;
                     cnt_argument_char = 0;
                     ignIFS_from_next_char();
+                    cnt_command_start = cnt_buffer + 1;
                 }
                 break;
             case '~': /* $HOME spanding stable */
@@ -440,177 +1308,276 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                 /* Line: command args... \
                  */
                 char *newline_buf;
-                newline_buf = psh_gets("> ");
+                if ((newline_buf = read_line(state)) == NULL)
+                {
+                    OUT2E("%s: unexpected EOF after `\\'\n", state->argv0);
+                    cnt_return = -2;
+                    goto done;
+                }
                 buffer =
                     xrealloc(buffer, P_CS * (strlen(buffer) +
                                              strlen(newline_buf) + 1 /* \0 */));
                 strncat(buffer, newline_buf, strlen(newline_buf));
                 xfree(newline_buf);
                 break;
-            case '>':
-                if (ignore)
-                {
+            case '`':
+                if (stat_in_squote || escape)
                     write_current();
-                    break;
-                }
-                if (buffer[cnt_buffer + 1] != '>')
+                else
                 {
-                    if (redir_lastnode->type != 0)
-                        code_fault(state, __FILE__, __LINE__);
-                    else if (buffer[cnt_buffer + 1] == '&')
-                        redir_lastnode->type = PSH_REDIR_FD2FD;
-                    else if (buffer[cnt_buffer + 1] == 0)
+                    int end = find_closing(buffer, cnt_buffer + 1, '`', '`');
+                    if (end < 0)
                     {
-                        synerr("newline");
+                        OUT2E("%s: unexpected EOF while looking for matching "
+                              "``'\n",
+                              state->argv0);
                         cnt_return = -2;
                         goto done;
                     }
+                    if (parsed)
+                        cnt_return += expand_command(
+                            state, cmd_lastnode, &cnt_argument_element,
+                            &cnt_argument_char, buffer + cnt_buffer + 1,
+                            end - cnt_buffer - 1, stat_in_dquote);
                     else
-                        redir_lastnode->type = PSH_REDIR_OUT_REDIR;
+                        defer_raw(end - cnt_buffer + 1);
+                    cnt_buffer = end;
                 }
-                if (cnt_buffer == cnt_first_nonIFS)
-                    redir_lastnode->lhs.fd = 1 /* stdout */;
-                else
+                break;
+            case '$':
+                /* TODO: Write variable cut, ANSI-C style escape, arithmetic
+                 * expansion code here */
+                if (stat_in_squote || escape)
                 {
-                    if (cnt_argument_char == 0) /* Previously a blank reached */
-                    {
-                        cnt_argument_char = cnt_old_parameter;
-                        xfree(cmd_lastnode->argv[cnt_argument_element]);
-                        cmd_lastnode->argv[cnt_argument_element] = NULL;
-                        cnt_argument_element--;
-                    }
-                    int case_count = cnt_buffer, case_buf_cnt = 0;
-                    char buf[MAXLINE] = {0};
-                    while (--case_count, 1 /* infinity loop */)
+                    write_current();
+                    break;
+                }
+                switch (buffer[cnt_buffer + 1])
+                {
+                    case '(':
                     {
-                        if (case_count == cnt_first_nonIFS ||
-                            !isdigit(buffer[case_count]))
+                        int end =
+                            find_closing(buffer, cnt_buffer + 2, '(', ')');
+                        if (buffer[cnt_buffer + 2] == '(')
                         {
-                            if (buf[0] == 0)
-                                buf[0] = 1 /* stdout */;
+                            /* Arithmetic expansion */
+                            write_current();
                             break;
                         }
-                        else /* digit */
-                            buf[case_buf_cnt++] = buffer[case_count];
-                    }
-                    int len = strlen(buf);
-                    char temp;
-                    int i;
-                    for (i = 0; i < len / 2; i++) /* reverse buf */
-                    {
-                        temp = buf[i];
-                        buf[i] = buf[len - i - 1];
-                        buf[len - i - 1] = temp;
-                    }
-                    redir_lastnode->lhs.fd = atoi(buf);
-                }
-                switch (buffer[cnt_buffer + 1])
-                {
-                    case '&':
-                        ++cnt_buffer; /* Increase cnt_buffer to the '&' */
-                        if (ignore_IFSs(buffer, ++cnt_buffer) ==
-                            -5) /* and remove all following blanks */
+                        if (end < 0)
                         {
-                            synerr("newline"); /* if EOL met, report error */
+                            OUT2E("%s: unexpected EOF while looking for "
+                                  "matching `)'\n",
+                                  state->argv0);
                             cnt_return = -2;
                             goto done;
                         }
-                        stat_parsing_redirect = 1; /* Parsing for fd */
+                        if (parsed)
+                            cnt_return += expand_command(
+                                state, cmd_lastnode, &cnt_argument_element,
+                                &cnt_argument_char, buffer + cnt_buffer + 2,
+                                end - cnt_buffer - 2, stat_in_dquote);
+                        else
+                            defer_raw(end - cnt_buffer + 1);
+                        cnt_buffer = end;
                         break;
-                    case ' ':
-                    case '\t':
-                    case '|':
-                        ++cnt_buffer; /* Increase cnt_buffer to the [' ''\t''|']
-                                       */
-                        if (ignore_IFSs(buffer, ++cnt_buffer) ==
-                            -5) /* and remove all following blanks */
+                    }
+                    case '{':
+                    {
+                        char *name;
+                        int end =
+                            find_closing(buffer, cnt_buffer + 2, '{', '}');
+                        if (end < 0)
                         {
-                            synerr("newline"); /* if EOL met, report error */
+                            synerr("${");
                             cnt_return = -2;
                             goto done;
                         }
-                        stat_parsing_redirect = 2; /* Parsing for filename */
-                        break;
-                    case '>': /* Out append */
-                        if (redir_lastnode->type != 0)
-                            code_fault(state, __FILE__, __LINE__);
-                        redir_lastnode->type = PSH_REDIR_OUT_APPN;
-                        ++cnt_buffer;
-                        switch (buffer[cnt_buffer + 1])
+                        if (!parsed)
                         {
-                            case '&':
-                                ++cnt_buffer; /* Increase cnt_buffer to the '&'
-                                               */
-                                if (ignore_IFSs(buffer, ++cnt_buffer) ==
-                                    -5) /* and remove all following blanks */
-                                {
-                                    synerr("newline"); /* if EOL met, report
-                                                          error */
-                                    cnt_return = -2;
-                                    goto done;
-                                }
-                                stat_parsing_redirect = 1; /* Parsing for fd */
-                                break;
-                            case ' ':
-                            case '\t':
-                            case '|':
-                                ++cnt_buffer; /* Increase cnt_buffer to the ['
-                                               * ''\t''|']
-                                               */
-                                if (ignore_IFSs(buffer, ++cnt_buffer) ==
-                                    -5) /* and remove all following blanks */
-                                {
-                                    synerr("newline"); /* if EOL met, report
-                                                          error */
-                                    cnt_return = -2;
-                                    goto done;
-                                }
-                                stat_parsing_redirect =
-                                    2; /* Parsing for filename */
-                                break;
-                            case '>': /* >>> */
-                                synerr(">");
-                                cnt_return = -2;
-                                goto done;
-                                break;
-                            case 0: /* EOL */
-                                synerr("newline");
-                                cnt_return = -2;
-                                goto done;
-                            default:
-                                stat_parsing_redirect = 2;
+                            defer_raw(end - cnt_buffer + 1);
+                            cnt_buffer = end;
+                            break;
                         }
+                        name = xmalloc(end - cnt_buffer - 1);
+                        psh_strncpy(name, buffer + cnt_buffer + 2,
+                                    end - cnt_buffer - 2);
+                        cnt_return += expand_parameter(
+                            state, cmd_lastnode, &cnt_argument_element,
+                            &cnt_argument_char, name, stat_in_dquote);
+                        xfree(name);
+                        cnt_buffer = end;
                         break;
-                    case 0:
-                        synerr("newline");
-                        cnt_return = -2;
-                        goto done;
-                    default: /* I don't need to handle the rest */
-                        stat_parsing_redirect = 2; /* Parsing for filename */
-                        break;
+                    }
+                    default:
+                    {
+                        char *name;
+                        size_t length =
+                            parameter_name_length(buffer + cnt_buffer + 1);
+                        if (length == 0)
+                        {
+                            /* A lone dollar sign */
+                            write_current();
+                            break;
+                        }
+                        if (!parsed)
+                        {
+                            defer_raw(length + 1);
+                            cnt_buffer += length;
+                            break;
+                        }
+                        name = xmalloc(length + 1);
+                        psh_strncpy(name, buffer + cnt_buffer + 1, length);
+                        cnt_return += expand_parameter(
+                            state, cmd_lastnode, &cnt_argument_element,
+                            &cnt_argument_char, name, stat_in_dquote);
+                        xfree(name);
+                        cnt_buffer += length;
+                    }
                 }
                 break;
-            case '`':
-                /* TODO: Write command substitute code here */
-                if (stat_in_squote || escape)
-                    write_current();
-                /* fall through */
-            case '$':
-                /* TODO: Write variable, variable cut,
-                 * ANSI-C style escape, command substitute,
-                 * arithmetic expansion code here */
-                if (stat_in_squote || escape)
+            case '<':
+            case '>':
+            {
+                char *word;
+                int next;
+                if (ignore)
+                {
                     write_current();
-                switch (buffer[cnt_buffer + 1])
+                    break;
+                }
+                if (buffer[cnt_buffer + 1] == '(')
+                {
+                    /* Process substitution */
+                    int end = find_closing(buffer, cnt_buffer + 2, '(', ')');
+                    if (end < 0)
+                    {
+                        OUT2E("%s: unexpected EOF while looking for "
+                              "matching `)'\n",
+                              state->argv0);
+                        cnt_return = -2;
+                        goto done;
+                    }
+                    if (parsed)
+                        cnt_return += substitute_process(
+                            state, cmd_lastnode, cnt_argument_element,
+                            &cnt_argument_char, buffer + cnt_buffer + 2,
+                            end - cnt_buffer - 2, buffer[cnt_buffer] == '<');
+                    else
+                        defer_raw(end - cnt_buffer + 1);
+                    cnt_buffer = end;
+                    break;
+                }
+                /* Like a>b>c */
+                end_redirect();
+                word = cmd_lastnode->argv[cnt_argument_element];
+                word[cnt_argument_char] = 0;
+                /* Append a new redirection, redir_lastnode is the last one of
+                 * this command if it already has any */
+                if (cmd_lastnode->rlist == NULL)
+                    redir_lastnode = cmd_lastnode->rlist =
+                        xcalloc(1, sizeof(struct _psh_redirect));
+                else
+                    redir_lastnode = redir_lastnode->next =
+                        xcalloc(1, sizeof(struct _psh_redirect));
+                /* The same one when the command was parsed */
+                if (parsed)
+                    redir_twin = redir_twin ? redir_twin->next : parsed->rlist;
+                redir_lastnode->lhs.fd =
+                    buffer[cnt_buffer] == '>' ? 1 /* stdout */ : 0 /* stdin */;
+                /* A word right before the operator can be its left-hand side:
+                 * 2>file, {varname}>file */
+                if (cnt_argument_char > 0 &&
+                    strspn(word, "0123456789") == (size_t)cnt_argument_char)
+                    redir_lastnode->lhs.fd = atoi(word);
+                else if (is_fd_varname(word, cnt_argument_char))
+                {
+                    redir_lastnode->fd_varname =
+                        xmalloc(cnt_argument_char - 1);
+                    psh_strncpy(redir_lastnode->fd_varname, word + 1,
+                                cnt_argument_char - 2);
+                }
+                else if (cnt_argument_char > 0)
                 {
+                    /* Otherwise it is an ordinary argument */
+                    write_char(0);
+                    cnt_argument_element++;
+                    cnt_old_parameter = cnt_argument_char;
+                    malloc_one(cnt_argument_element);
                 }
-                /* fall through */
+                cnt_argument_char = 0;
+                cmd_lastnode->argv[cnt_argument_element][0] = 0;
+                stat_parsing_redirect = 2; /* Parsing for filename */
+                if (buffer[cnt_buffer] == '>')
+                    switch (buffer[cnt_buffer + 1])
+                    {
+                        case '>':
+                            ++cnt_buffer;
+                            redir_lastnode->type = PSH_REDIR_OUT_APPN;
+                            break;
+                        case '&':
+                            ++cnt_buffer;
+                            redir_lastnode->type = PSH_REDIR_FD2FD;
+                            stat_parsing_redirect = 1; /* Parsing for fd */
+                            break;
+                        case '|':
+                            ++cnt_buffer;
+                            /* Fall through */
+                        default:
+                            redir_lastnode->type = PSH_REDIR_OUT_REDIR;
+                    }
+                else
+                    switch (buffer[cnt_buffer + 1])
+                    {
+                        case '&':
+                            ++cnt_buffer;
+                            redir_lastnode->type = PSH_REDIR_FD2FD;
+                            stat_parsing_redirect = 1; /* Parsing for fd */
+                            break;
+                        case '>':
+                            ++cnt_buffer;
+                            redir_lastnode->type = PSH_REDIR_OPENFN;
+                            break;
+                        case '<':
+                            ++cnt_buffer;
+                            redir_lastnode->type = PSH_REDIR_HEREXX;
+                            redir_lastnode->rhs.fd = -1;
+                            if (buffer[cnt_buffer + 1] == '<')
+                            {
+                                ++cnt_buffer;
+                                stat_parsing_redirect = 4; /* Here string */
+                                break;
+                            }
+                            stat_strip_tabs = buffer[cnt_buffer + 1] == '-';
+                            if (stat_strip_tabs)
+                                ++cnt_buffer;
+                            stat_parsing_redirect = 3; /* Here document */
+                            break;
+                        default:
+                            redir_lastnode->type = PSH_REDIR_IN_REDIR;
+                    }
+                /* The target is collected as an ordinary word */
+                next = ignore_IFSs(buffer, cnt_buffer + 1);
+                if (next == -5 ||
+                    (strchr("|&;<>", buffer[next + 1]) &&
+                     /* Unless it is a process substitution */
+                     !(strchr("<>", buffer[next + 1]) &&
+                       buffer[next + 2] == '(')))
+                {
+                    char token[2] = {0};
+                    token[0] = next == -5 ? 0 : buffer[next + 1];
+                    synerr(next == -5 ? "newline" : token);
+                    cnt_return = -2;
+                    goto done;
+                }
+                cnt_buffer = next;
+                cnt_redirect_element = cnt_argument_element;
+                cnt_redirect_start = next + 1;
+                break;
+            }
             case '(':
             case ')':
-            /* TODO: Write command sequence code here */
-            case '<':
-                /* TODO: Write input redirect, here string and here document
-                 * code here */
+                /* TODO: Write command sequence code here */
                 write_current();
                 break;
             case '#':
@@ -634,12 +1601,15 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                     write_current();
                 else
                 {
-                    if (cnt_argument_char == 0) /* Previously a blank reached */
+                    end_redirect();
+                    /* Previously a blank reached, or only redirections */
+                    if (cnt_argument_char == 0 && cnt_argument_element > 0)
                     {
                         cnt_argument_char = cnt_old_parameter;
                         xfree(cmd_lastnode->argv[cnt_argument_element]);
                         cmd_lastnode->argv[cnt_argument_element] = NULL;
                     }
+                    end_command();
                     cmd_lastnode->next = new_command();
                     if (cmd_lastnode->type == 0)
                         cmd_lastnode->type = PSH_CMD_MULTICMD;
@@ -655,33 +1625,72 @@ int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
                     {
                         goto done; /* Ending `;', end parsing */
                     }
-                    ++cnt_buffer;
+                    cmd_lastnode = cmd_lastnode->next;
+                    cnt_argument_element = 0;
+                    cnt_argument_char = 0;
+                    ignIFS_from_next_char();
+                    cnt_command_start = cnt_buffer + 1;
+                    /* TODO: `;;' of case */
                 }
-                cmd_lastnode = cmd_lastnode->next;
-                cnt_argument_element = 0;
-                cnt_argument_char = 0;
-                ignIFS_from_next_char();
-                do /* Remove all following `;'s. I'll mess up with case later.
-                      TODO */
-                {
-                    if (!buffer[cnt_buffer])
-                    {
-                        ;
-                    } /* EOL, No new command required */
-                    if (buffer[cnt_buffer] != ';')
-                    {
-                        --cnt_buffer;
-                        break;
-                    }
-                } while (++cnt_buffer);
                 break;
             default:
                 write_current();
         }
     } while (++cnt_buffer);
 done:
+    if (stat_parsing_redirect && cnt_return >= 0)
+    {
+        end_redirect();
+        if (cnt_argument_element > 0)
+        {
+            /* Drop the word the target was collected in */
+            xfree(cmd_lastnode->argv[cnt_argument_element]);
+            cmd_lastnode->argv[cnt_argument_element--] = NULL;
+            cnt_argument_char = cnt_old_parameter;
+        }
+    }
     if (cnt_return > 0)
+    {
         write_char(0);
+        end_command();
+    }
     xfree(buffer);
     return cnt_return;
 }
+
+int filpinfo(psh_state *state, char *buffer, struct _psh_command *info)
+{
+    return parse(state, buffer, info, NULL);
+}
+
+/* The words and redirections of the command parsed again are swapped in */
+int psh_expand_command(psh_state *state, struct _psh_command *cmd)
+{
+    struct _psh_command *expanded;
+    struct _psh_redirect *rlist;
+    char **argv;
+    size_t slots;
+    if (cmd->source == NULL)
+        return 0;
+    expanded = new_command();
+    if (parse(state, psh_strdup(cmd->source), expanded, cmd) < 0)
+    {
+        free_command(expanded);
+        return 1;
+    }
+    argv = cmd->argv;
+    slots = cmd->argv_slots;
+    rlist = cmd->rlist;
+    cmd->argv = expanded->argv;
+    cmd->argv_slots = expanded->argv_slots;
+    cmd->rlist = expanded->rlist;
+    expanded->argv = argv;
+    expanded->argv_slots = slots;
+    expanded->rlist = rlist;
+    /* Pipes of process substitutions stay open until the command starts */
+    while (expanded->held_fd_count)
+        command_hold_fd(cmd,
+                        expanded->held_fds[--expanded->held_fd_count]);
+    free_command(expanded);
+    return 0;
+}
@@ -23,6 +23,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 /* Some evil implementations include no stdio.h is history.h */
 #ifdef HAVE_READLINE_HISTORY_H
 #include <readline/history.h>
@@ -80,3 +81,19 @@ int read_cmdline(psh_state *state, char *prompt, char **result)
     *result = buffer;
     return 0;
 }
+
+/* The pointer is moved past the line and its newline */
+char *read_string_line(psh_state *state)
+{
+    const char *start = state->from_string;
+    size_t length;
+    char *line;
+    if (*start == 0)
+        return NULL;
+    length = strcspn(start, "\n");
+    line = xmalloc(length + 1);
+    memcpy(line, start, length);
+    line[length] = 0;
+    state->from_string = start[length] ? start + length + 1 : start + length;
+    return line;
+}
@@ -18,6 +18,11 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "jobs.h"
 #include "backend.h"
 #include "command.h"
@@ -25,36 +30,423 @@
 #include "libpsh/xmalloc.h"
 #include "psh.h"
 
+/* Job table of the shell, created on first use */
+static struct _psh_job_table *get_table(psh_state *state)
+{
+    if (state->jobs == NULL)
+    {
+        state->jobs = xcalloc(1, sizeof(struct _psh_job_table));
+        state->jobs->by_pid = psh_hash_create(32);
+        state->jobs->done = psh_hash_create(32);
+    }
+    return state->jobs;
+}
+
+/* Key of PID in by_pid */
+static void pid_key(char *key, size_t size, int pid)
+{
+    snprintf(key, size, "%d", pid);
+}
+
+/* Add DELTA to the counter of jobs in STATUS, if it has one */
+static void count_status(struct _psh_job_table *table,
+                         enum _psh_job_status status, int delta)
+{
+    if (status == PSH_JOB_RUNNING)
+        table->running += delta;
+    else if (status == PSH_JOB_STOPPED)
+        table->stopped += delta;
+}
+
 /* Add one job */
-int psh_jobs_add(psh_state *state, char *cmd, int pid, enum _psh_cmd_type type)
+int psh_jobs_add(psh_state *state, const char *cmd, int pid,
+                 enum _psh_cmd_type type)
 {
+    struct _psh_job_table *table = get_table(state);
     struct _psh_jobs *job = xcalloc(1, sizeof(struct _psh_jobs));
-    if (!state->jobs)
-        state->jobs = job;
-    else
+    char key[24];
+    /* Like other shells, one more than the highest ID in use */
+    job->id = table->max_id + 1;
+    if (job->id >= table->slots)
     {
-        struct _psh_jobs *where_to_add = state->jobs;
-        while (where_to_add->next)
-            where_to_add = where_to_add->next;
-        where_to_add->next = job;
+        int old_slots = table->slots;
+        table->slots = table->slots ? table->slots * 2 : 16;
+        table->by_id = xrealloc(table->by_id,
+                                sizeof(struct _psh_jobs *) * table->slots);
+        memset(table->by_id + old_slots, 0,
+               sizeof(struct _psh_jobs *) * (table->slots - old_slots));
     }
+    table->by_id[job->id] = job;
+    table->max_id = job->id;
+    ++table->count;
     job->name = psh_strdup(cmd);
     job->notified = 1;
     job->pid = pid;
+    job->pids = xmalloc(sizeof(int));
+    job->pids[0] = pid;
+    job->pid_count = job->pids_left = 1;
     job->type = type;
-    return 0;
+    job->status = PSH_JOB_RUNNING;
+    ++table->running;
+    job->start = psh_backend_now();
+    job->waitfd = psh_backend_watch_child(pid);
+    pid_key(key, sizeof(key), pid);
+    psh_hash_add_chk(table->by_pid, key, job, 0);
+    return job->id;
+}
+
+void psh_jobs_add_stage(psh_state *state, int id, const char *cmd, int pid)
+{
+    struct _psh_jobs *job = psh_jobs_get_id(state, id);
+    size_t length;
+    char key[24];
+    if (job == NULL)
+        return;
+    job->pids = xrealloc(job->pids, sizeof(int) * (job->pid_count + 1));
+    job->pids[job->pid_count++] = pid;
+    ++job->pids_left;
+    length = strlen(job->name);
+    job->name = xrealloc(job->name, length + strlen(cmd) + 4);
+    strcpy(job->name + length, " | ");
+    strcpy(job->name + length + 3, cmd);
+    job->pid = pid;
+    /* Only the last stage is watched, its status is the one waited for */
+    if (job->waitfd >= 0)
+        psh_backend_unwatch_child(job->waitfd);
+    job->waitfd = psh_backend_watch_child(pid);
+    pid_key(key, sizeof(key), pid);
+    psh_hash_add_chk(state->jobs->by_pid, key, job, 0);
+}
+
+struct _psh_jobs *psh_jobs_get_pid(psh_state *state, int pid)
+{
+    char key[24];
+    if (state->jobs == NULL)
+        return NULL;
+    pid_key(key, sizeof(key), pid);
+    return psh_hash_get(state->jobs->by_pid, key);
+}
+
+struct _psh_jobs *psh_jobs_get_id(psh_state *state, int id)
+{
+    if (state->jobs == NULL || id <= 0 || id > state->jobs->max_id)
+        return NULL;
+    return state->jobs->by_id[id];
+}
+
+struct _psh_jobs *psh_jobs_find(psh_state *state, const char *spec)
+{
+    int by_id = spec[0] == '%';
+    char *end;
+    long number;
+    if (by_id)
+    {
+        /* The current job is the most recent one */
+        if ((spec[1] == '%' || spec[1] == '+') && spec[2] == 0)
+            return state->jobs ? psh_jobs_get_id(state, state->jobs->max_id)
+                               : NULL;
+        ++spec;
+    }
+    number = strtol(spec, &end, 10);
+    if (*spec == 0 || *end != 0 || number <= 0 || number > INT_MAX)
+        return NULL;
+    if (by_id)
+        return psh_jobs_get_id(state, (int)number);
+    return psh_jobs_get_pid(state, (int)number);
+}
+
+/* Remove the entry of PID in by_pid if it is JOB's */
+static void forget_pid(struct _psh_job_table *table,
+                       const struct _psh_jobs *job, int pid)
+{
+    char key[24];
+    pid_key(key, sizeof(key), pid);
+    /* The PID could have been reused by a newer job */
+    if (psh_hash_get(table->by_pid, key) == job)
+        psh_hash_rm(table->by_pid, key);
+}
+
+void psh_jobs_remove(psh_state *state, struct _psh_jobs *job)
+{
+    struct _psh_job_table *table = state->jobs;
+    size_t idx;
+    forget_pid(table, job, job->pid);
+    for (idx = 0; idx < job->pid_count; ++idx)
+        if (job->pids[idx])
+            forget_pid(table, job, job->pids[idx]);
+    if (job->waitfd >= 0)
+        psh_backend_unwatch_child(job->waitfd);
+    table->by_id[job->id] = NULL;
+    --table->count;
+    count_status(table, job->status, -1);
+    /* Make the ID of the highest job available again */
+    while (table->max_id > 0 && table->by_id[table->max_id] == NULL)
+        --table->max_id;
+    xfree(job->name);
+    xfree(job->pids);
+    xfree(job);
+}
+
+/* Copy of a finished job, its name in the same allocation */
+struct done_job
+{
+    struct _psh_jobs job;
+    char name[];
+};
+
+/* Remember a finished job for wait and jobs -v */
+static void remember_job(struct _psh_job_table *table,
+                         const struct _psh_jobs *job)
+{
+    char key[24];
+    struct done_job *value =
+        xmalloc(sizeof(struct done_job) + strlen(job->name) + 1);
+    if (table->done_order == NULL)
+        table->done_order = xmalloc(sizeof(int) * PSH_JOBS_KEEP_DONE);
+    if (table->done_count == PSH_JOBS_KEEP_DONE)
+    {
+        /* Forget the oldest one */
+        pid_key(key, sizeof(key), table->done_order[table->done_first]);
+        psh_hash_rm(table->done, key);
+        table->done_first = (table->done_first + 1) % PSH_JOBS_KEEP_DONE;
+        --table->done_count;
+    }
+    table->done_order[(table->done_first + table->done_count++) %
+                      PSH_JOBS_KEEP_DONE] = job->pid;
+    value->job = *job;
+    strcpy(value->name, job->name);
+    value->job.name = value->name;
+    value->job.pids = NULL;
+    value->job.pid_count = 0;
+    value->job.waitfd = -1;
+    /* Not shown by jobs -v yet */
+    value->job.notified = 0;
+    pid_key(key, sizeof(key), job->pid);
+    psh_hash_add_chk(table->done, key, value, 1);
+}
+
+int psh_jobs_take_status(psh_state *state, int pid)
+{
+    struct _psh_jobs *job;
+    struct done_job *value;
+    char key[24];
+    int exit_status;
+    if (state->jobs == NULL)
+        return -1;
+    pid_key(key, sizeof(key), pid);
+    if ((value = psh_hash_get(state->jobs->done, key)) == NULL)
+        return -1;
+    exit_status = value->job.exit_status;
+    /* Its entry in done_order becomes stale */
+    psh_hash_rm(state->jobs->done, key);
+    /* Waited for, so not to be notified */
+    job = psh_jobs_get_pid(state, pid);
+    if (job && (job->status == PSH_JOB_DONE || job->status == PSH_JOB_SIGNALED))
+        psh_jobs_remove(state, job);
+    return exit_status;
+}
+
+struct _psh_jobs *psh_jobs_next_done(psh_state *state, size_t *cursor)
+{
+    struct _psh_job_table *table = state->jobs;
+    if (table == NULL)
+        return NULL;
+    while (*cursor < table->done_count)
+    {
+        char key[24];
+        struct done_job *value;
+        pid_key(key, sizeof(key),
+                table->done_order[(table->done_first + (*cursor)++) %
+                                  PSH_JOBS_KEEP_DONE]);
+        /* Skip stale entries */
+        if ((value = psh_hash_get(table->done, key)) != NULL)
+            return &value->job;
+    }
+    return NULL;
+}
+
+int psh_jobs_take_next_status(psh_state *state, int *pid)
+{
+    struct _psh_job_table *table = state->jobs;
+    if (table == NULL)
+        return -1;
+    while (table->done_count)
+    {
+        int next = table->done_order[table->done_first];
+        int exit_status;
+        table->done_first = (table->done_first + 1) % PSH_JOBS_KEEP_DONE;
+        --table->done_count;
+        if ((exit_status = psh_jobs_take_status(state, next)) >= 0)
+        {
+            if (pid)
+                *pid = next;
+            return exit_status;
+        }
+    }
+    return -1;
+}
+
+void psh_jobs_describe(const struct _psh_jobs *job, int with_pid,
+                       char *buffer, size_t size)
+{
+    char status[32];
+    switch (job->status)
+    {
+        case PSH_JOB_RUNNING:
+            strcpy(status, "Running");
+            break;
+        case PSH_JOB_STOPPED:
+            strcpy(status, "Stopped");
+            break;
+        case PSH_JOB_SIGNALED:
+            snprintf(status, sizeof(status), "Signal %d", job->sig);
+            break;
+        case PSH_JOB_DONE:
+            if (job->exit_status)
+                snprintf(status, sizeof(status), "Exit %d", job->exit_status);
+            else
+                strcpy(status, "Done");
+            break;
+    }
+    if (with_pid)
+        snprintf(buffer, size, "[%d]  %-8d%-24s%s", job->id, job->pid, status,
+                 job->name);
+    else
+        snprintf(buffer, size, "[%d]  %-24s%s", job->id, status, job->name);
+}
+
+/* Add the resources used by one more process to TOTAL */
+static void add_usage(struct _psh_job_usage *total,
+                      const struct _psh_job_usage *usage)
+{
+    total->user += usage->user;
+    total->sys += usage->sys;
+    if (usage->maxrss > total->maxrss)
+        total->maxrss = usage->maxrss;
+    total->inblock += usage->inblock;
+    total->oublock += usage->oublock;
+    total->nvcsw += usage->nvcsw;
+    total->nivcsw += usage->nivcsw;
+}
+
+void psh_jobs_set_status(psh_state *state, int pid,
+                         enum _psh_job_status status, int wait_stat,
+                         int exit_status, const struct _psh_job_usage *usage)
+{
+    struct _psh_jobs *job = psh_jobs_get_pid(state, pid);
+    size_t idx;
+    if (job == NULL)
+        return;
+    if (status == PSH_JOB_STOPPED)
+    {
+        /* Any stage stops the whole job */
+        count_status(state->jobs, job->status, -1);
+        count_status(state->jobs, status, 1);
+        job->status = status;
+        job->wait_stat = wait_stat;
+        job->sig = exit_status;
+        job->notified = 0;
+        return;
+    }
+    for (idx = 0; idx < job->pid_count; ++idx)
+        if (job->pids[idx] == pid)
+        {
+            job->pids[idx] = 0;
+            --job->pids_left;
+        }
+    if (usage)
+        add_usage(&job->usage, usage);
+    if (pid == job->pid)
+    {
+        job->last_status = status;
+        job->wait_stat = wait_stat;
+        job->exit_status = exit_status;
+        if (status == PSH_JOB_SIGNALED)
+            job->sig = exit_status - 128;
+        /* Nothing more to wait for */
+        if (job->waitfd >= 0)
+        {
+            psh_backend_unwatch_child(job->waitfd);
+            job->waitfd = -1;
+        }
+    }
+    else
+        /* Only the last stage's PID stays, for wait */
+        forget_pid(state->jobs, job, pid);
+    if (job->pids_left)
+        return;
+    count_status(state->jobs, job->status, -1);
+    count_status(state->jobs, job->last_status, 1);
+    job->status = job->last_status;
+    job->notified = 0;
+    job->end = psh_backend_now();
+    remember_job(state->jobs, job);
+    if (!state->interactive)
+        /* Nobody to tell */
+        psh_jobs_remove(state, job);
+}
+
+void psh_jobs_notify(psh_state *state)
+{
+    char description[256];
+    int id;
+    if (state->jobs == NULL)
+        return;
+    for (id = 1; id <= state->jobs->max_id; ++id)
+    {
+        struct _psh_jobs *job = state->jobs->by_id[id];
+        if (job == NULL || job->notified)
+            continue;
+        job->notified = 1;
+        if (job->status == PSH_JOB_RUNNING)
+            continue;
+        psh_jobs_describe(job, 0, description, sizeof(description));
+        OUT2E("%s\n", description);
+        if (job->status != PSH_JOB_STOPPED)
+            psh_jobs_remove(state, job);
+    }
+}
+
+size_t psh_jobs_count(psh_state *state)
+{
+    return state->jobs ? state->jobs->running + state->jobs->stopped : 0;
+}
+
+size_t psh_jobs_running(psh_state *state)
+{
+    return state->jobs ? state->jobs->running : 0;
 }
 
 void psh_jobs_free(psh_state *state, int sighup)
 {
-    struct _psh_jobs *cur = state->jobs, *tmp;
-    while (cur)
+    struct _psh_job_table *table = state->jobs;
+    int id;
+    if (table == NULL)
+        return;
+    for (id = 1; id <= table->max_id; ++id)
     {
-        xfree(cur->name);
-        if (sighup)
-            psh_backend_hup(cur->pid);
-        tmp = cur->next;
-        xfree(cur);
-        cur = tmp;
+        struct _psh_jobs *job = table->by_id[id];
+        if (job == NULL)
+            continue;
+        /* Finished ones might have had their PIDs reused */
+        if (sighup && (job->status == PSH_JOB_RUNNING ||
+                       job->status == PSH_JOB_STOPPED))
+        {
+            size_t idx;
+            for (idx = 0; idx < job->pid_count; ++idx)
+                if (job->pids[idx])
+                    psh_backend_hup(job->pids[idx]);
+        }
+        if (job->waitfd >= 0)
+            psh_backend_unwatch_child(job->waitfd);
+        xfree(job->name);
+        xfree(job->pids);
+        xfree(job);
     }
-}
\ No newline at end of file
+    psh_hash_free(table->by_pid);
+    psh_hash_free(table->done);
+    xfree(table->done_order);
+    xfree(table->by_id);
+    xfree(table);
+    state->jobs = NULL;
+}
@@ -37,6 +37,7 @@
 #include "command.h"
 #include "filpinfo.h"
 #include "input.h"
+#include "jobs.h"
 #include "libpsh/hash.h"
 #include "libpsh/util.h"
 #include "libpsh/xmalloc.h"
@@ -49,19 +50,32 @@
 
 static void load_shell_vars(psh_state *state)
 {
-    union _psh_vfa_value payload = {psh_backend_getcwd_dm()};
-    psh_vf_set(state, "PWD", PSH_VFA_STRING, payload, 0, 0, 0);
+    char *cwd;
+    union _psh_vfa_value payload;
     psh_vf_unset(state, "OLDPWD", 0);
-    payload.integer = 0;
-    psh_vf_set(state, "?", PSH_VFA_INTEGER, payload, 0, 0, 0);
-    payload.string = psh_strdup(
-        "\\[\\e[01;32m\\]\\u \\D{} "
-        "\\[\\e[01;34m\\]\\w\\[\\e[01;35m\\]\\012\\s-\\V\\[\\e[0m\\]\\$ ");
-    psh_vf_set(state, "PS1", PSH_VFA_STRING, payload, 0, 0, 0);
     /* #5 #12 #14 TODO: Retrieve all env vars,
      * for generic, only try to read those important to shell, such as HOME,
-     * PATH, etc. */
+     * PATH, etc.
+     * Imported first, so that the parameters computed below replace the
+     * inherited ones and the defaults only fill in what is missing */
     psh_backend_get_all_env(state);
+    cwd = psh_backend_getcwd_dm();
+    /* An inherited PWD stays exported */
+    psh_vf_setstr(state, "PWD",
+                  psh_vf_get(state, "PWD", 0, 0) ? 0 : PSH_VFA_STRING, cwd, 0);
+    xfree(cwd);
+    payload.integer = 0;
+    psh_vf_set(state, "?", PSH_VFA_INTEGER, payload, 0, 0, 0);
+    /* Positional parameters aren't kept yet, so there are none */
+    psh_vf_set(state, "#", PSH_VFA_INTEGER, payload, 0, 0, 0);
+    payload.integer = psh_backend_getpid();
+    psh_vf_set(state, "$", PSH_VFA_INTEGER, payload, 0, 0, 0);
+    if (!psh_vf_getstr_special(state, PSH_VF_PS1))
+        psh_vf_setstr(
+            state, "PS1", PSH_VFA_STRING,
+            "\\[\\e[01;32m\\]\\u \\D{} "
+            "\\[\\e[01;34m\\]\\w\\[\\e[01;35m\\]\\012\\s-\\V\\[\\e[0m\\]\\$ ",
+            0);
 }
 
 int main(int argc, char **argv)
@@ -102,13 +116,17 @@ int main(int argc, char **argv)
 #endif
     while (1)
     {
-        expanded_ps1 = ps_expander(state, psh_vf_getstr(state, "PS1"));
+        /* Report background jobs that have finished */
+        psh_backend_reap(state);
+        psh_jobs_notify(state);
+        expanded_ps1 =
+            ps_expander(state, psh_vf_getstr_special(state, PSH_VF_PS1));
         stat = read_cmdline(state, expanded_ps1, &buffer);
         xfree(expanded_ps1);
         if (stat == 1)
         {
             puts("");
-            exit_psh(state, psh_vf_getint(state, "?"));
+            exit_psh(state, psh_vf_get_status(state));
         }
         if (stat < 0)
             continue;
@@ -48,6 +48,7 @@ void exit_psh(psh_state *state, int status)
     xfree(state->argv0);
     psh_vfa_free(state);
     psh_hash_free(state->command_table);
+    psh_hash_free(state->capture_hints);
     psh_jobs_free(state, 1);
     xfree(state);
     exit(status);
@@ -29,7 +29,9 @@ Variables:
 */
 /* Variables, functions and aliases are all managed in this file.
  * The implementation of the scope of functions and variables is like
- * that in other languages: layers of context frames are used.
+ * that in other languages: layers of context frames are used. Rather than
+ * one table per frame, a single table maps each name to a stack of its
+ * bindings, so lookups don't depend on the depth of the frames.
  * One psh extension is local functions.
  */
 #ifdef HAVE_CONFIG_H
@@ -37,11 +39,12 @@ Variables:
 #endif
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "backend.h"
 #include "command.h"
 #include "libpsh/hash.h"
 #include "libpsh/util.h"
@@ -50,6 +53,9 @@ Variables:
 #include "util.h"
 #include "variable.h"
 
+/* Most bindings kept for reuse once their frames are left */
+#define SPARE_BINDINGS_MAX 256
+
 /** Clear a variable container and free() the values.
  *
  * @param state Psh internal state.
@@ -59,6 +65,9 @@ static inline void clear_single_var(psh_state *state,
                                     struct _psh_vfa_container *var)
 {
     unsigned int attributes = var->attributes;
+    if (attributes & PSH_VFA_UNSET)
+        /* Already cleared by psh_vf_unset() */
+        return;
     if (attributes & PSH_VFA_PARSED)
         free_command(var->payload.code);
     else if (attributes & PSH_VFA_ASSOC_ARRAY ||
@@ -73,7 +82,8 @@ static inline void clear_single_var(psh_state *state,
             /* String arrays need another loop */
             char **array = var->payload.string_array;
             while (var->array_size--)
-                xfree(*array++);
+                psh_vfa_str_unref(*array++);
+            xfree(var->payload.string_array);
         }
     }
     else if (!(attributes & PSH_VFA_INTEGER))
@@ -81,56 +91,431 @@ static inline void clear_single_var(psh_state *state,
         if (!(attributes & PSH_VFA_STRING))
             /* No more types exist, this is a mistake */
             code_fault(state, __FILE__, __LINE__);
-        xfree(var->payload.string);
+        if (var->payload.string != var->inline_string)
+            psh_vfa_str_unref(var->payload.string);
     }
     /* else: integers don't need to be free()d */
 }
 
-/** Free a variable hash table.
+/** Header of a shared string.
+ *
+ * @param string The string in a payload.
+ * @return Its header.
+ */
+static inline struct _psh_vfa_string *str_header(char *string)
+{
+    return (struct _psh_vfa_string *)(string -
+                                      offsetof(struct _psh_vfa_string, data));
+}
+
+char *psh_vfa_str_new(const char *str)
+{
+    size_t size = strlen(str) + 1;
+    struct _psh_vfa_string *shared =
+        xmalloc(sizeof(struct _psh_vfa_string) + size);
+    shared->refs = 1;
+    memcpy(shared->data, str, size);
+    return shared->data;
+}
+
+/* Inline strings can't be referred to by another container, so they are
+ * copied. */
+char *psh_vfa_str_share(struct _psh_vfa_container *container)
+{
+    char *string = container->payload.string;
+    if (string == NULL)
+        return NULL;
+    if (string == container->inline_string)
+        return psh_vfa_str_new(string);
+    ++str_header(string)->refs;
+    return string;
+}
+
+void psh_vfa_str_unref(char *string)
+{
+    struct _psh_vfa_string *shared;
+    if (string == NULL)
+        return;
+    shared = str_header(string);
+    if (--shared->refs == 0)
+        xfree(shared);
+}
+
+/** Store a copy of a string to a cleared container, inline if it fits.
+ *
+ * @param container The variable.
+ * @param value The string, can be NULL.
+ */
+static void store_string(struct _psh_vfa_container *container,
+                         const char *value)
+{
+    size_t length;
+    if (value == NULL)
+    {
+        container->payload.string = NULL;
+        return;
+    }
+    length = strlen(value);
+    if (length < PSH_VFA_INLINE)
+    {
+        memcpy(container->inline_string, value, length + 1);
+        container->payload.string = container->inline_string;
+    }
+    else
+        container->payload.string = psh_vfa_str_new(value);
+}
+
+/** Name table of variables or functions.
+ *
+ * @param state Psh internal state.
+ * @param is_func Whether to get the one of functions.
+ * @return The table.
+ */
+static inline psh_hash *name_table(psh_state *state, int is_func)
+{
+    return is_func ? state->function_table : state->variable_table;
+}
+
+/** List of the bindings made in a frame.
+ *
+ * @param state Psh internal state.
+ * @param frame Index of the frame.
+ * @param is_func Whether to get the one of functions.
+ * @return Pointer to the head of the list.
+ */
+static inline struct _psh_vf_binding **frame_list(psh_state *state,
+                                                  size_t frame, int is_func)
+{
+    return is_func ? &state->contexts[frame].functions
+                   : &state->contexts[frame].variables;
+}
+
+/** Slot of a special parameter.
+ *
+ * @param varname Name of the variable.
+ * @return Its index in psh_state::specials, -1 if it has none.
+ */
+static int special_index(const char *varname)
+{
+    /* In the order of enum _psh_vf_special */
+    static const char *const names[PSH_VF_SPECIAL_COUNT] = {
+        "?", "$", "!", "#", "PWD", "PATH", "IFS", "PS1"};
+    int idx;
+    for (idx = 0; idx < PSH_VF_SPECIAL_COUNT; ++idx)
+        if (strcmp(varname, names[idx]) == 0)
+            return idx;
+    return -1;
+}
+
+/** Whether a variable goes to the environment of commands.
+ *
+ * @param attributes Variable attributes.
+ * @return Nonzero if it does.
+ */
+static inline int is_exported(unsigned int attributes)
+{
+    /* Arrays, references, code, and unset ones can't be */
+    return attributes & PSH_VFA_EXPORT &&
+           !(attributes & (PSH_VFA_INDEX_ARRAY | PSH_VFA_ASSOC_ARRAY |
+                           PSH_VFA_REFERENCE | PSH_VFA_PARSED |
+                           PSH_VFA_UNSET));
+}
+
+/** Update the environment after a variable changed, or before it is freed.
+ *
+ * The entry is only formatted again by psh_vf_envp(), so that repeated
+ * assignments cost nothing until a command is run.
+ *
+ * @param state Psh internal state.
+ * @param binding The variable.
+ * @param exported Whether it is exported from now on.
+ */
+static void env_sync(psh_state *state, struct _psh_vf_binding *binding,
+                     int exported)
+{
+    struct _psh_vf_env *env = &state->environment;
+    xfree(binding->env);
+    binding->env = NULL;
+    if (exported && !binding->env_idx)
+    {
+        if (env->count == env->slots)
+        {
+            env->slots = env->slots ? env->slots * 2 : 64;
+            env->bindings = xrealloc(
+                env->bindings, sizeof(struct _psh_vf_binding *) * env->slots);
+        }
+        env->bindings[env->count++] = binding;
+        binding->env_idx = env->count;
+    }
+    else if (!exported && binding->env_idx)
+    {
+        /* Move the last one into its place */
+        struct _psh_vf_binding *last = env->bindings[--env->count];
+        env->bindings[binding->env_idx - 1] = last;
+        last->env_idx = binding->env_idx;
+        binding->env_idx = 0;
+    }
+    else if (!exported)
+    {
+        /* Nothing to do unless it hides or reveals an exported one */
+        struct _psh_vf_binding *below = binding->shadowed;
+        while (below && !below->env_idx)
+            below = below->shadowed;
+        if (!below)
+            return;
+    }
+    env->dirty = 1;
+}
+
+/** Find or create the binding of a name in a frame. Outer frames are rare
+ * targets, so the stack is walked from the top.
+ *
+ * @param state Psh internal state.
+ * @param varname Name of the variable or function.
+ * @param frame Index of the frame.
+ * @param is_func Whether this is a function.
+ * @param created Set to whether the binding is new, with an empty container.
+ * @return The binding.
+ */
+static struct _psh_vf_binding *bind(psh_state *state, const char *varname,
+                                    size_t frame, int is_func, int *created)
+{
+    psh_hash *table = name_table(state, is_func);
+    struct _psh_vf_binding **list = frame_list(state, frame, is_func);
+    struct _psh_vf_binding *binding, *above = NULL,
+                                     *below = psh_hash_get(table, varname);
+    while (below && below->frame > frame)
+    {
+        above = below;
+        below = below->shadowed;
+    }
+    if (below && below->frame == frame)
+    {
+        *created = 0;
+        return below;
+    }
+    *created = 1;
+    if ((binding = state->spare_bindings))
+    {
+        /* Entering and leaving frames shouldn't reach malloc() */
+        state->spare_bindings = binding->frame_next;
+        --state->spare_count;
+        memset(binding, 0, sizeof(struct _psh_vf_binding));
+    }
+    else
+        binding = xcalloc(1, sizeof(struct _psh_vf_binding));
+    if (strlen(varname) < sizeof(binding->inline_name))
+        binding->name = strcpy(binding->inline_name, varname);
+    else
+        binding->name = psh_strdup(varname);
+    binding->frame = frame;
+    binding->special = is_func ? -1 : special_index(varname);
+    binding->shadowed = below;
+    if (above)
+        above->shadowed = binding;
+    else
+    {
+        psh_hash_add_chk(table, varname, binding, 0);
+        if (binding->special >= 0)
+            state->specials[binding->special] = &binding->container;
+    }
+    binding->frame_next = *list;
+    if (*list)
+        (*list)->frame_prev = binding;
+    *list = binding;
+    return binding;
+}
+
+/** Remove a binding from its name's stack and its frame, and free it with
+ * its value.
+ *
+ * @param state Psh internal state.
+ * @param binding The binding.
+ * @param is_func Whether this is a function.
+ */
+static void unbind(psh_state *state, struct _psh_vf_binding *binding,
+                   int is_func)
+{
+    psh_hash *table = name_table(state, is_func);
+    struct _psh_vf_binding *above = psh_hash_get(table, binding->name);
+    if (above == binding)
+    {
+        /* The usual case, the innermost one */
+        if (binding->shadowed)
+            psh_hash_add(table, binding->name, binding->shadowed, 0);
+        else if (binding->frame != 0)
+            /* Keep the entry of locals, as the next call binds them again */
+            psh_hash_add(table, binding->name, NULL, 0);
+        else
+            psh_hash_rm(table, binding->name);
+        if (binding->special >= 0)
+            state->specials[binding->special] =
+                binding->shadowed ? &binding->shadowed->container : NULL;
+    }
+    else
+    {
+        while (above->shadowed != binding)
+            above = above->shadowed;
+        above->shadowed = binding->shadowed;
+    }
+    if (binding->frame_prev)
+        binding->frame_prev->frame_next = binding->frame_next;
+    else
+        *frame_list(state, binding->frame, is_func) = binding->frame_next;
+    if (binding->frame_next)
+        binding->frame_next->frame_prev = binding->frame_prev;
+    if (!is_func)
+        env_sync(state, binding, 0);
+    clear_single_var(state, &binding->container);
+    if (binding->name != binding->inline_name)
+        xfree(binding->name);
+    if (state->spare_count < SPARE_BINDINGS_MAX)
+    {
+        binding->frame_next = state->spare_bindings;
+        state->spare_bindings = binding;
+        ++state->spare_count;
+    }
+    else
+        xfree(binding);
+}
+
+/** Pop all bindings made in a frame.
  *
  * @param state Psh internal state.
- * @param vfa_table The hash table to be free()d.
+ * @param frame Index of the frame.
+ * @param is_func Whether to pop functions instead of variables.
  */
-static inline void free_vf_table(psh_state *state, psh_hash *vfa_table)
+static void unbind_frame(psh_state *state, size_t frame, int is_func)
 {
-    ITER_TABLE(vfa_table, {
-        clear_single_var(state, (struct _psh_vfa_container *)this->value);
-    });
-    psh_hash_free(vfa_table);
+    struct _psh_vf_binding **list = frame_list(state, frame, is_func);
+    while (*list)
+        unbind(state, *list, is_func);
 }
 
-/** Put a variable to the environment.
+/** Create the variable of an inherited entry on its first use.
  *
- * @param attrib Variable attributes.
- * @param payload Variable value.
- * @param varname Variable name.
+ * @param state Psh internal state.
+ * @param varname Name of the variable.
+ * @return Its binding, NULL if no such entry is left.
  */
-static inline void put_to_environ(unsigned int attrib,
-                                  const union _psh_vfa_value payload,
-                                  const char *varname)
+static struct _psh_vf_binding *import(psh_state *state, const char *varname)
+{
+    struct _psh_vf_env *env = &state->environment;
+    struct _psh_vf_binding *binding;
+    const char *entry;
+    int created;
+    if (!env->inherited || !(entry = psh_hash_get(env->inherited, varname)))
+        return NULL;
+    psh_hash_rm(env->inherited, varname);
+    --env->inherited_count;
+    /* Always new, inherited names are dropped before binding in frame 0 */
+    binding = bind(state, varname, 0, 0, &created);
+    binding->container.attributes = PSH_VFA_EXPORT | PSH_VFA_STRING;
+    store_string(&binding->container, strchr(entry, '=') + 1);
+    env_sync(state, binding, 1);
+    return binding;
+}
+
+/* Index ENTRY by its name. Names already set by the shell are exported with
+ * their value, and special parameters are imported right away since their
+ * slots are read directly. */
+void psh_vf_inherit(psh_state *state, const char *entry)
 {
-    if (attrib & PSH_VFA_INTEGER)
+    struct _psh_vf_env *env = &state->environment;
+    struct _psh_vf_binding *binding;
+    const char *equal = strchr(entry, '=');
+    char *varname;
+    if (!equal)
+        return;
+    varname = xmalloc(equal - entry + 1);
+    memcpy(varname, entry, equal - entry);
+    varname[equal - entry] = 0;
+    if ((binding = psh_hash_get(state->variable_table, varname)))
     {
-        int negative = payload.integer < 0;
-        intmax_t a = negative ? -payload.integer : payload.integer;
-        size_t length = negative ? 3 : 2; /* With '\0' and negative sign */
-        char *str;
-        while ((a /= 10) != 0)
-            length += 1;
-        str = xmalloc(length);
-        snprintf(str, length, "%" PRIdMAX, payload.integer);
-        psh_backend_setenv(varname, str, 1);
-        xfree(str);
+        binding->container.attributes |= PSH_VFA_EXPORT;
+        env_sync(state, binding, is_exported(binding->container.attributes));
     }
-    else if (attrib & 0xc0a)
-        /* Arrays, references, code, or unset */
-        ;
     else
-        psh_backend_setenv(varname, payload.string, 1);
+    {
+        if (!env->inherited)
+            env->inherited = psh_hash_create(64);
+        if (!psh_hash_get(env->inherited, varname))
+            ++env->inherited_count;
+        psh_hash_add_chk(env->inherited, varname, (void *)entry, 0);
+        env->dirty = 1;
+        if (special_index(varname) >= 0)
+            import(state, varname);
+    }
+    xfree(varname);
+}
+
+/** Whether an exported variable is the one of its name to be passed on,
+ * i.e. the innermost binding. A local one that is unset or not exported
+ * hides the name from commands.
+ *
+ * @param state Psh internal state.
+ * @param binding The variable.
+ * @return Nonzero if it is.
+ */
+static int env_visible(psh_state *state, struct _psh_vf_binding *binding)
+{
+    return psh_hash_get(state->variable_table, binding->name) == binding;
+}
+
+/* Rebuild the pointer array if anything changed, formatting only the entries
+ * dropped by env_sync(). */
+char **psh_vf_envp(psh_state *state)
+{
+    struct _psh_vf_env *env = &state->environment;
+    size_t idx, used = 0;
+    if (!env->envp)
+        env->envp = xcalloc(1, sizeof(char *));
+    if (!env->dirty)
+        return env->envp;
+    env->envp =
+        xrealloc(env->envp, sizeof(char *) *
+                                (env->count + env->inherited_count + 1));
+    /* Untouched inherited entries are passed on from the original block */
+    if (env->inherited)
+        ITER_TABLE(env->inherited, env->envp[used++] = this->value;);
+    for (idx = 0; idx < env->count; ++idx)
+    {
+        struct _psh_vf_binding *binding = env->bindings[idx];
+        const struct _psh_vfa_container *container = &binding->container;
+        if (!env_visible(state, binding))
+            continue;
+        if (!binding->env)
+        {
+            size_t length;
+            if (container->attributes & PSH_VFA_INTEGER)
+            {
+                length = snprintf(NULL, 0, "%s=%" PRIdMAX, binding->name,
+                                  container->payload.integer);
+                binding->env = xmalloc(length + 1);
+                snprintf(binding->env, length + 1, "%s=%" PRIdMAX,
+                         binding->name, container->payload.integer);
+            }
+            else
+            {
+                const char *value =
+                    container->payload.string ? container->payload.string
+                                              : "";
+                length = strlen(binding->name) + strlen(value) + 2;
+                binding->env = xmalloc(length);
+                snprintf(binding->env, length, "%s=%s", binding->name, value);
+            }
+        }
+        env->envp[used++] = binding->env;
+    }
+    env->envp[used] = NULL;
+    env->dirty = 0;
+    return env->envp;
 }
 
 /* Increment internal frame counter, allocate more if needed.
- * Initialize variable, function, and alias tables. */
+ * Initialize the name and alias tables with the first frame. Frames are
+ * never freed, so entering one allocates nothing once the array is large
+ * enough, and locals reuse the bindings in state->spare_bindings. */
 void psh_vfa_new_context(psh_state *state)
 {
     if (state->contexts == NULL)
@@ -139,48 +524,88 @@ void psh_vfa_new_context(psh_state *state)
         state->contexts = xmalloc(sizeof(struct _psh_vf_context) * 4);
         state->context_slots = 4;
         state->alias_table = psh_hash_create(32);
+        state->variable_table = psh_hash_create(64);
+        state->function_table = psh_hash_create(16);
     }
-    else if (++state->context_idx == state->context_slots + 1)
+    else if (++state->context_idx == state->context_slots)
     {
         state->context_slots *= 2;
         state->contexts =
             xrealloc(state->contexts,
                      sizeof(struct _psh_vf_context) * (state->context_slots));
     }
-    state->contexts[state->context_idx].variable_table = psh_hash_create(32);
-    state->contexts[state->context_idx].function_table = psh_hash_create(8);
+    state->contexts[state->context_idx].variables = NULL;
+    state->contexts[state->context_idx].functions = NULL;
 }
 
-/* Set or update a variable or function, if updating, the original string is
- * free()d if needed. Therefore, for each variable, a new string should be
- * duplicated, even if it is a copy. XXX: COW. When the variable tables are
- * destroyed, the payloads and the pointers in the payload are free()d. if
- * is_local is 1, the variable is created/updated in the current context frame,
- * otherwise, it is set in the outmost context frame or updated in the innermost
- * frame in which this variable is found.
+/** Find the container a value is to be stored to, creating it if needed, and
+ * clear its old value.
+ *
+ * @param state Psh internal state.
+ * @param varname Name of the variable or function.
+ * @param attrib Variable attributes, 0 to keep the old ones.
+ * @param is_local Whether to treat as local variable.
+ * @param is_func Whether this is a function.
+ * @return The container, with the new attributes.
  */
-int psh_vf_set(psh_state *state, const char *varname, unsigned int attrib,
-               const union _psh_vfa_value payload, size_t array_size,
-               int is_local, int is_func)
+static struct _psh_vfa_container *target(psh_state *state, const char *varname,
+                                         unsigned int attrib, int is_local,
+                                         int is_func)
 {
-    struct _psh_vfa_container *container = NULL;
-    if (is_local && !(attrib & PSH_VFA_EXPORT))
-        container = psh_vf_get(state, varname, 1, is_func);
+    int force_local = is_local && !(attrib & PSH_VFA_EXPORT);
+    struct _psh_vfa_container *container =
+        psh_vf_get(state, varname, force_local, is_func);
+    if (container)
+        /* Replace original content. */
+        clear_single_var(state, container);
     else
-        container = psh_vf_get(state, varname, 0, is_func);
-    /* Put to environ if export */
-    if (attrib & PSH_VFA_EXPORT)
-        put_to_environ(attrib, payload, varname);
-    if (!container)
+    {
         /* Such a variable doesn't exist, create new. */
-        return psh_vf_add_raw(state, varname, attrib, payload, array_size,
-                              is_local, is_func);
-    /* Replace original content. */
-    clear_single_var(state, container);
-    container->payload = payload;
+        int created;
+        if (!attrib)
+            /* New variables must have attrib */
+            code_fault(state, __FILE__, __LINE__);
+        container = &bind(state, varname, force_local ? state->context_idx : 0,
+                          is_func, &created)
+                         ->container;
+    }
     if (attrib)
         container->attributes = attrib;
+    return container;
+}
+
+/* Set or update a variable or function, if updating, the original value is
+ * released. Strings in PAYLOAD are owned by the variable afterwards, and
+ * shared with others only through psh_vfa_str_share(). if is_local is 1, the
+ * variable is created/updated in the current context frame, otherwise, it is
+ * set in the outmost context frame or updated in the innermost frame in which
+ * this variable is found.
+ */
+int psh_vf_set(psh_state *state, const char *varname, unsigned int attrib,
+               const union _psh_vfa_value payload, size_t array_size,
+               int is_local, int is_func)
+{
+    struct _psh_vfa_container *container =
+        target(state, varname, attrib, is_local, is_func);
+    container->payload = payload;
     container->array_size = array_size;
+    if (!is_func)
+        /* The container is the first member of its binding */
+        env_sync(state, (struct _psh_vf_binding *)container,
+                 is_exported(container->attributes));
+    return 0;
+}
+
+/* Like psh_vf_set(), but copying VALUE, inline if it is short. */
+int psh_vf_setstr(psh_state *state, const char *varname, unsigned int attrib,
+                  const char *value, int is_local)
+{
+    struct _psh_vfa_container *container =
+        target(state, varname, attrib, is_local, 0);
+    store_string(container, value);
+    container->array_size = 0;
+    env_sync(state, (struct _psh_vf_binding *)container,
+             is_exported(container->attributes));
     return 0;
 }
 
@@ -189,22 +614,26 @@ int psh_vf_add_raw(psh_state *state, const char *varname, unsigned int attrib,
                    const union _psh_vfa_value payload, size_t array_size,
                    int is_local, int is_func)
 {
-    struct _psh_vfa_container *container =
-        xmalloc(sizeof(struct _psh_vfa_container));
-    container->attributes = attrib;
-    container->payload = payload;
-    container->array_size = array_size;
+    struct _psh_vf_binding *binding;
+    int created;
     if (!attrib)
         /* New variables must have attrib */
         code_fault(state, __FILE__, __LINE__);
-    if (is_local && !(attrib & PSH_VFA_EXPORT))
-        return psh_hash_add(
-            (is_func ? state->contexts[state->context_idx].function_table
-                     : state->contexts[state->context_idx].variable_table),
-            varname, container, 1);
-    return psh_hash_add((is_func ? state->contexts[0].function_table
-                                 : state->contexts[0].variable_table),
-                        varname, container, 1);
+    if (!is_func)
+        /* Its inherited entry mustn't be passed on besides the new one */
+        import(state, varname);
+    binding = bind(state, varname,
+                   is_local && !(attrib & PSH_VFA_EXPORT) ? state->context_idx
+                                                          : 0,
+                   is_func, &created);
+    if (!created)
+        clear_single_var(state, &binding->container);
+    binding->container.attributes = attrib;
+    binding->container.payload = payload;
+    binding->container.array_size = array_size;
+    if (!is_func)
+        env_sync(state, binding, is_exported(attrib));
+    return 0;
 }
 
 /* Get the reference to a variable or a function. Returned value should never be
@@ -213,23 +642,15 @@ int psh_vf_add_raw(psh_state *state, const char *varname, unsigned int attrib,
 struct _psh_vfa_container *psh_vf_get(psh_state *state, const char *varname,
                                       int force_local, int is_func)
 {
-    struct _psh_vfa_container *container;
-    size_t ctx_idx_searching = state->context_idx + 1;
-    if (force_local)
-        return psh_hash_get(
-            (is_func ? state->contexts[state->context_idx].function_table
-                     : state->contexts[state->context_idx].variable_table),
-            varname);
-    do
-    {
-        --ctx_idx_searching;
-        if ((container = psh_hash_get(
-                 (is_func ? state->contexts[ctx_idx_searching].function_table
-                          : state->contexts[ctx_idx_searching].variable_table),
-                 varname)))
-            return container;
-    } while (ctx_idx_searching);
-    return NULL;
+    /* The innermost binding, whatever the depth */
+    struct _psh_vf_binding *binding =
+        psh_hash_get(name_table(state, is_func), varname);
+    if (binding == NULL && !is_func)
+        binding = import(state, varname);
+    if (binding == NULL ||
+        (force_local && binding->frame != state->context_idx))
+        return NULL;
+    return &binding->container;
 }
 
 /* Clear all variables and functions local to this scope. */
@@ -238,47 +659,38 @@ void psh_vf_exit_local(psh_state *state)
     if (state->context_idx == 0)
         /* Exiting the root context is not expected to happen. */
         code_fault(state, __FILE__, __LINE__);
-    free_vf_table(state, state->contexts[state->context_idx].variable_table);
-    free_vf_table(state, state->contexts[state->context_idx--].function_table);
+    unbind_frame(state, state->context_idx, 0);
+    unbind_frame(state, state->context_idx--, 1);
 }
 
 /* Unset a variable. Removes only the innermost entry. Returns 0 if something is
  * removed, 1 if not found. */
 int psh_vf_unset(psh_state *state, const char *varname, int is_func)
 {
-    struct _psh_vfa_container *container = NULL;
-    size_t ctx_idx_searching = state->context_idx + 1;
-    do
+    struct _psh_vf_binding *binding =
+        psh_hash_get(name_table(state, is_func), varname);
+    struct _psh_vf_env *env = &state->environment;
+    if (binding == NULL)
     {
-        --ctx_idx_searching;
-        if ((container = psh_hash_get(
-                 (is_func ? state->contexts[ctx_idx_searching].function_table
-                          : state->contexts[ctx_idx_searching].variable_table),
-                 varname)))
-        {
-            int attrib = container->attributes;
-            if (attrib & PSH_VFA_EXPORT && !(attrib & 0xc0a))
-                /* Don't touch arrays, references, code, or unset */
-                psh_backend_setenv(varname, NULL, 1);
-            if (ctx_idx_searching != 0)
-            {
-                /* Removing a local variable */
-                clear_single_var(state, container);
-                container->attributes |= PSH_VFA_UNSET;
-            }
-            else
-            {
-                clear_single_var(state, container);
-                psh_hash_rm(
-                    (is_func
-                         ? state->contexts[ctx_idx_searching].function_table
-                         : state->contexts[ctx_idx_searching].variable_table),
-                    varname);
-            }
-            return 0;
-        }
-    } while (ctx_idx_searching);
-    return 1;
+        if (is_func || !env->inherited ||
+            psh_hash_rm(env->inherited, varname) != 0)
+            return 1;
+        /* Never used, just stop passing it on */
+        --env->inherited_count;
+        env->dirty = 1;
+        return 0;
+    }
+    if (binding->frame != 0)
+    {
+        /* Removing a local variable, which hides the outer ones */
+        clear_single_var(state, &binding->container);
+        binding->container.attributes |= PSH_VFA_UNSET;
+        if (!is_func)
+            env_sync(state, binding, 0);
+    }
+    else
+        unbind(state, binding, is_func);
+    return 0;
 }
 
 /* Called upon shell exit, destroy the whole variable database */
@@ -286,8 +698,20 @@ void psh_vfa_free(psh_state *state)
 {
     while (state->context_idx)
         psh_vf_exit_local(state);
-    free_vf_table(state, state->contexts[0].variable_table);
-    free_vf_table(state, state->contexts[0].function_table);
+    unbind_frame(state, 0, 0);
+    unbind_frame(state, 0, 1);
+    while (state->spare_bindings)
+    {
+        struct _psh_vf_binding *next = state->spare_bindings->frame_next;
+        xfree(state->spare_bindings);
+        state->spare_bindings = next;
+    }
+    state->spare_count = 0;
+    psh_hash_free(state->variable_table);
+    psh_hash_free(state->function_table);
+    psh_hash_free(state->environment.inherited);
+    xfree(state->environment.bindings);
+    xfree(state->environment.envp);
     xfree(state->contexts);
     psh_hash_free(state->alias_table);
 }
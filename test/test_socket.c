@@ -0,0 +1,95 @@
+/* Test for psh_posix_open_socket against loopback listeners
+ * do `gcc -Wall -Wextra -Ibuild -Iinclude -Isrc/backends/posix2
+ * -DHAVE_CONFIG_H -g -fsanitize=address test/test_socket.c
+ * src/backends/posix2/socket.c src/variable.c src/command.c lib/hash.c
+ * lib/hasher.c lib/util.c lib/xmalloc.c -lreadline`
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "posix2.h"
+#include "psh.h"
+#include "util.h"
+#include "variable.h"
+
+/* Not needed by the code under test */
+void code_fault(psh_state *state, char *file, int line)
+{
+    (void)state;
+    printf("fault at %s:%d\n", file, line);
+    abort();
+}
+
+void psh_backend_close_fd(int fd) { close(fd); }
+
+/* Send through FD and receive on the accepted end of LISTENER */
+static void check(const char *what, int fd, int listener)
+{
+    char buffer[8] = {0};
+    int peer;
+    if (fd < 0)
+    {
+        printf("%s: not connected\n", what);
+        return;
+    }
+    peer = accept(listener, NULL, NULL);
+    write(fd, "hello", 5);
+    read(peer, buffer, sizeof(buffer) - 1);
+    printf("%s: got %s, expecting hello\n", what, buffer);
+    close(peer);
+    close(fd);
+}
+
+int main(void)
+{
+    psh_state *state = calloc(1, sizeof(psh_state));
+    struct sockaddr_in in_addr;
+    struct sockaddr_un un_addr;
+    socklen_t length = sizeof(in_addr);
+    char path[128];
+    int listener;
+
+    state->argv0 = "test_socket";
+    psh_vfa_new_context(state);
+    printf("plain file: %d, expecting -2\n",
+           psh_posix_open_socket(state, "/dev/null"));
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&in_addr, 0, sizeof(in_addr));
+    in_addr.sin_family = AF_INET;
+    in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener, (struct sockaddr *)&in_addr, sizeof(in_addr));
+    listen(listener, 1);
+    getsockname(listener, (struct sockaddr *)&in_addr, &length);
+    snprintf(path, sizeof(path), "/dev/tcp/127.0.0.1/%d",
+             ntohs(in_addr.sin_port));
+    check("tcp", psh_posix_open_socket(state, path), listener);
+    close(listener);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&un_addr, 0, sizeof(un_addr));
+    un_addr.sun_family = AF_UNIX;
+    snprintf(un_addr.sun_path, sizeof(un_addr.sun_path),
+             "/tmp/psh-test-socket-%d", (int)getpid());
+    bind(listener, (struct sockaddr *)&un_addr, sizeof(un_addr));
+    listen(listener, 1);
+    snprintf(path, sizeof(path), "/dev/unix%s", un_addr.sun_path);
+    check("unix", psh_posix_open_socket(state, path), listener);
+    close(listener);
+    unlink(un_addr.sun_path);
+
+    /* Nothing listens on a closed port */
+    printf("refused: %d, expecting -1\n",
+           psh_posix_open_socket(state, "/dev/tcp/127.0.0.1/1"));
+
+    psh_vfa_free(state);
+    free(state);
+    return 0;
+}
@@ -0,0 +1,26 @@
+/* Test for psh_split_field
+ * do `gcc -Wall -Wextra -I. -g -fsanitize=address
+ * libpsh/test_split_field.c libpsh/util.c libpsh/xmalloc.c`
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "libpsh/util.h"
+
+int main(void)
+{
+    char buffer[] = "  abc def\t\n:ghi::jkl  \n";
+    char *intended[] = {"abc", "def", "ghi", "", "jkl"};
+    char *cursor = buffer, *field;
+    size_t count = 0;
+    while ((field = psh_split_field(&cursor, " \t\n:")))
+    {
+        printf("%zu: `%s': %s\n", count, field,
+               count < 5 && strcmp(field, intended[count]) == 0
+                   ? "matches"
+                   : "doesn't match");
+        ++count;
+    }
+    printf("%zu fields: %s\n", count, count == 5 ? "matches" : "doesn't match");
+    return 0;
+}